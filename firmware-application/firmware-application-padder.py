@@ -1,18 +1,20 @@
 # --- Constants ---
 # Define constants using descriptive uppercase names
-# The size is in bytes, so a comment clarifies the hexadecimal value (16 KB)
-APPLICATION_SIZE_BYTES = 0xC000  # 48 KB
+# The size is in bytes, so a comment clarifies the hexadecimal value (48 KB)
+APPLICATION_SIZE_BYTES = 0xC000  # 48 KB, upper limit only, the image is no longer padded up to it
+APPLICATION_ALIGNMENT_BYTES = 4  # The bootloader takes whole 32-bit words
 APPLICATION_FILE_NAME = "firmware-application.bin"
 
-def pad_application_file(file_path: str, target_size: int, pad_byte: int = 0xFF):
+def pad_application_file(file_path: str, max_size: int, alignment: int = APPLICATION_ALIGNMENT_BYTES, pad_byte: int = 0xFF):
     """
-    Pads a binary file to a specific target size by appending a padding byte.
-    The file is read, padding is calculated, and the file is overwritten
-    with the original content plus the padding.
+    Pads a binary file up to the next multiple of the alignment by appending a padding byte.
+    The bootloader finishes as soon as it has received the announced length, so the image
+    is kept at its real size instead of being padded out to the whole application region.
 
     Args:
         file_path (str): The path to the binary file to pad.
-        target_size (int): The desired final size of the file in bytes.
+        max_size (int): The size of the application region in bytes, only used as a sanity check.
+        alignment (int): The file size is rounded up to a multiple of this (default is 4).
         pad_byte (int): The byte value to use for padding (default is 0xFF).
     """
     try:
@@ -22,26 +24,23 @@ def pad_application_file(file_path: str, target_size: int, pad_byte: int = 0xFF)
 
         current_size = len(raw_data)
 
-        # Check if padding is necessary
-        if current_size >= target_size:
-            print(f"File '{file_path}' is already {current_size} bytes.")
-            if current_size > target_size:
-                print(f"Warning: File size exceeds target size of {target_size} bytes. No padding applied.")
+        if current_size > max_size:
+            print(f"Warning: File size {current_size} bytes exceeds the application region of {max_size} bytes.")
             return
 
-        if current_size % 4 == 0:
-            print(f"File current size is '{current_size}', which is already able to be divided by 4 with no remainder.")
-            # print(f"File '{file_path}' is already able to be divided by 4 with no remainder.")
+        # Check if padding is necessary
+        if current_size % alignment == 0:
+            print(f"File '{file_path}' is {current_size} bytes, already a multiple of {alignment}.")
             return
 
         # Calculate padding and generate padding bytes
-        bytes_to_pad = current_size % 4
+        bytes_to_pad = alignment - (current_size % alignment)
         
         # Use a simpler way to generate a sequence of repeated bytes
         padding = bytes([pad_byte]) * bytes_to_pad
         
         # Overwrite the file with original data + padding
-        print(f"Padding '{file_path}' from {current_size} bytes to {target_size} bytes (+{bytes_to_pad} bytes).")
+        print(f"Padding '{file_path}' from {current_size} bytes to {current_size + bytes_to_pad} bytes (+{bytes_to_pad} bytes).")
         with open(file_path, "wb") as f:
             f.write(raw_data + padding)
             
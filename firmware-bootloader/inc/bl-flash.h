@@ -18,7 +18,53 @@ typedef struct {
     uint32_t NbPages;     /*!< NbPages: Number of pages to be erased. This parameter must be a value between 1 and (max number of pages - value of Initial page)*/
 } FLASH_EraseInitTypeDef;
 
-uint32_t BL_FLASH_ERASE_Main_Application(void);
+typedef struct {
+    uint32_t pages_erased;  /*!< Pages actually erased by the last BL_FLASH_ERASE_Main_Application call, or by the
+                                 writer since the last BL_FLASH_WRITE_Begin erasing as it goes */
+    uint32_t pages_skipped; /*!< Pages left alone because they already read as erased */
+} bl_flash_erase_stats_t;
+
+// Describes the application image in data EEPROM, written only once the whole image has been received and checked
+#define BL_IMAGE_DESCRIPTOR_MAGIC (0xB007C0DEU)
+
+typedef struct {
+    uint32_t magic;  /*!< BL_IMAGE_DESCRIPTOR_MAGIC when the descriptor is valid */
+    uint32_t length; /*!< Image length in bytes from the start of the application */
+    uint32_t crc32;  /*!< CRC-32 of those length bytes */
+} bl_image_descriptor_t;
+
+const bl_image_descriptor_t* BL_FLASH_IMAGE_Get_Descriptor(void);
+HAL_StatusTypeDef BL_FLASH_IMAGE_Write_Descriptor(const bl_image_descriptor_t* descriptor);
+HAL_StatusTypeDef BL_FLASH_IMAGE_Invalidate_Descriptor(void);
+
+// Progress of an update in data EEPROM, right behind the descriptor. Committed while the image is being received so
+// an interrupted transfer can continue from offset instead of starting over
+#define BL_PROGRESS_MAGIC (0xB007F00DU)
+
+typedef struct {
+    uint32_t magic;  /*!< BL_PROGRESS_MAGIC when the record is valid */
+    uint32_t offset; /*!< Bytes from the start of the application that are programmed */
+    uint32_t crc32;  /*!< CRC-32 of those offset bytes */
+} bl_progress_t;
+
+const bl_progress_t* BL_FLASH_PROGRESS_Get(void);
+HAL_StatusTypeDef BL_FLASH_PROGRESS_Commit(uint32_t offset, uint32_t crc32);
+HAL_StatusTypeDef BL_FLASH_PROGRESS_Clear(void);
+
+// Erases just the pages covering offset up to size bytes from the start of the application, returns the number of
+// pages erased. offset is rounded down to a page
+uint32_t BL_FLASH_ERASE_Main_Application(uint32_t offset, uint32_t size, bool skip_blank_pages);
+const bl_flash_erase_stats_t* BL_FLASH_ERASE_Get_Stats(void);
+
+// Buffered writer: data is gathered into 64 byte half-pages and each one is programmed in a single operation.
+// With erase_as_you_go each page is erased (unless already blank) just before its first half-page is programmed,
+// so no up-front erase is needed
+void BL_FLASH_WRITE_Begin(uint32_t address, bool erase_as_you_go);
+HAL_StatusTypeDef BL_FLASH_WRITE_Data(const uint8_t* data, uint32_t length);
+// Leaves the next length bytes of flash as they are and carries on behind them. Only on a half-page boundary with
+// nothing buffered, a page skipped this way is not erased either
+void BL_FLASH_WRITE_Skip(uint32_t length);
+HAL_StatusTypeDef BL_FLASH_WRITE_Flush(void);
 
 uint32_t HAL_FLASH_GetError(void);
 
@@ -31,5 +77,7 @@ HAL_StatusTypeDef HAL_FLASH_Lock(void);
 void FLASH_PageErase(uint32_t PageAddress);
 HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError);
 HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint32_t Data);
+HAL_StatusTypeDef HAL_FLASHEx_HalfPageProgram(uint32_t Address, uint32_t *pBuffer);
+HAL_StatusTypeDef HAL_FLASHEx_DATAEEPROM_Program(uint32_t Address, uint32_t Data);
 
 #endif
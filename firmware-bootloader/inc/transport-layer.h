@@ -3,29 +3,99 @@
 
 #include "common-defines.h"
 
-#define SEGMENT_DATA_SIZE (32) // Up to 32 Bytes
+// Largest payload we accept, one 128 Byte flash page. The host picks any multiple of 4 up to this
+// (64 = half-page, 128 = page), it is advertised in BL_AL_MESSAGE_FW_LENGTH_REQ
+#define SEGMENT_DATA_SIZE (128) // Up to 128 Bytes
 #define SEGMENT_TYPE_SIZE (1) // 1 Byte
+#define SEGMENT_SEQ_SIZE (1) // 1 Byte
 #define SEGMENT_LENGTH_SIZE (1) // 1 Byte
 #define SEGMENT_CRC_SIZE (1) // 1 Byte
-#define SEGMENT_LENGTH (SEGMENT_DATA_SIZE + SEGMENT_LENGTH_SIZE + SEGMENT_CRC_SIZE + SEGMENT_TYPE_SIZE) // Up to 35 Byte
+#define SEGMENT_HEADER_SIZE (SEGMENT_LENGTH_SIZE + SEGMENT_TYPE_SIZE + SEGMENT_SEQ_SIZE) // 3 Byte
+#define SEGMENT_LENGTH (SEGMENT_DATA_SIZE + SEGMENT_HEADER_SIZE + SEGMENT_CRC_SIZE) // Up to 132 Byte
 
+// Only segment_data_size data bytes go on the wire, an ACK/RETX is 4 bytes and a single byte message 5 bytes
+#define SEGMENT_WIRE_LENGTH(data_size) (SEGMENT_HEADER_SIZE + (data_size) + SEGMENT_CRC_SIZE)
+
+// Each segment is sent as one COBS frame: the COBS encoded segment (no 0x00 inside), then TL_FRAME_DELIMITER.
+// A lost, doubled or corrupted byte only breaks the frame it is in, the receiver picks up again at the next delimiter.
+// A segment is always shorter than 254 bytes, so COBS adds exactly one byte.
+#define TL_FRAME_DELIMITER (0x00)
+#define TL_FRAME_OVERHEAD (2) // COBS code byte + delimiter
+#define SEGMENT_FRAME_LENGTH(data_size) (SEGMENT_WIRE_LENGTH(data_size) + TL_FRAME_OVERHEAD) // Up to 134 Byte
+
+// Maximum number of data segments a sender may have in flight without an ACK (power of 2), advertised in
+// BL_AL_MESSAGE_FW_LENGTH_REQ. A build parameter, e.g. -DTL_WINDOW_SIZE=8; the UART RX ring has to hold a window.
+// The receive queue always has room for a full window, so a host that respects it never overruns us.
+#ifndef TL_WINDOW_SIZE
+#define TL_WINDOW_SIZE (4)
+#endif
+// 8 is the largest that fits the L053's 8 KByte RAM: 3 KByte of segment queues and a 2 KByte RX DMA ring
+#if (TL_WINDOW_SIZE < 1) || (TL_WINDOW_SIZE > 8) || (TL_WINDOW_SIZE & (TL_WINDOW_SIZE - 1))
+#error "TL_WINDOW_SIZE must be a power of 2 from 1 to 8"
+#endif
+
+#define SEGMENT_DATA (0x00)
 #define SEGMENT_RETX (0x01)
 #define SEGMENT_ACK (0x02)
+#define SEGMENT_DATA_RLE (0x03) // Firmware data as RLE tokens, see RLE_RUN_FLAG
+#define SEGMENT_BUSY (0x04) // Receive queue full, stop sending until the next RETX
+#define SEGMENT_DATA_DELTA (0x05) // Firmware data as delta tokens against the installed image, see DELTA_COPY
+
+// RLE token: control byte, then either
+//   control & RLE_RUN_FLAG  -> one value byte, repeated (control & 0x7F) + RLE_MIN_RUN times (3..130)
+//   otherwise               -> control + 1 literal bytes (1..128)
+// Tokens never span two segments.
+#define RLE_RUN_FLAG (0x80)
+#define RLE_MIN_RUN (3)
+
+// Delta token: control byte, then by (control & DELTA_TOKEN_MASK)
+//   DELTA_COPY  -> length - 1 low byte, source offset (2 bytes LE): ((control & 0x3F) << 8 | low) + 1 bytes
+//                  (1..16384) from the application region at the source offset
+//   DELTA_RUN   -> one value byte, repeated (control & 0x3F) + RLE_MIN_RUN times (3..66)
+//   otherwise   -> control + 1 literal bytes (1..128), as in RLE
+// The image is rebuilt in place one page at a time and the old contents of the page before the one being built are
+// kept in RAM, so a copy reads the installed image from that previous page on and the new image below it (code that
+// moved by up to a page still copies). Tokens never span two segments.
+#define DELTA_TOKEN_MASK (0xC0)
+#define DELTA_COPY (0xC0)
+#define DELTA_RUN (0x80)
+
+// Data segments carry their own sequence number in segment_seq. For control segments it is:
+//   ACK  - cumulative, the sequence number of the next segment the receiver expects
+//   RETX - the first sequence number the receiver wants re-sent (everything after it follows)
+//   BUSY - the first sequence number the receiver dropped because it had no room, it asks for it with a RETX
+//          as soon as the application has freed a slot
 
 #define BL_AL_MESSAGE_SEQ_OBSERVED (0x20)
 #define BL_AL_MESSAGE_FW_UPDATE_REQ (0x31)
 #define BL_AL_MESSAGE_FW_UPDATE_RES (0x37)
 #define BL_AL_MESSAGE_DEVICE_ID_REQ (0x3C)
 #define BL_AL_MESSAGE_DEVICE_ID_RES (0x3F)
+// [FW_LENGTH_REQ, max payload, window, resume offset (4 bytes LE), CRC-32 of the image up to it (4 bytes LE)],
+// offset 0 when there is no interrupted transfer to continue
 #define BL_AL_MESSAGE_FW_LENGTH_REQ (0x42)
+// [FW_LENGTH_RES, length (4 bytes LE), CRC-32 (4 bytes LE), optional offset to resume from (4 bytes LE),
+//  optional length and CRC-32 of the installed image a delta is made against (4 bytes LE each, offset 0)].
+// Base length 0 is a delta made from PAGE_HASH_RES, against flash as it is
 #define BL_AL_MESSAGE_FW_LENGTH_RES (0x45)
+// [READY_FOR_DATA, offset the first data segment starts at (4 bytes LE), 1 if the delta base matches / 0 if not]
 #define BL_AL_MESSAGE_READY_FOR_DATA (0x48)
 #define BL_AL_MESSAGE_UPDATE_SUCCESSFUL (0x54)
 #define BL_AL_MESSAGE_NACK (0x59)
+#define BL_AL_MESSAGE_BAUD_REQ (0x4B) // [BAUD_REQ, baud rate (4 bytes LE)], optional, only right after sync
+#define BL_AL_MESSAGE_BAUD_RES (0x4E) // [BAUD_RES, 1 = switching / 0 = rejected], sent at the old rate
+#define BL_AL_MESSAGE_BAUD_PROBE (0x51) // [BAUD_PROBE, pattern], first segment at the new rate, echoed back
+// [PAGE_HASH_REQ, first page (2 bytes LE), count], optional, any number of them between FW_LENGTH_REQ and FW_LENGTH_RES
+#define BL_AL_MESSAGE_PAGE_HASH_REQ (0x5C)
+// [PAGE_HASH_RES, first page (2 bytes LE), count, CRC-32 of each 128 byte page of the application (4 bytes LE)],
+// count is cut to PAGE_HASH_MAX_COUNT and to the end of the application region
+#define BL_AL_MESSAGE_PAGE_HASH_RES (0x5F)
+#define PAGE_HASH_MAX_COUNT (30)
 
 typedef struct tl_segment_t {
     uint8_t segment_data_size;
     uint8_t segment_type;
+    uint8_t segment_seq;
     uint8_t data[SEGMENT_DATA_SIZE];
     uint8_t segment_crc;
 } tl_segment_t;
@@ -36,12 +106,23 @@ void TL_Update(void);
 bool tl_segment_available(void);
 void tl_write(tl_segment_t* segment);
 void tl_read(tl_segment_t* segment);
+
+// Zero-copy receive: tl_borrow points into the segment queue (NULL if empty), the segment stays valid
+// and unACKed until tl_release. Only one segment can be borrowed at a time.
+const tl_segment_t* tl_borrow(void);
+void tl_release(void);
+
+// Zero-copy transmit: build the next outgoing segment in its retransmit slot, then tl_write it.
+// tl_write still accepts any other segment and copies it into the slot.
+tl_segment_t* tl_acquire(void);
 uint8_t tl_compute_crc(tl_segment_t* segment);
 bool tl_is_retx_segment(const tl_segment_t* segment);
 bool tl_is_ack_segment(const tl_segment_t* segment);
+bool tl_is_busy_segment(const tl_segment_t* segment);
 bool tl_is_single_byte_segment(const tl_segment_t* segment, const uint8_t byte);
-void tl_create_retx_segment(tl_segment_t* segment);
-void tl_create_ack_segment(tl_segment_t* segment);
+void tl_create_retx_segment(tl_segment_t* segment, uint8_t seq);
+void tl_create_ack_segment(tl_segment_t* segment, uint8_t seq);
+void tl_create_busy_segment(tl_segment_t* segment, uint8_t seq);
 void tl_create_single_byte_segment(tl_segment_t* segment, uint8_t byte);
 
 #endif
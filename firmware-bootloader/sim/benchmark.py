@@ -0,0 +1,470 @@
+#!/usr/bin/env python3
+"""
+End-to-end update benchmark against firmware-bootloader-sim.
+
+Every combination of host, transport mode (UART driver and payload encoding), transport window, baud rate, payload
+size, image size and line impairment runs a complete sync -> device ID -> length -> erase -> data -> verify update on a fresh
+simulator. The host is bl_host.py in this process or the native bl-programmer from firmware-programmer/cli. Each run is one JSON line (or CSV row) with per-phase latency, goodput, retransmit counters,
+recovery time after line faults and the simulator's own statistics, so results can be diffed across commits.
+
+    ./benchmark.py --baud 115200,460800 --payload 64,128 --image-size 4096,32768 --ber 0,1e-5
+    ./benchmark.py --uart dma,irq --encoding raw,rle --drop 0,1e-4 --latency-us 0,2000 --jitter-us 500
+    ./benchmark.py --host python,cli --baud 115200,460800
+    ./benchmark.py --window 1,2,4,8 --baud 115200,921600 --latency-us 0,2000  # after make -C sim windows
+    ./benchmark.py --image-size 49152 --interrupt-at 0.5,0.9 --resume on,off
+    ./benchmark.py --image firmware --image-size 32768 --encoding rle,delta,pages --change-bytes 256,2048 --insert-bytes 0,40
+
+With --interrupt-at the simulated device is reset once that fraction of the image is ACKed (bl_host.py does this
+first attempt), the run then measures the retry on the same flash and EEPROM, resuming or starting over per --resume.
+
+With --change-bytes or --insert-bytes the device runs an installed image and the update is that image with so many
+bytes changed in short stretches, and so many new bytes inserted (moving the rest, the length stays). The delta
+encoding sends only a delta against the installed image, against unrelated flash contents otherwise. The pages
+encoding needs no base: it asks the bootloader for the CRC-32 of each flash page and sends only the pages that differ.
+"""
+
+import argparse
+import csv
+import itertools
+import json
+import os
+import random
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+import bl_host
+
+SIM_FLASH_SIZE = 0x10000
+SIM_EEPROM_SIZE = 0x800
+BOOTLOADER_SIZE = 0x4000
+MAX_FIRMWARE_SIZE = SIM_FLASH_SIZE - BOOTLOADER_SIZE
+
+PHASES = ("sync", "baud", "handshake", "erase", "transfer", "verify")
+
+# Simulator options for the line impairments, in the order of the sweep
+LINK_OPTIONS = ("ber", "drop", "dup", "latency-us", "jitter-us", "baud-drop")
+
+# `make -C sim` builds the DMA driven UART, `make -C sim irq` the interrupt driven one next to it
+SIM_BINARIES = {
+    "dma": lambda sim: sim,
+    "irq": lambda sim: sim + "-irq",
+}
+
+# The transport window is a build parameter, `make -C sim windows` builds the others next to the default one
+DEFAULT_WINDOW = 4
+
+
+def sim_binary(sim, uart, window):
+    binary = SIM_BINARIES[uart](sim)
+    return binary if window == DEFAULT_WINDOW else "%s-w%d" % (binary, window)
+
+
+# bl_host.py in this process, or `make -C ../../firmware-programmer/cli` for the native programmer
+HOSTS = ("python", "cli")
+
+
+class RunTimeout(Exception):
+    pass
+
+
+class Interrupted(Exception):
+    pass
+
+
+def number_list(kind):
+    return lambda text: [kind(value) for value in text.split(",") if value]
+
+
+def str_list(choices):
+    def parse(text):
+        values = [value for value in text.split(",") if value]
+        for value in values:
+            if value not in choices:
+                raise argparse.ArgumentTypeError("%s is not one of %s" % (value, ", ".join(choices)))
+        return values
+    return parse
+
+
+def make_image(size, kind, rng):
+    if kind == "random":
+        return rng.randbytes(size)
+
+    # "firmware": code-like random stretches with zero padding and 0xFF filled tables in between
+    image = bytearray()
+    while len(image) < size:
+        image += rng.randbytes(rng.randint(64, 512))
+        image += bytes([rng.choice((0x00, 0xFF))]) * rng.randint(0, 256)
+    return bytes(image[:size])
+
+
+def make_update(base, change_bytes, insert_bytes, rng):
+    # A field update: stretches of up to 64 changed bytes (constants, fixed functions) and one block of new code
+    # that moves everything behind it
+    image = bytearray(base)
+    changed = 0
+    while changed < change_bytes:
+        length = min(64, change_bytes - changed)
+        at = rng.randrange(len(image) - length + 1)
+        image[at:at + length] = rng.randbytes(length)
+        changed += length
+    if insert_bytes:
+        at = rng.randrange(len(image))
+        image[at:at] = rng.randbytes(insert_bytes)
+        del image[len(base):]
+    return bytes(image)
+
+
+def make_flash_file(path, rng, old_image, installed=None):
+    # Bootloader region and EEPROM blank, the application region holds an old image so pages really get erased
+    flash = bytearray(SIM_FLASH_SIZE + SIM_EEPROM_SIZE)
+    if old_image:
+        flash[BOOTLOADER_SIZE:SIM_FLASH_SIZE] = rng.randbytes(MAX_FIRMWARE_SIZE)
+    if installed:
+        flash[BOOTLOADER_SIZE:BOOTLOADER_SIZE + len(installed)] = installed
+    with open(path, "wb") as file:
+        file.write(flash)
+
+
+def start_sim(args, workdir, uart, window, link, seed):
+    flash_file = os.path.join(workdir, "flash.bin")
+    stats_file = os.path.join(workdir, "stats.json")
+    command = [sim_binary(args.sim, uart, window), "--flash", flash_file, "--stats", stats_file,
+               "--erase-us", str(args.erase_us), "--program-us", str(args.program_us),
+               "--eeprom-us", str(args.eeprom_us), "--link-dir", args.link_dir, "--seed", str(seed), "--match-baud"]
+    for option, value in zip(LINK_OPTIONS, link):
+        command += ["--" + option, str(value)]
+
+    process = subprocess.Popen(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    pty = process.stdout.readline().strip()
+    if not pty:
+        raise RuntimeError("simulator did not start: %s" % process.stderr.read())
+
+    return process, pty, flash_file, stats_file
+
+
+def stop_sim(process, stats_file):
+    if process.poll() is None:
+        process.send_signal(signal.SIGTERM)
+    try:
+        process.wait(timeout=5)
+    except subprocess.TimeoutExpired:
+        process.kill()
+        process.wait()
+
+    try:
+        with open(stats_file) as file:
+            return json.load(file)
+    except (OSError, ValueError):
+        return {}
+
+
+def read_back(flash_file, length):
+    with open(flash_file, "rb") as file:
+        file.seek(BOOTLOADER_SIZE)
+        return file.read(length)
+
+
+def run_python(args, pty, image, encoding, baud_rate, payload_size, resume=True, interrupt_at=0.0, base=None):
+    link = bl_host.Link(pty)
+    bootloader = bl_host.Bootloader(link, timeout=args.message_timeout)
+    outcome = {"ok": False, "error": None, "failed_phase": None}
+
+    def on_progress(acked_bytes, total_bytes):
+        if acked_bytes >= interrupt_at * total_bytes:
+            raise Interrupted("%d of %d bytes ACKed" % (acked_bytes, total_bytes))
+
+    if interrupt_at:
+        bootloader.on_progress = on_progress
+
+    def on_alarm(signum, frame):
+        raise RunTimeout("run took longer than %.0f s" % args.timeout)
+
+    signal.signal(signal.SIGALRM, on_alarm)
+    signal.setitimer(signal.ITIMER_REAL, args.timeout)
+    negotiate = baud_rate != bl_host.DEFAULT_BAUD_RATE
+    start = time.monotonic()
+    try:
+        bootloader.sync()
+        # The simulator paces the pty itself, the speed set on it only has to match the USART's (--match-baud).
+        # A refused rate or a lost probe leaves both ends at the boot rate, the update goes on there
+        if negotiate and not bootloader.negotiate_baud_rate(baud_rate, link.set_baud_rate):
+            negotiate = False
+        outcome["ok"] = bootloader.update(image, rle=(encoding != "raw"), payload_size=payload_size, resume=resume,
+                                          base=base if encoding == "delta" else None, pages=(encoding == "pages"),
+                                          force_window=args.host_window or None)
+        if not outcome["ok"]:
+            outcome["error"] = "NACK"
+    except (bl_host.ProtocolError, TimeoutError, RunTimeout, OSError, Interrupted) as error:
+        outcome["error"] = "%s: %s" % (type(error).__name__, error)
+        negotiate = negotiate and not bootloader.stats["nacks"]  # A retry after a NACK stays at the boot rate
+        outcome["failed_phase"] = next((phase for phase in PHASES if phase not in bootloader.phases
+                                        and not (phase == "baud" and not negotiate)),
+                                       None)
+    finally:
+        signal.setitimer(signal.ITIMER_REAL, 0)
+    outcome["total_s"] = time.monotonic() - start
+    link.close()
+
+    recoveries = bootloader.recoveries
+    outcome["phases_s"] = dict(bootloader.phases)
+    outcome["host"] = dict(bootloader.stats)
+    outcome["recovery"] = {"count": len(recoveries), "total_s": sum(recoveries), "max_s": max(recoveries, default=0.0)}
+    return outcome
+
+
+def run_cli(args, pty, workdir, image, encoding, baud_rate, payload_size, resume=True, base=None):
+    image_file = os.path.join(workdir, "image.bin")
+    base_file = os.path.join(workdir, "base.bin")
+    stats_file = os.path.join(workdir, "programmer.json")
+    with open(image_file, "wb") as file:
+        file.write(image)
+    with open(base_file, "wb") as file:
+        file.write(base or b"")
+
+    command = [args.programmer, "--port", pty, "--payload", str(payload_size), "--stats", stats_file,
+               "--timeout-ms", str(int(args.message_timeout * 1000)), "--quiet", image_file]
+    if baud_rate != bl_host.DEFAULT_BAUD_RATE:
+        command += ["--baud", str(baud_rate)]
+    if encoding != "raw":
+        command.append("--rle")
+    if encoding == "delta":
+        command += ["--base", base_file]
+    if encoding == "pages":
+        command.append("--pages")
+    if not resume:
+        command.append("--no-resume")
+    if args.host_window:
+        command += ["--force-window", str(args.host_window)]
+
+    start = time.monotonic()
+    try:
+        subprocess.run(command, timeout=args.timeout, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+        with open(stats_file) as file:
+            outcome = json.load(file)
+    except subprocess.TimeoutExpired:
+        outcome = {"ok": False, "error": "RunTimeout: run took longer than %.0f s" % args.timeout}
+    except (OSError, ValueError) as error:
+        outcome = {"ok": False, "error": "%s: %s" % (type(error).__name__, error)}
+    outcome["total_s"] = outcome.get("total_s", time.monotonic() - start)
+
+    if outcome.get("error") == "nack":
+        outcome["error"] = "NACK"
+    outcome.setdefault("failed_phase", None if outcome["ok"] else "sync")
+    outcome["phases_s"] = {name: value for name, value in outcome.get("phases_s", {}).items() if value is not None}
+    outcome.setdefault("host", {})
+    outcome.setdefault("recovery", {"count": 0, "total_s": 0.0, "max_s": 0.0})
+    return outcome
+
+
+def run_once(args, mode, window, baud_rate, payload_size, image_size, link, interruption, change, repeat):
+    programmer, uart, encoding = mode
+    interrupt_at, resume = interruption
+    change_bytes, insert_bytes = change
+    seed = args.seed + repeat
+    rng = random.Random(seed)
+    image = make_image(image_size, args.image, rng)
+    installed = None
+    if change_bytes or insert_bytes:
+        installed, image = image, make_update(image, change_bytes, insert_bytes, rng)
+
+    result = {
+        "programmer": programmer,
+        "uart": uart,
+        "encoding": encoding,
+        "window": window,
+        "baud_rate": baud_rate,
+        "payload_size": payload_size,
+        "image_size": image_size,
+        "image": args.image,
+        "repeat": repeat,
+        "erase_us": args.erase_us,
+        "program_us": args.program_us,
+        "link_dir": args.link_dir,
+        "host_window": args.host_window,
+        "interrupt_at": interrupt_at,
+        "resume": resume,
+        "change_bytes": change_bytes,
+        "insert_bytes": insert_bytes,
+    }
+    result.update({option.replace("-", "_"): value for option, value in zip(LINK_OPTIONS, link)})
+
+    with tempfile.TemporaryDirectory(prefix="bl-bench-") as workdir:
+        make_flash_file(os.path.join(workdir, "flash.bin"), rng, not args.blank, installed)
+        process, pty, flash_file, stats_file = start_sim(args, workdir, uart, window, link, seed)
+        # A delta is made against what the device runs, without an installed image that is whatever flash holds
+        base = installed or read_back(flash_file, image_size)
+
+        if interrupt_at:
+            # Simulator exit saves flash and EEPROM like a reset keeps them, the retry starts on a fresh instance
+            interrupted = run_python(args, pty, image, encoding, baud_rate, payload_size, interrupt_at=interrupt_at)
+            stop_sim(process, stats_file)
+            process, pty, flash_file, stats_file = start_sim(args, workdir, uart, window, link, seed + 1)
+            result["interrupted_s"] = round(interrupted["total_s"], 4)
+
+        if programmer == "cli":
+            outcome = run_cli(args, pty, workdir, image, encoding, baud_rate, payload_size, resume == "on", base)
+        else:
+            outcome = run_python(args, pty, image, encoding, baud_rate, payload_size, resume == "on", base=base)
+
+        sim_stats = stop_sim(process, stats_file)
+        if outcome["ok"] and read_back(flash_file, image_size) != image:
+            outcome["ok"] = False
+            outcome["error"] = "flash contents differ from the image"
+        # A host sending past the bootloader's window is the BUSY stress, a run that never saw one did not test it
+        if outcome["ok"] and args.host_window > window and not outcome["host"].get("busy_received"):
+            outcome["ok"] = False
+            outcome["error"] = "no BUSY with a host window of %d against %d" % (args.host_window, window)
+
+    phases = outcome["phases_s"]
+    result["ok"] = outcome["ok"]
+    result["error"] = outcome["error"]
+    result["failed_phase"] = outcome["failed_phase"]
+    result["total_s"] = round(outcome["total_s"], 4)
+    result["phases_s"] = {name: round(phases[name], 4) if name in phases else None for name in PHASES}
+    result["throughput_Bps"] = round(image_size / outcome["total_s"], 1) if result["ok"] else 0.0
+    # Goodput: image bytes per second of the data phase, retransmissions and recovery included. A resumed
+    # transfer only sends what the bootloader did not have yet
+    transfer = phases.get("transfer", 0.0) + phases.get("verify", 0.0)
+    sent = image_size - outcome["host"].get("resume_offset", 0)
+    result["goodput_Bps"] = round(sent / transfer, 1) if result["ok"] and transfer else 0.0
+    result["link_utilisation"] = round(result["goodput_Bps"] * bl_host.BITS_PER_BYTE / baud_rate, 3)
+    recovery = outcome["recovery"]
+    result["recovery_ms"] = {
+        "count": recovery["count"],
+        "mean": round(1000 * recovery["total_s"] / recovery["count"], 2) if recovery["count"] else None,
+        "max": round(1000 * recovery["max_s"], 2) if recovery["count"] else None,
+        "total": round(1000 * recovery["total_s"], 2),
+    }
+    result["host"] = outcome["host"]
+    result["sim"] = sim_stats
+
+    return result
+
+
+def flatten(result, prefix=""):
+    flat = {}
+    for key, value in result.items():
+        if isinstance(value, dict):
+            flat.update(flatten(value, prefix + key + "."))
+        else:
+            flat[prefix + key] = value
+    return flat
+
+
+def print_summary(results, stream):
+    stream.write("%6s %4s %5s %3s %8s %7s %6s %7s %7s %7s %7s %5s %6s %6s %6s %3s %8s %9s %6s %6s %6s %5s %7s\n" % (
+        "host", "uart", "enc", "win", "baud", "payload", "image", "ber", "drop", "dup", "lat_us", "intr", "resume", "change",
+        "insert", "ok", "total_s", "goodput", "wire", "erased", "resent", "retx", "rec_ms"))
+    for result in results:
+        stream.write("%6s %4s %5s %3d %8d %7d %6d %7g %7g %7g %7d %5g %6s %6d %6d %3s %8.3f %9.1f %6d %6d %6d %5d %7.1f\n" % (
+            result["programmer"], result["uart"], result["encoding"], result["window"], result["baud_rate"], result["payload_size"], result["image_size"],
+            result["ber"], result["drop"], result["dup"], result["latency_us"], result["interrupt_at"],
+            result["host"].get("resume_offset", 0) if result["resume"] == "on" else "off", result["change_bytes"],
+            result["insert_bytes"], "yes" if result["ok"] else "NO", result["total_s"],
+            result["goodput_Bps"], result["host"].get("wire_payload_bytes", 0), result["sim"].get("pages_erased", 0),
+            result["host"].get("segments_resent", 0), result["host"].get("retx_received", 0),
+            result["recovery_ms"]["mean"] or 0.0))
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--sim", default=os.path.join(here, "firmware-bootloader-sim"))
+    parser.add_argument("--programmer", default=os.path.join(here, "..", "..", "firmware-programmer", "cli",
+                                                             "bl-programmer"))
+    parser.add_argument("--host", type=str_list(HOSTS), default=["python"], help="python, cli")
+    parser.add_argument("--window", type=number_list(int), default=[DEFAULT_WINDOW],
+                        help="transport window the simulator is built with, the hosts use what it advertises")
+    parser.add_argument("--host-window", type=int, default=0,
+                        help="segments the host sends ahead whatever the bootloader advertises, 0 for its window. "
+                             "Past it the bootloader has to answer with BUSY")
+    parser.add_argument("--baud", type=number_list(int), default=[115200])
+    parser.add_argument("--payload", type=number_list(int), default=[128])
+    parser.add_argument("--image-size", type=number_list(int), default=[16384])
+    parser.add_argument("--uart", type=str_list(SIM_BINARIES), default=["dma"], help="dma, irq")
+    parser.add_argument("--encoding", type=str_list(("raw", "rle", "delta", "pages")), default=["raw"],
+                        help="raw, rle, delta, pages")
+    parser.add_argument("--ber", type=number_list(float), default=[0.0], help="bit-error rate")
+    parser.add_argument("--drop", type=number_list(float), default=[0.0], help="probability of losing a byte")
+    parser.add_argument("--dup", type=number_list(float), default=[0.0], help="probability of doubling a byte")
+    parser.add_argument("--latency-us", type=number_list(int), default=[0])
+    parser.add_argument("--jitter-us", type=number_list(int), default=[0])
+    parser.add_argument("--baud-drop", type=number_list(int), default=[0],
+                        help="lose every frame to the device from the Nth at the negotiated rate, 0 for none: 1 is "
+                             "BAUD_PROBE, 3 the first request after its echo, both fall back to the boot rate")
+    parser.add_argument("--link-dir", choices=("both", "to-device", "to-host"), default="both",
+                        help="which direction the impairments apply to")
+    parser.add_argument("--image", choices=("random", "firmware"), default="random", help="image contents")
+    parser.add_argument("--blank", action="store_true", help="start from blank flash instead of an old image")
+    parser.add_argument("--interrupt-at", type=number_list(float), default=[0.0],
+                        help="reset the device once this fraction of the image is ACKed, then measure the retry")
+    parser.add_argument("--resume", type=str_list(("on", "off")), default=["on"],
+                        help="on: the retry continues an interrupted transfer, off: it starts over")
+    parser.add_argument("--change-bytes", type=number_list(int), default=[0],
+                        help="update an installed image with this many bytes changed")
+    parser.add_argument("--insert-bytes", type=number_list(int), default=[0],
+                        help="update an installed image with this many bytes of new code moving the rest")
+    parser.add_argument("--repeat", type=int, default=1)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--erase-us", type=int, default=3200)
+    parser.add_argument("--program-us", type=int, default=3200)
+    parser.add_argument("--eeprom-us", type=int, default=3200)
+    parser.add_argument("--timeout", type=float, default=120.0, help="give up on a run after this many seconds")
+    parser.add_argument("--message-timeout", type=float, default=2.0)
+    parser.add_argument("--format", choices=("jsonl", "csv"), default="jsonl")
+    parser.add_argument("--output", help="write results here instead of stdout")
+    args = parser.parse_args()
+
+    for uart, window in itertools.product(args.uart, args.window):
+        if not os.access(sim_binary(args.sim, uart, window), os.X_OK):
+            parser.error("%s not found, run make -C sim (make -C sim irq, make -C sim windows) first" %
+                         sim_binary(args.sim, uart, window))
+    if "cli" in args.host and not os.access(args.programmer, os.X_OK):
+        parser.error("%s not found, run make -C ../../firmware-programmer/cli first" % args.programmer)
+    for interrupt_at in args.interrupt_at:
+        if not 0.0 <= interrupt_at < 1.0:
+            parser.error("--interrupt-at %g must be at least 0 and below 1" % interrupt_at)
+    for image_size in args.image_size:
+        if image_size <= 0 or image_size > MAX_FIRMWARE_SIZE or image_size % 4:
+            parser.error("image size %d must be a multiple of 4 up to %d" % (image_size, MAX_FIRMWARE_SIZE))
+        if max(args.change_bytes) > image_size or max(args.insert_bytes) >= image_size:
+            parser.error("--change-bytes and --insert-bytes must stay below the image size %d" % image_size)
+
+    output = open(args.output, "w", newline="") if args.output else sys.stdout
+    writer = None
+    results = []
+
+    modes = list(itertools.product(args.host, args.uart, args.encoding))
+    links = list(itertools.product(args.ber, args.drop, args.dup, args.latency_us, args.jitter_us, args.baud_drop))
+    interruptions = list(itertools.product(args.interrupt_at, args.resume))
+    changes = list(itertools.product(args.change_bytes, args.insert_bytes))
+
+    for mode, window, baud_rate, payload_size, image_size, link, interruption, change in itertools.product(
+            modes, args.window, args.baud, args.payload, args.image_size, links, interruptions, changes):
+        for repeat in range(args.repeat):
+            result = run_once(args, mode, window, baud_rate, payload_size, image_size, link, interruption, change,
+                              repeat)
+            results.append(result)
+
+            if args.format == "jsonl":
+                output.write(json.dumps(result, sort_keys=True) + "\n")
+            else:
+                row = flatten(result)
+                if writer is None:
+                    writer = csv.DictWriter(output, fieldnames=list(row), extrasaction="ignore")
+                    writer.writeheader()
+                writer.writerow(row)
+            output.flush()
+
+    print_summary(results, sys.stderr)
+    if output is not sys.stdout:
+        output.close()
+
+    return 0 if all(result["ok"] for result in results) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
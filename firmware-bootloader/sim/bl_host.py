@@ -0,0 +1,830 @@
+"""
+Host side of the bootloader protocol for the simulator and benchmarks.
+
+Speaks the same wire format as transport-layer.c: [length, type, seq, data..., crc8] as a COBS frame ending in
+0x00, with a go-back-N window, cumulative ACKs, RETX and BUSY. Only the standard library is used, the line is any file
+descriptor (usually the pty printed by firmware-bootloader-sim).
+"""
+
+import os
+import select
+import termios
+import time
+import tty
+import zlib
+
+SEGMENT_DATA_SIZE = 128
+SEGMENT_HEADER_SIZE = 3
+SEGMENT_CRC_SIZE = 1
+TL_FRAME_DELIMITER = 0x00
+TL_FRAME_OVERHEAD = 2  # COBS code byte + delimiter, segments are always shorter than 254 bytes
+TL_WINDOW_SIZE = 4
+
+SEGMENT_DATA = 0x00
+SEGMENT_RETX = 0x01
+SEGMENT_ACK = 0x02
+SEGMENT_DATA_RLE = 0x03
+SEGMENT_BUSY = 0x04
+SEGMENT_DATA_DELTA = 0x05
+
+RLE_RUN_FLAG = 0x80
+RLE_MIN_RUN = 3
+RLE_MAX_RUN = 0x7F + RLE_MIN_RUN
+RLE_MAX_LITERAL = 128
+
+DELTA_TOKEN_MASK = 0xC0
+DELTA_COPY = 0xC0
+DELTA_RUN = 0x80
+DELTA_MAX_COPY = 0x3FFF + 1
+DELTA_MAX_RUN = 0x3F + RLE_MIN_RUN
+DELTA_MIN_COPY = 8  # A copy token is 4 bytes, shorter matches go out as literals
+DELTA_PAGE_SIZE = 128  # The bootloader rebuilds the image one flash page at a time
+DELTA_CHAIN_LENGTH = 16  # Most recent positions tried per 4 byte prefix
+
+BL_AL_MESSAGE_SEQ_OBSERVED = 0x20
+BL_AL_MESSAGE_FW_UPDATE_REQ = 0x31
+BL_AL_MESSAGE_FW_UPDATE_RES = 0x37
+BL_AL_MESSAGE_DEVICE_ID_REQ = 0x3C
+BL_AL_MESSAGE_DEVICE_ID_RES = 0x3F
+BL_AL_MESSAGE_FW_LENGTH_REQ = 0x42
+BL_AL_MESSAGE_FW_LENGTH_RES = 0x45
+BL_AL_MESSAGE_READY_FOR_DATA = 0x48
+BL_AL_MESSAGE_UPDATE_SUCCESSFUL = 0x54
+BL_AL_MESSAGE_NACK = 0x59
+BL_AL_MESSAGE_BAUD_REQ = 0x4B
+BL_AL_MESSAGE_BAUD_RES = 0x4E
+BL_AL_MESSAGE_BAUD_PROBE = 0x51
+BL_AL_MESSAGE_PAGE_HASH_REQ = 0x5C
+BL_AL_MESSAGE_PAGE_HASH_RES = 0x5F
+PAGE_HASH_MAX_COUNT = 30
+
+SYNC_SEQ = bytes([0x01, 0x02, 0x03, 0x04])
+DEVICE_ID = 0x01
+DEFAULT_BAUD_RATE = 115200
+BAUD_PROBE_PATTERN = bytes([0x00, 0xFF, 0x55, 0xAA, 0x0F, 0xF0, 0x33, 0xCC])
+BAUD_PROBE_TIMEOUT = 0.5
+# Until READY_FOR_DATA, pages are erased during the transfer. Still 2 s per attempt for a build erasing all 384 up front
+ERASE_TIMEOUT = 8.0
+# Tries at an image the bootloader NACKs (a corrupt segment got past its CRC-8, see update())
+UPDATE_ATTEMPTS = 3
+
+BITS_PER_BYTE = 10
+
+# Erase plus two half-page programs per 128 byte page on the STM32L0, rounded up
+FLASH_SECONDS_PER_BYTE = 100e-6
+
+
+class ProtocolError(Exception):
+    pass
+
+
+def crc8(data):
+    # Polynomial 0x07, init 0x00, same as shared/src/core/crc8.c
+    crc = 0
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def crc32(data):
+    # IEEE 802.3, same as shared/src/core/crc32.c
+    return zlib.crc32(data) & 0xFFFFFFFF
+
+
+def pack_tokens(tokens, payload_size):
+    """Fill payloads of at most payload_size bytes with tokens, a token that does not fit starts the next one."""
+    payloads = []
+    current = bytearray()
+    for token in tokens:
+        if len(current) + len(token) > payload_size:
+            payloads.append(bytes(current))
+            current = bytearray()
+        current += token
+    if current:
+        payloads.append(bytes(current))
+
+    return payloads
+
+
+def literal_tokens(literal, payload_size):
+    # Control byte plus the bytes, a literal token has to fit into one payload
+    max_literal = min(RLE_MAX_LITERAL, payload_size - 1)
+    tokens = []
+    for start in range(0, len(literal), max_literal):
+        chunk = literal[start:start + max_literal]
+        tokens.append(bytes([len(chunk) - 1]) + bytes(chunk))
+    return tokens
+
+
+def rle_encode(image, payload_size):
+    """Split image into SEGMENT_DATA_RLE payloads of at most payload_size bytes, tokens never span two payloads."""
+    tokens = []
+    literal = bytearray()
+
+    def flush_literal():
+        tokens.extend(literal_tokens(literal, payload_size))
+        literal.clear()
+
+    i = 0
+    while i < len(image):
+        run = 1
+        while i + run < len(image) and run < RLE_MAX_RUN and image[i + run] == image[i]:
+            run += 1
+
+        if run >= RLE_MIN_RUN:
+            flush_literal()
+            tokens.append(bytes([RLE_RUN_FLAG | (run - RLE_MIN_RUN), image[i]]))
+            i += run
+        else:
+            literal.append(image[i])
+            i += 1
+    flush_literal()
+
+    return pack_tokens(tokens, payload_size)
+
+
+def rle_decoded_length(payload):
+    length = 0
+    i = 0
+    while i < len(payload):
+        control = payload[i]
+        if control & RLE_RUN_FLAG:
+            length += (control & 0x7F) + RLE_MIN_RUN
+            i += 2
+        else:
+            length += control + 1
+            i += control + 2
+    return length
+
+
+def delta_encode(base, image, payload_size):
+    """
+    Split image into SEGMENT_DATA_DELTA payloads that rebuild it in place over base, the image the device runs now.
+
+    The bootloader builds each page in RAM before it programs it and keeps the old contents of the page before, so
+    while it produces the byte at offset d a copy reads base from the page before d's page on and the new image below
+    that. Matches are searched under that same rule: at the same offset first (unchanged code), at the distance of
+    the last copy (code that moved) and then through hash chains of 4 byte prefixes in base and in the rebuilt part
+    of the image.
+    """
+    def source_byte_run(source, destination, limit):
+        # Bytes from source that match the image at destination, as the bootloader would read them
+        n = 0
+        while n < limit:
+            page = (destination + n) & ~(DELTA_PAGE_SIZE - 1)
+            end = min(limit, page + DELTA_PAGE_SIZE - destination)
+            rebuilt = page - DELTA_PAGE_SIZE
+            at = source + n
+            if at < rebuilt:
+                length = min(end - n, rebuilt - at)
+                chunk = image[at:at + length]
+            else:
+                length = min(end - n, len(base) - at)
+                if length <= 0:
+                    break
+                chunk = base[at:at + length]
+            target = image[destination + n:destination + n + length]
+            if chunk != target:
+                return n + next(i for i in range(length) if chunk[i] != target[i])
+            n += length
+        return n
+
+    base_chains = {}
+    for position in range(len(base) - 3):
+        base_chains.setdefault(base[position:position + 4], []).append(position)
+    image_chains = {}
+    indexed = 0  # Image positions below this are in image_chains, only what is rebuilt in flash
+
+    tokens = []
+    literal = bytearray()
+    distance = 0  # Source minus destination of the last copy
+    d = 0
+    while d < len(image):
+        rebuilt = (d & ~(DELTA_PAGE_SIZE - 1)) - DELTA_PAGE_SIZE
+        while indexed + 4 <= rebuilt:
+            image_chains.setdefault(image[indexed:indexed + 4], []).append(indexed)
+            indexed += 1
+
+        limit = min(len(image) - d, DELTA_MAX_COPY)
+        key = image[d:d + 4]
+        candidates = [d, d + distance] + base_chains.get(key, [])[-DELTA_CHAIN_LENGTH:] + \
+            image_chains.get(key, [])[-DELTA_CHAIN_LENGTH:]
+        best_length, best_source = 0, 0
+        for source in candidates:
+            if 0 <= source < 0x10000 and (source < rebuilt or source < len(base)):
+                length = source_byte_run(source, d, limit)
+                if length > best_length:
+                    best_length, best_source = length, source
+
+        run = 1
+        while run < min(limit, DELTA_MAX_RUN) and image[d + run] == image[d]:
+            run += 1
+
+        if best_length >= DELTA_MIN_COPY and best_length >= run:
+            tokens.extend(literal_tokens(literal, payload_size))
+            literal.clear()
+            count = best_length - 1
+            tokens.append(bytes([DELTA_COPY | (count >> 8), count & 0xFF]) + best_source.to_bytes(2, "little"))
+            distance = best_source - d
+            d += best_length
+        elif run >= RLE_MIN_RUN:
+            tokens.extend(literal_tokens(literal, payload_size))
+            literal.clear()
+            tokens.append(bytes([DELTA_RUN | (run - RLE_MIN_RUN), image[d]]))
+            d += run
+        else:
+            literal.append(image[d])
+            d += 1
+    tokens.extend(literal_tokens(literal, payload_size))
+
+    return pack_tokens(tokens, payload_size)
+
+
+def page_delta_encode(image, page_hashes, payload_size):
+    """
+    SEGMENT_DATA_DELTA payloads that send only the pages of image whose CRC-32 is not in page_hashes, the table the
+    bootloader reported for what its flash holds. A page it has at the same offset is an in-place copy, it leaves
+    those alone without an erase, and one it has elsewhere is copied from there if the view rule lets it still
+    read the old contents, that is from the page before on. A partial last page always goes out.
+    """
+    where = {}
+    for page, page_hash in enumerate(page_hashes):
+        where.setdefault(page_hash, []).append(page * DELTA_PAGE_SIZE)
+
+    tokens = []
+    copy_source = copy_length = 0
+
+    def flush_copy():
+        nonlocal copy_source, copy_length
+        while copy_length:
+            count = min(copy_length, DELTA_MAX_COPY)
+            tokens.append(bytes([DELTA_COPY | ((count - 1) >> 8), (count - 1) & 0xFF]) +
+                          copy_source.to_bytes(2, "little"))
+            copy_length -= count
+            copy_source += count
+
+    for d in range(0, len(image), DELTA_PAGE_SIZE):
+        page = image[d:d + DELTA_PAGE_SIZE]
+        sources = where.get(crc32(page), []) if len(page) == DELTA_PAGE_SIZE else []
+        source = d if d in sources else next((s for s in sources if s >= d - DELTA_PAGE_SIZE), None)
+        if source is not None and copy_length and copy_source + copy_length == source:
+            copy_length += DELTA_PAGE_SIZE
+            continue
+        flush_copy()
+        if source is not None:
+            copy_source, copy_length = source, DELTA_PAGE_SIZE
+            continue
+
+        literal = bytearray()
+        i = 0
+        while i < len(page):
+            run = 1
+            while i + run < len(page) and run < DELTA_MAX_RUN and page[i + run] == page[i]:
+                run += 1
+            if run >= RLE_MIN_RUN:
+                tokens.extend(literal_tokens(literal, payload_size))
+                literal.clear()
+                tokens.append(bytes([DELTA_RUN | (run - RLE_MIN_RUN), page[i]]))
+                i += run
+            else:
+                literal.append(page[i])
+                i += 1
+        tokens.extend(literal_tokens(literal, payload_size))
+    flush_copy()
+
+    return pack_tokens(tokens, payload_size)
+
+
+def delta_decoded_length(payload):
+    length = 0
+    i = 0
+    while i < len(payload):
+        control = payload[i]
+        if control & DELTA_TOKEN_MASK == DELTA_COPY:
+            length += ((control & 0x3F) << 8 | payload[i + 1]) + 1
+            i += 4
+        elif control & DELTA_TOKEN_MASK == DELTA_RUN:
+            length += (control & 0x3F) + RLE_MIN_RUN
+            i += 2
+        else:
+            length += control + 1
+            i += control + 2
+    return length
+
+
+def changed_pages(image, base=None, page_hashes=None):
+    """Per page of image whether it differs from base, or from what page_hashes says the bootloader holds there."""
+    changed = []
+    for page in range(0, len(image), DELTA_PAGE_SIZE):
+        data = image[page:page + DELTA_PAGE_SIZE]
+        if base is not None:
+            changed.append(data != base[page:page + DELTA_PAGE_SIZE])
+        else:
+            index = page // DELTA_PAGE_SIZE
+            changed.append(len(data) < DELTA_PAGE_SIZE or index >= len(page_hashes) or
+                           crc32(data) != page_hashes[index])
+    return changed
+
+
+def delta_flash_bytes(changed, image, payloads):
+    """Image bytes each delta payload makes the bootloader program, it leaves pages that come out the same alone."""
+    programmed = []
+    position = 0
+    for payload in payloads:
+        end = position + delta_decoded_length(payload)
+        count = 0
+        for page in range(position & ~(DELTA_PAGE_SIZE - 1), end, DELTA_PAGE_SIZE):
+            page_end = min(page + DELTA_PAGE_SIZE, len(image))
+            if changed[page // DELTA_PAGE_SIZE]:
+                count += min(end, page_end) - max(position, page)
+        programmed.append(count)
+        position = end
+    return programmed
+
+
+def cobs_encode(data):
+    out = bytearray()
+    for block in bytes(data).split(b"\x00"):
+        while len(block) >= 0xFE:
+            out += bytes([0xFF]) + block[:0xFE]
+            block = block[0xFE:]
+        out += bytes([len(block) + 1]) + block
+    return bytes(out)
+
+
+def cobs_decode(frame):
+    """Decoded bytes of one frame without its delimiter, None if it is malformed."""
+    out = bytearray()
+    i = 0
+    while i < len(frame):
+        code = frame[i]
+        if code == 0 or i + code > len(frame) + 1:
+            return None
+        out += frame[i + 1:i + code]
+        i += code
+        if code != 0xFF and i < len(frame):
+            out.append(0)
+    return bytes(out)
+
+
+def create_segment(segment_type, seq, data=b""):
+    header = bytes([len(data), segment_type, seq & 0xFF]) + bytes(data)
+    return cobs_encode(header + bytes([crc8(header)])) + bytes([TL_FRAME_DELIMITER])
+
+
+def parse_segment(frame):
+    """(type, seq, data) of one frame without its delimiter, None if it does not decode to a good segment."""
+    segment = cobs_decode(frame)
+    if segment is None or len(segment) < SEGMENT_HEADER_SIZE + SEGMENT_CRC_SIZE:
+        return None
+
+    end = len(segment) - SEGMENT_CRC_SIZE
+    if segment[0] != end - SEGMENT_HEADER_SIZE or crc8(segment[:end]) != segment[end]:
+        return None
+    return (segment[1], segment[2], segment[SEGMENT_HEADER_SIZE:end])
+
+
+class Link:
+    """Byte stream to the bootloader. Line faults are injected by the simulator (--ber, --drop, ...), not here."""
+
+    def __init__(self, path, baud_rate=DEFAULT_BAUD_RATE):
+        self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd, termios.TCSANOW)
+        self.set_baud_rate(baud_rate)
+        self.buffer = bytearray()
+
+    def close(self):
+        os.close(self.fd)
+
+    def set_baud_rate(self, baud_rate):
+        """Host side of the line at baud_rate, the reopen for negotiate_baud_rate. The simulator checks it with --match-baud."""
+        speed = getattr(termios, "B%d" % baud_rate)
+        attributes = termios.tcgetattr(self.fd)
+        attributes[4] = attributes[5] = speed
+        termios.tcsetattr(self.fd, termios.TCSADRAIN, attributes)
+
+    def write(self, data):
+        view = memoryview(data)
+        while view:
+            select.select([], [self.fd], [])
+            written = os.write(self.fd, view)
+            view = view[written:]
+
+    def fill(self, timeout):
+        ready, _, _ = select.select([self.fd], [], [], max(0.0, timeout))
+        if not ready:
+            return False
+
+        data = os.read(self.fd, 4096)
+        if not data:
+            # The bootloader side hung up (the simulator exits when it jumps to the application)
+            time.sleep(max(0.0, timeout))
+            return False
+        self.buffer += data
+        return True
+
+    def discard(self):
+        self.buffer.clear()
+
+
+class Bootloader:
+    """
+    One update session. Every method raises ProtocolError or TimeoutError when the bootloader does not answer,
+    counters and per-phase timings are collected in stats.
+    """
+
+    def __init__(self, link, baud_rate=DEFAULT_BAUD_RATE, timeout=2.0, ack_timeout=None):
+        self.link = link
+        self.baud_rate = baud_rate
+        self.timeout = timeout
+        self.ack_timeout = ack_timeout  # None scales it with the window and the flash time it takes
+        self.tx_seq = 0
+        self.rx_seq = 0
+        self.fallback = None  # (reopen, rate before the negotiated one) until the bootloader answers at the new rate
+        self.reopen = None  # From the last negotiation, takes the host back to the boot rate after a NACK
+        self.phases = {}
+        self.pages = None  # Page hashes the bootloader reported in the last handshake, if asked for
+        self.stats = {
+            "segments_sent": 0,
+            "segments_resent": 0,
+            "retx_received": 0,
+            "busy_received": 0,
+            "ack_timeouts": 0,
+            "crc_errors": 0,
+            "handshake_retries": 0,
+            "faults": 0,
+            "baud_fallbacks": 0,
+            "nacks": 0,
+        }
+        self.recoveries = []  # Seconds from each fault (RETX or ACK timeout) to the next ACK that made progress
+        self.on_progress = None  # Called with (image bytes ACKed, image bytes to send) as ACKs come in
+
+    # Framing
+
+    def _send(self, segment_type, seq, data=b""):
+        self.link.write(create_segment(segment_type, seq, data))
+
+    def _send_message(self, data):
+        self._send(SEGMENT_DATA, self.tx_seq, data)
+        self.tx_seq = (self.tx_seq + 1) & 0xFF
+
+    def _receive(self, timeout):
+        """Next good segment as (type, seq, data), None on timeout. Broken frames are counted and skipped."""
+        deadline = time.monotonic() + timeout
+        buffer = self.link.buffer
+
+        while True:
+            end = buffer.find(TL_FRAME_DELIMITER)
+            while end >= 0:
+                frame = bytes(buffer[:end])
+                del buffer[:end + 1]
+                if frame:
+                    segment = parse_segment(frame)
+                    if segment is not None:
+                        return segment
+                    self.stats["crc_errors"] += 1
+                end = buffer.find(TL_FRAME_DELIMITER)
+
+            if not self.link.fill(deadline - time.monotonic()):
+                return None
+
+    def _receive_message(self, timeout=None):
+        """Next DATA segment from the bootloader, ACKed. Control segments in between are skipped."""
+        deadline = time.monotonic() + (self.timeout if timeout is None else timeout)
+
+        while True:
+            segment = self._receive(deadline - time.monotonic())
+            if segment is None:
+                raise TimeoutError("no answer from the bootloader")
+
+            segment_type, seq, data = segment
+            if segment_type == SEGMENT_DATA:
+                self.rx_seq = (seq + 1) & 0xFF
+                self._send(SEGMENT_ACK, self.rx_seq)
+                return data
+
+    def _expect(self, message, timeout=None):
+        data = self._receive_message(timeout)
+        if not data or data[0] != message:
+            raise ProtocolError("expected 0x%02X, got %s" % (message, data.hex()))
+        return data
+
+    def _request(self, data, message, timeout=None, retries=3):
+        """
+        Send data (None to only wait) and wait for message. On a timeout ask for everything from rx_seq again
+        and repeat data, the bootloader ACKs a duplicate and resends nothing it has not sent yet.
+        """
+        if data is not None:
+            seq = self.tx_seq
+            self._send_message(data)
+        timeout = self.timeout if timeout is None else timeout
+
+        for attempt in range(retries + 1):
+            try:
+                return self._expect(message, timeout / (retries + 1))
+            except TimeoutError:
+                if attempt == retries:
+                    raise
+                self.stats["handshake_retries"] += 1
+                self._send(SEGMENT_RETX, self.rx_seq)
+                if data is not None:
+                    self._send(SEGMENT_DATA, seq, data)
+
+    def _byte_time(self):
+        return BITS_PER_BYTE / self.baud_rate
+
+    def _phase(self, name, start):
+        self.phases[name] = time.monotonic() - start
+
+    # Application layer
+
+    def sync(self, timeout=None):
+        start = time.monotonic()
+        timeout = self.timeout if timeout is None else timeout
+        self.link.discard()
+        self.tx_seq = 0
+        self.rx_seq = 0
+
+        # A lost SEQ_OBSERVED is asked for again, a sync sequence that did not arrive intact is repeated
+        for attempt in range(3):
+            self.link.write(SYNC_SEQ)
+            try:
+                self._request(None, BL_AL_MESSAGE_SEQ_OBSERVED, timeout / 3, retries=1)
+                break
+            except TimeoutError:
+                if attempt == 2:
+                    raise
+        self._phase("sync", start)
+
+    def negotiate_baud_rate(self, baud_rate, reopen):
+        """
+        Ask for baud_rate right after sync, reopen(baud_rate) must switch the host side of the line.
+        Returns True if both ends now run at baud_rate.
+        """
+        start = time.monotonic()
+        res = self._request(bytes([BL_AL_MESSAGE_BAUD_REQ]) + baud_rate.to_bytes(4, "little"),
+                            BL_AL_MESSAGE_BAUD_RES, BAUD_PROBE_TIMEOUT)
+        if len(res) < 2 or res[1] != 1:
+            return False
+
+        # Both transports start over at the new rate
+        previous_baud_rate = self.baud_rate
+        reopen(baud_rate)
+        self.tx_seq = 0
+        self.rx_seq = 0
+        self.link.discard()
+
+        probe = bytes([BL_AL_MESSAGE_BAUD_PROBE]) + BAUD_PROBE_PATTERN
+        self._send_message(probe)
+        try:
+            echo = self._receive_message(BAUD_PROBE_TIMEOUT)
+        except TimeoutError:
+            echo = None
+
+        if echo != probe:
+            # The bootloader goes back on its own once the probe times out, wait for that before following it
+            reopen(previous_baud_rate)
+            time.sleep(2 * BAUD_PROBE_TIMEOUT)
+            self.tx_seq = 0
+            self.rx_seq = 0
+            self.link.discard()
+            return False
+
+        self.fallback = (reopen, previous_baud_rate)
+        self.reopen = reopen
+        self.baud_rate = baud_rate
+        self._phase("baud", start)
+        return True
+
+    def page_hashes(self, count):
+        """CRC-32 of the first count pages of the application as the bootloader has them, between FW_LENGTH_REQ/RES."""
+        hashes = []
+        while len(hashes) < count:
+            first = len(hashes)
+            request = bytes([BL_AL_MESSAGE_PAGE_HASH_REQ]) + first.to_bytes(2, "little") + \
+                bytes([min(count - first, PAGE_HASH_MAX_COUNT)])
+            response = self._request(request, BL_AL_MESSAGE_PAGE_HASH_RES)
+            if len(response) < 4 or int.from_bytes(response[1:3], "little") != first or response[3] == 0:
+                break  # Past the end of the application region, those pages are sent as they are
+            hashes.extend(int.from_bytes(response[4 + 4 * i:8 + 4 * i], "little") for i in range(response[3]))
+        return hashes[:count]
+
+    def handshake(self, image, resume=True, base=None, pages=False):
+        """
+        FW_UPDATE_REQ up to READY_FOR_DATA, returns the (payload size, window) the bootloader advertised, the
+        offset into image the data starts at and whether it takes a delta against base. With resume, an interrupted
+        transfer of an image with the same CRC-32 up to where it stopped is continued from there, otherwise a base
+        (the image the device should be running) is offered for a delta. With pages instead of a base the bootloader
+        is asked for the CRC-32 of each page it holds, kept in self.pages for a delta of the pages that differ.
+        """
+        start = time.monotonic()
+        fallback, self.fallback = self.fallback, None
+        try:
+            self._request(bytes([BL_AL_MESSAGE_FW_UPDATE_REQ]), BL_AL_MESSAGE_FW_UPDATE_RES)
+        except TimeoutError:
+            if fallback is None:
+                raise
+            # The echo came back but nothing after it got through: the bootloader has long given up on the new
+            # rate (BAUD_PROBE_TIMEOUT without a good segment), follow it back and ask once more
+            reopen, self.baud_rate = fallback
+            reopen(self.baud_rate)
+            self.tx_seq = 0
+            self.rx_seq = 0
+            self.link.discard()
+            self.stats["baud_fallbacks"] += 1
+            self._request(bytes([BL_AL_MESSAGE_FW_UPDATE_REQ]), BL_AL_MESSAGE_FW_UPDATE_RES)
+        self._request(None, BL_AL_MESSAGE_DEVICE_ID_REQ)
+        length_req = self._request(bytes([BL_AL_MESSAGE_DEVICE_ID_RES, DEVICE_ID]), BL_AL_MESSAGE_FW_LENGTH_REQ)
+        payload_size = length_req[1] if len(length_req) > 1 else SEGMENT_DATA_SIZE
+        window = length_req[2] if len(length_req) > 2 else 1
+        offered = int.from_bytes(length_req[3:7], "little") if len(length_req) >= 11 else 0
+        offered_crc = int.from_bytes(length_req[7:11], "little") if len(length_req) >= 11 else 0
+        can_resume = resume and 0 < offered < len(image) and crc32(image[:offered]) == offered_crc
+        self.pages = None
+        if pages and not base and not can_resume:
+            self.pages = self.page_hashes(len(image) // DELTA_PAGE_SIZE)
+        self._phase("handshake", start)
+
+        # Erase covers everything until READY_FOR_DATA: invalidating the descriptor and the progress record
+        # and checking the delta base. The pages are erased during the transfer, each just before it is programmed
+        start = time.monotonic()
+        length_res = bytes([BL_AL_MESSAGE_FW_LENGTH_RES]) + len(image).to_bytes(4, "little") + \
+            crc32(image).to_bytes(4, "little")
+        proposed = 0
+        if can_resume:
+            proposed = offered
+            length_res += proposed.to_bytes(4, "little")
+        elif base:
+            length_res += bytes(4) + len(base).to_bytes(4, "little") + crc32(base).to_bytes(4, "little")
+        elif self.pages is not None:
+            length_res += bytes(12)  # Base length 0, the delta is made from the page hashes
+        ready = self._request(length_res, BL_AL_MESSAGE_READY_FOR_DATA, max(self.timeout, ERASE_TIMEOUT))
+        offset = int.from_bytes(ready[1:5], "little") if len(ready) >= 5 else 0
+        if offset not in (0, proposed):
+            raise ProtocolError("bootloader starts at offset %u, not %u" % (offset, proposed))
+        delta = (bool(base) or self.pages is not None) and not proposed and len(ready) >= 6 and ready[5] == 1
+        self.stats["resume_offset"] = offset
+        self.stats["delta"] = delta
+        self._phase("erase", start)
+
+        return payload_size, window, offset, delta
+
+    def send_payloads(self, payloads, segment_type=SEGMENT_DATA, window=TL_WINDOW_SIZE, flash_bytes=None):
+        """
+        Go-back-N over the payloads, returns the first bootloader message after them (UPDATE_SUCCESSFUL or NACK).
+        A RETX or an ACK timeout resends from the oldest unACKed segment, BUSY pauses until the next RETX.
+        flash_bytes is what each payload makes the bootloader program if that is less than it decodes to.
+        """
+        start = time.monotonic()
+        base_seq = self.tx_seq
+        count = len(payloads)
+        acked = 0           # Payloads before this one are ACKed
+        next_index = 0      # Next payload to put on the wire
+        sent = [False] * count
+        paused = False
+        retx_holdoff = {}   # seq -> time before which a repeated RETX for it is ignored
+        window_time = window * (SEGMENT_DATA_SIZE + SEGMENT_HEADER_SIZE + SEGMENT_CRC_SIZE + TL_FRAME_OVERHEAD) * self._byte_time()
+        # Resending while the bootloader is still programming would only pile a second window into its RX buffer,
+        # so the timeout covers the flash time of the largest window (an RLE or delta segment can expand to kilobytes)
+        decoded_length = {SEGMENT_DATA_RLE: rle_decoded_length, SEGMENT_DATA_DELTA: delta_decoded_length}
+        decoded = [decoded_length.get(segment_type, len)(p) for p in payloads]
+        flash_bytes = flash_bytes or decoded
+        flash_time = max((sum(flash_bytes[i:i + window]) for i in range(len(flash_bytes))), default=0) * \
+            FLASH_SECONDS_PER_BYTE
+        total_bytes = sum(decoded)
+        ack_timeout = self.ack_timeout or max(0.2, 2 * window_time + 2 * flash_time)
+        response = None
+        fault_start = None
+
+        def index_of(seq):
+            # Counted from the oldest unACKed payload, sequence numbers wrap every 256 but the window never does
+            return acked + ((seq - base_seq - acked) & 0xFF)
+
+        while acked < count:
+            while not paused and next_index < count and next_index - acked < window:
+                self._send(segment_type, base_seq + next_index, payloads[next_index])
+                self.stats["segments_resent" if sent[next_index] else "segments_sent"] += 1
+                sent[next_index] = True
+                next_index += 1
+
+            segment = self._receive(ack_timeout)
+            now = time.monotonic()
+
+            if segment is None:
+                # Lost ACK, RETX or BUSY release, go back to the oldest outstanding segment
+                self.stats["ack_timeouts"] += 1
+                if fault_start is None:
+                    self.stats["faults"] += 1
+                    fault_start = now - ack_timeout
+                next_index = acked
+                paused = False
+                continue
+
+            segment_type_in, seq, data = segment
+            if segment_type_in == SEGMENT_ACK:
+                index = index_of(seq)
+                if acked < index <= next_index:
+                    acked = index
+                    if fault_start is not None:
+                        self.recoveries.append(now - fault_start)
+                        fault_start = None
+                    if self.on_progress:
+                        self.on_progress(sum(decoded[:acked]), total_bytes)
+            elif segment_type_in == SEGMENT_RETX:
+                self.stats["retx_received"] += 1
+                if fault_start is None:
+                    self.stats["faults"] += 1
+                    fault_start = now
+                index = index_of(seq)
+                if acked <= index <= next_index and (paused or now >= retx_holdoff.get(seq, 0.0)):
+                    # One RETX per loss is enough, the rest come from segments that were already in flight
+                    retx_holdoff[seq] = now + window_time + 0.02
+                    next_index = index
+                    paused = False
+            elif segment_type_in == SEGMENT_BUSY:
+                self.stats["busy_received"] += 1
+                index = index_of(seq)
+                if acked <= index <= next_index:
+                    next_index = index
+                    paused = True
+            elif segment_type_in == SEGMENT_DATA:
+                # The last ACK may have been lost with the final message right behind it
+                self.rx_seq = (seq + 1) & 0xFF
+                self._send(SEGMENT_ACK, self.rx_seq)
+                response = data
+                break
+
+        self.tx_seq = (base_seq + count) & 0xFF
+        self._phase("transfer", start)
+
+        start = time.monotonic()
+        if response is None:
+            response = self._receive_message(max(self.timeout, 5.0))
+        self._phase("verify", start)
+
+        return response
+
+    def restart(self):
+        """
+        After a NACK the bootloader waits for a sync at the rate it booted with. It keeps its last progress record,
+        the next handshake only resumes from it if the CRC-32 up to there matches the image.
+        """
+        if self.baud_rate != DEFAULT_BAUD_RATE:
+            self.reopen(DEFAULT_BAUD_RATE)
+            self.baud_rate = DEFAULT_BAUD_RATE
+        self.phases = {}  # Timed again for the retry
+        self.sync()
+
+    def update(self, image, rle=False, payload_size=None, window=None, resume=True, base=None, pages=False,
+               force_window=None):
+        """
+        Complete update after sync, returns True on UPDATE_SUCCESSFUL. With base, the image the device runs now, only
+        a delta against it is sent if the bootloader confirms it has that image. With pages, only the pages whose
+        CRC-32 differs from what the bootloader reports for its flash are sent, no base needed. window can only lower
+        the window the bootloader advertises, force_window is used as it is: past the bootloader's window it answers
+        with BUSY, which is what it is for.
+
+        A corrupt segment passes its CRC-8 about once in 256, the image CRC-32 then fails and the bootloader NACKs.
+        The update is repeated from a fresh sync up to UPDATE_ATTEMPTS times, at the boot rate.
+        """
+        if len(image) % 4:
+            raise ValueError("image length must be a multiple of 4")
+
+        for attempt in range(UPDATE_ATTEMPTS):
+            if attempt:
+                self.restart()
+            response = self._update_once(image, rle, payload_size, window, resume, base, pages, force_window)
+            if not response or response[0] != BL_AL_MESSAGE_NACK:
+                break
+            self.stats["nacks"] += 1
+        return bool(response) and response[0] == BL_AL_MESSAGE_UPDATE_SUCCESSFUL
+
+    def _update_once(self, image, rle, payload_size, window, resume, base, pages, force_window):
+        advertised_payload, advertised_window, offset, delta = self.handshake(image, resume, base, pages)
+        payload_size = min(payload_size or advertised_payload, advertised_payload)
+        window = force_window or min(window or advertised_window, advertised_window)
+        image = image[offset:]
+
+        flash_bytes = None
+        if delta and base:
+            payloads = delta_encode(base, image, payload_size)
+            segment_type = SEGMENT_DATA_DELTA
+            flash_bytes = delta_flash_bytes(changed_pages(image, base), image, payloads)
+        elif delta:
+            payloads = page_delta_encode(image, self.pages, payload_size)
+            segment_type = SEGMENT_DATA_DELTA
+            flash_bytes = delta_flash_bytes(changed_pages(image, page_hashes=self.pages), image, payloads)
+        elif rle:
+            payloads = rle_encode(image, payload_size)
+            segment_type = SEGMENT_DATA_RLE
+        else:
+            payloads = [image[i:i + payload_size] for i in range(0, len(image), payload_size)]
+            segment_type = SEGMENT_DATA
+
+        self.stats["payload_size"] = payload_size
+        self.stats["window"] = window
+        self.stats["wire_payload_bytes"] = sum(len(p) for p in payloads)
+
+        return self.send_payloads(payloads, segment_type, window, flash_bytes)
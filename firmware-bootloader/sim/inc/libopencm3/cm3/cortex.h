@@ -0,0 +1,9 @@
+#ifndef SIM_LIBOPENCM3_CORTEX_H
+#define SIM_LIBOPENCM3_CORTEX_H
+
+#include "common-defines.h"
+
+// PRIMASK is the interrupt lock of the hardware thread, see sim.h
+uint32_t cm_mask_interrupts(uint32_t mask);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef SIM_LIBOPENCM3_NVIC_H
+#define SIM_LIBOPENCM3_NVIC_H
+
+#include "common-defines.h"
+
+#define NVIC_DMA1_CHANNEL2_3_IRQ (10)
+#define NVIC_DMA1_CHANNEL4_7_IRQ (11)
+#define NVIC_USART2_IRQ (28)
+
+void nvic_enable_irq(uint8_t irqn);
+void nvic_disable_irq(uint8_t irqn);
+
+// Handlers the hardware thread calls
+void usart2_isr(void);
+void dma1_channel4_7_isr(void);
+void sys_tick_handler(void);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef SIM_LIBOPENCM3_SYSTICK_H
+#define SIM_LIBOPENCM3_SYSTICK_H
+
+#include "common-defines.h"
+
+bool systick_set_frequency(uint32_t freq, uint32_t ahb);
+void systick_counter_enable(void);
+void systick_counter_disable(void);
+void systick_interrupt_enable(void);
+void systick_interrupt_disable(void);
+void systick_clear(void);
+
+#endif
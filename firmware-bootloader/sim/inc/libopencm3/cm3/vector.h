@@ -0,0 +1,16 @@
+#ifndef SIM_LIBOPENCM3_VECTOR_H
+#define SIM_LIBOPENCM3_VECTOR_H
+
+#include "common-defines.h"
+
+typedef void (*vector_table_entry_t)(void);
+
+typedef struct {
+    unsigned int* initial_sp_value;
+    vector_table_entry_t reset;
+} vector_table_t;
+
+// There is no application to run on the host, the simulator reports the hand-over and exits
+void sim_jump_to_application(uint32_t address);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef SIM_LIBOPENCM3_CRC_H
+#define SIM_LIBOPENCM3_CRC_H
+
+// The simulator builds crc32.c without CRC32_HARDWARE, nothing to model here
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef SIM_LIBOPENCM3_DMA_H
+#define SIM_LIBOPENCM3_DMA_H
+
+#include "common-defines.h"
+
+#define DMA1 (0x40020000U)
+
+#define DMA_CHANNEL1 (1)
+#define DMA_CHANNEL2 (2)
+#define DMA_CHANNEL3 (3)
+#define DMA_CHANNEL4 (4)
+#define DMA_CHANNEL5 (5)
+#define DMA_CHANNEL6 (6)
+#define DMA_CHANNEL7 (7)
+
+#define DMA_GIF (1U << 0)
+#define DMA_TCIF (1U << 1)
+#define DMA_HTIF (1U << 2)
+#define DMA_TEIF (1U << 3)
+
+#define DMA_CCR_PL_LOW (0U)
+#define DMA_CCR_PL_MEDIUM (1U)
+#define DMA_CCR_PL_HIGH (2U)
+#define DMA_CCR_PL_VERY_HIGH (3U)
+#define DMA_CCR_MSIZE_8BIT (0U)
+#define DMA_CCR_PSIZE_8BIT (0U)
+
+// Channel state, the hardware thread moves the data
+typedef struct sim_dma_channel_t {
+    volatile uint32_t cndtr;
+    uint32_t cmar;
+    uint32_t cpar;
+    uint32_t reload;
+    volatile uint32_t flags;
+    uint8_t request;
+    bool enabled;
+    bool circular;
+    bool from_memory;
+    bool htie;
+    bool tcie;
+} sim_dma_channel_t;
+
+extern sim_dma_channel_t sim_dma[8];
+
+#define DMA_CNDTR(dma_base, channel) (sim_dma[(channel)].cndtr)
+
+void dma_channel_reset(uint32_t dma, uint8_t channel);
+void dma_set_channel_request(uint32_t dma, uint8_t channel, uint8_t request);
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address);
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address);
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel);
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel);
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel);
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size);
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size);
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio);
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel);
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_channel(uint32_t dma, uint8_t channel);
+void dma_disable_channel(uint32_t dma, uint8_t channel);
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts);
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef SIM_LIBOPENCM3_FLASH_H
+#define SIM_LIBOPENCM3_FLASH_H
+
+#include "common-defines.h"
+
+// Wait states and prefetch only, programming goes through the simulated HAL in sim-flash.c
+
+void flash_prefetch_enable(void);
+void flash_set_ws(uint32_t ws);
+
+#endif
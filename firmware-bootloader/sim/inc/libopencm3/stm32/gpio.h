@@ -0,0 +1,25 @@
+#ifndef SIM_LIBOPENCM3_GPIO_H
+#define SIM_LIBOPENCM3_GPIO_H
+
+#include "common-defines.h"
+
+#define GPIOA (0x50000000U)
+
+#define GPIO2 (1U << 2)
+#define GPIO3 (1U << 3)
+#define GPIO5 (1U << 5)
+
+#define GPIO_MODE_INPUT (0x00)
+#define GPIO_MODE_OUTPUT (0x01)
+#define GPIO_MODE_AF (0x02)
+#define GPIO_MODE_ANALOG (0x03)
+
+#define GPIO_PUPD_NONE (0x00)
+
+#define GPIO_AF4 (0x04)
+
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios);
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios);
+void gpio_toggle(uint32_t gpioport, uint16_t gpios);
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef SIM_LIBOPENCM3_L0_USART_H
+#define SIM_LIBOPENCM3_L0_USART_H
+
+#include "common-defines.h"
+
+#define USART2 (0x40004400U)
+
+// Bit positions as on the part, ICR clear bits line up with the ISR flags they clear
+#define USART_ISR_FE (1U << 1)
+#define USART_ISR_NF (1U << 2)
+#define USART_ISR_ORE (1U << 3)
+#define USART_ISR_IDLE (1U << 4)
+#define USART_ISR_RXNE (1U << 5)
+#define USART_ISR_TC (1U << 6)
+#define USART_ISR_TXE (1U << 7)
+
+#define USART_FLAG_FE USART_ISR_FE
+#define USART_FLAG_NF USART_ISR_NF
+#define USART_FLAG_ORE USART_ISR_ORE
+#define USART_FLAG_IDLE USART_ISR_IDLE
+#define USART_FLAG_RXNE USART_ISR_RXNE
+#define USART_FLAG_TC USART_ISR_TC
+#define USART_FLAG_TXE USART_ISR_TXE
+
+#define USART_ICR_FECF (1U << 1)
+#define USART_ICR_NCF (1U << 2)
+#define USART_ICR_ORECF (1U << 3)
+#define USART_ICR_IDLECF (1U << 4)
+
+#define USART_CR1_UE (1U << 0)
+#define USART_CR1_IDLEIE (1U << 4)
+#define USART_CR1_RXNEIE (1U << 5)
+#define USART_CR1_TXEIE (1U << 7)
+
+#define USART_CR3_EIE (1U << 0)
+#define USART_CR3_DMAR (1U << 6)
+#define USART_CR3_DMAT (1U << 7)
+
+#define USART_FLOWCONTROL_NONE (0)
+#define USART_PARITY_NONE (0)
+#define USART_STOPBITS_1 (0)
+#define USART_MODE_TX_RX (0)
+
+typedef struct sim_usart_t {
+    volatile uint32_t cr1;
+    volatile uint32_t cr3;
+    volatile uint32_t brr;
+    volatile uint32_t isr;
+    volatile uint32_t icr; // Write-1-to-clear, applied by the hardware thread and usart_get_flag
+    volatile uint32_t rdr;
+    volatile uint32_t tdr;
+} sim_usart_t;
+
+extern sim_usart_t sim_usart2;
+
+#define USART_CR1(usart_base) (sim_usart2.cr1)
+#define USART_CR3(usart_base) (sim_usart2.cr3)
+#define USART_BRR(usart_base) (sim_usart2.brr)
+#define USART_ISR(usart_base) (sim_usart2.isr)
+#define USART_ICR(usart_base) (sim_usart2.icr)
+#define USART_RDR(usart_base) (sim_usart2.rdr)
+#define USART_TDR(usart_base) (sim_usart2.tdr)
+
+bool usart_get_flag(uint32_t usart, uint32_t flag);
+uint16_t usart_recv(uint32_t usart);
+void usart_send_blocking(uint32_t usart, uint16_t data);
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol);
+void usart_set_databits(uint32_t usart, uint32_t bits);
+void usart_set_parity(uint32_t usart, uint32_t parity);
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits);
+void usart_set_mode(uint32_t usart, uint32_t mode);
+void usart_enable(uint32_t usart);
+void usart_disable(uint32_t usart);
+void usart_enable_rx_interrupt(uint32_t usart);
+void usart_disable_rx_interrupt(uint32_t usart);
+void usart_enable_rx_dma(uint32_t usart);
+void usart_disable_rx_dma(uint32_t usart);
+void usart_enable_tx_dma(uint32_t usart);
+void usart_disable_tx_dma(uint32_t usart);
+
+#endif
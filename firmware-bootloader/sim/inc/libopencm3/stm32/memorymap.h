@@ -0,0 +1,8 @@
+#ifndef SIM_LIBOPENCM3_MEMORYMAP_H
+#define SIM_LIBOPENCM3_MEMORYMAP_H
+
+#include "sim.h"
+
+#define FLASH_BASE (SIM_FLASH_BASE) // Mapped at the same address in the simulator process
+
+#endif
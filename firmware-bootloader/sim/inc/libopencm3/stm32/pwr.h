@@ -0,0 +1,10 @@
+#ifndef SIM_LIBOPENCM3_PWR_H
+#define SIM_LIBOPENCM3_PWR_H
+
+#include "common-defines.h"
+
+#define PWR_SCALE1 (1)
+
+void pwr_set_vos_scale(uint32_t scale);
+
+#endif
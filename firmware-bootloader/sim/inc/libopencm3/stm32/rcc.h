@@ -0,0 +1,56 @@
+#ifndef SIM_LIBOPENCM3_RCC_H
+#define SIM_LIBOPENCM3_RCC_H
+
+#include "common-defines.h"
+
+// Clocks only need to exist for the firmware to configure them
+
+enum rcc_periph_clken {
+    RCC_GPIOA,
+    RCC_USART2,
+    RCC_PWR,
+    RCC_DMA,
+    RCC_CRC,
+};
+
+enum rcc_osc {
+    RCC_HSI16,
+    RCC_MSI,
+    RCC_PLL,
+};
+
+#define RCC_CFGR (0x0000000CU) // SWS always reads back the PLL
+#define RCC_CFGR_PLLMUL_MUL4 (1)
+#define RCC_CFGR_PLLDIV_DIV2 (1)
+#define RCC_CFGR_PLLSRC_HSI16_CLK (0)
+#define RCC_CFGR_HPRE_NODIV (0)
+
+struct rcc_clock_scale {
+    uint8_t pll_mul;
+    uint8_t pll_div;
+    uint8_t pll_source;
+    uint8_t flash_waitstates;
+    uint8_t voltage_scale;
+    uint8_t hpre;
+    uint8_t ppre1;
+    uint8_t ppre2;
+    uint32_t ahb_frequency;
+    uint32_t apb1_frequency;
+    uint32_t apb2_frequency;
+};
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken);
+void rcc_periph_clock_disable(enum rcc_periph_clken clken);
+void rcc_osc_on(enum rcc_osc osc);
+void rcc_osc_off(enum rcc_osc osc);
+void rcc_wait_for_osc_ready(enum rcc_osc osc);
+bool rcc_is_osc_ready(enum rcc_osc osc);
+void rcc_set_hpre(uint32_t hpre);
+void rcc_set_ppre1(uint32_t ppre);
+void rcc_set_ppre2(uint32_t ppre);
+void rcc_set_pll_multiplier(uint32_t factor);
+void rcc_set_pll_divider(uint32_t factor);
+void rcc_set_pll_source(uint32_t source);
+void rcc_set_sysclk_source(enum rcc_osc osc);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef INC_SIM_H
+#define INC_SIM_H
+
+#include "common-defines.h"
+
+// Host simulator of the bootloader, see sim/Makefile.
+// One hardware thread models the USART line, the DMA channels and SysTick in real time. Interrupt handlers run on
+// that thread while it holds the interrupt lock, which the firmware side takes whenever it masks interrupts or the
+// simulated flash stalls the core. A stalled core therefore delays interrupts exactly like on the part, while DMA
+// keeps moving bytes.
+
+#define SIM_FLASH_BASE (0x08000000U)
+#define SIM_FLASH_SIZE (0x10000U)
+#define SIM_EEPROM_BASE (0x08080000U)
+#define SIM_EEPROM_SIZE (0x800U)
+
+typedef enum sim_link_direction_t {
+    SIM_LINK_TO_DEVICE = 0,  // Host -> bootloader
+    SIM_LINK_TO_HOST = 1,    // Bootloader -> host
+    SIM_LINK_DIRECTIONS = 2,
+} sim_link_direction_t;
+
+// Line impairments (sim-link.c), applied to the directions set in directions (1 << sim_link_direction_t)
+typedef struct sim_link_config_t {
+    double ber;              // Probability of each bit being flipped, start and stop bits included
+    double drop;             // Probability of each byte being lost
+    double duplicate;        // Probability of each byte arriving twice
+    uint32_t latency_us;     // Fixed delay
+    uint32_t jitter_us;      // Extra delay, uniform in 0..jitter_us, bytes keep their order
+    uint32_t baud_drop;      // At a negotiated baud rate every frame to the device from this one on is lost, 0 = off
+    uint32_t directions;
+    uint64_t seed;
+} sim_link_config_t;
+
+// What the receiving USART makes of a byte with a flipped start or stop bit, see sim_link_to_device_pop
+#define SIM_LINK_FRAMING_ERROR (1U << 0)
+#define SIM_LINK_NOISE_ERROR (1U << 1)
+
+typedef struct sim_link_stats_t {
+    uint64_t bits_flipped;
+    uint64_t bytes_dropped;
+    uint64_t bytes_duplicated;
+} sim_link_stats_t;
+
+typedef struct sim_config_t {
+    uint32_t erase_us;       // Page erase time
+    uint32_t program_us;     // Word or half-page program time
+    uint32_t eeprom_us;      // Data EEPROM word write time
+    const char* flash_file;  // Flash and EEPROM contents are loaded from / saved to this file, NULL to start blank
+    const char* stats_file;  // Statistics are written here as JSON on exit, NULL for stderr only
+    bool match_baud;         // Bytes only get through when the host's termios speed matches the USART's
+    sim_link_config_t link;
+} sim_config_t;
+
+typedef struct sim_stats_t {
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t rx_overruns;    // Bytes the USART dropped because RDR was still full
+    uint64_t baud_mismatch_bytes; // Bytes garbled because the host and the USART ran at different rates
+    uint64_t irq_stuck;      // Interrupts still pending after 4 handler runs, a flag the firmware never clears
+    uint32_t pages_erased;
+    uint32_t half_pages_programmed;
+    uint32_t words_programmed;
+    uint64_t flash_busy_us;  // Time the core spent stalled on flash
+    uint64_t erase_busy_us;  // Part of it spent erasing pages
+    sim_link_stats_t link[SIM_LINK_DIRECTIONS];
+} sim_stats_t;
+
+extern sim_config_t sim_config;
+extern sim_stats_t sim_stats;
+
+void sim_irq_lock(void);
+void sim_irq_unlock(void);
+void sim_stall_us(uint32_t us); // Core stalled (interrupts held off), e.g. by a flash operation
+
+void sim_hw_start(int line_fd);
+
+void sim_link_init(void);
+void sim_link_to_device_pull(int fd, uint64_t now);
+bool sim_link_to_device_pop(uint64_t now, uint8_t* byte, uint8_t* errors);
+void sim_link_to_host_push(uint8_t byte, uint64_t now);
+void sim_link_to_host_flush(int fd, uint64_t now);
+
+void sim_flash_init(void);
+void sim_flash_save(void);
+void sim_exit(int status);
+
+#endif
@@ -0,0 +1,200 @@
+#define _GNU_SOURCE
+
+#include "bl-flash.h"
+#include "sim.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Stands in for the register level part of bl-flash.c (built with BL_SIM), the BL_FLASH_* layer on top is the
+// firmware's own. Flash and data EEPROM are mapped at their real addresses, so the firmware reads them directly.
+// Operations behave like the STM32L0: erased flash reads 0x00, programming a word that is not erased fails with
+// NOTZERO, the array is locked until HAL_FLASH_Unlock and every operation stalls the core for its typical time.
+
+#define SIM_PAGE_SIZE (128U)
+#define SIM_HALF_PAGE_WORDS (16U)
+
+#define SIM_FLASH_ERROR_NONE (0x00U)
+#define SIM_FLASH_ERROR_PGA (0x01U)
+#define SIM_FLASH_ERROR_WRP (0x02U)
+#define SIM_FLASH_ERROR_NOTZERO (0x40U)
+
+static uint32_t error_code = SIM_FLASH_ERROR_NONE;
+static bool unlocked = false;
+
+static bool sim_in_flash(uint32_t address, uint32_t size) {
+    return (address >= SIM_FLASH_BASE) && (address + size <= SIM_FLASH_BASE + SIM_FLASH_SIZE);
+}
+
+static bool sim_in_eeprom(uint32_t address, uint32_t size) {
+    return (address >= SIM_EEPROM_BASE) && (address + size <= SIM_EEPROM_BASE + SIM_EEPROM_SIZE);
+}
+
+static void* sim_map(uint32_t address, uint32_t size) {
+    void* memory = mmap((void*)(uintptr_t)address, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (memory != (void*)(uintptr_t)address) {
+        fprintf(stderr, "sim: cannot map 0x%08x, is the simulator built with -no-pie?\n", address);
+        sim_exit(1);
+    }
+
+    return memory;
+}
+
+void sim_flash_init(void) {
+    uint8_t* flash = sim_map(SIM_FLASH_BASE, SIM_FLASH_SIZE);
+    uint8_t* eeprom = sim_map(SIM_EEPROM_BASE, SIM_EEPROM_SIZE);
+
+    if (sim_config.flash_file == NULL) {
+        return;
+    }
+
+    FILE* file = fopen(sim_config.flash_file, "rb");
+    if (file == NULL) {
+        return; // First run, starts blank and is created on exit
+    }
+
+    if (fread(flash, 1, SIM_FLASH_SIZE, file) != SIM_FLASH_SIZE || fread(eeprom, 1, SIM_EEPROM_SIZE, file) != SIM_EEPROM_SIZE) {
+        fprintf(stderr, "sim: %s is not a flash image, starting blank\n", sim_config.flash_file);
+        memset(flash, 0, SIM_FLASH_SIZE);
+        memset(eeprom, 0, SIM_EEPROM_SIZE);
+    }
+    fclose(file);
+}
+
+void sim_flash_save(void) {
+    if (sim_config.flash_file == NULL) {
+        return;
+    }
+
+    FILE* file = fopen(sim_config.flash_file, "wb");
+    if (file == NULL) {
+        perror("sim: flash file");
+        return;
+    }
+
+    fwrite((const void*)(uintptr_t)SIM_FLASH_BASE, 1, SIM_FLASH_SIZE, file);
+    fwrite((const void*)(uintptr_t)SIM_EEPROM_BASE, 1, SIM_EEPROM_SIZE, file);
+    fclose(file);
+}
+
+static void sim_flash_busy(uint32_t us) {
+    sim_stats.flash_busy_us += us;
+    sim_stall_us(us);
+}
+
+// Checks shared by every program operation, sets error_code on failure
+static bool sim_program_allowed(bool in_range, const uint32_t* target, uint32_t words) {
+    error_code = SIM_FLASH_ERROR_NONE;
+
+    if (!unlocked || !in_range) {
+        error_code = SIM_FLASH_ERROR_WRP;
+        return false;
+    }
+
+    for (uint32_t i = 0; i < words; i++) {
+        if (target[i] != 0U) {
+            error_code = SIM_FLASH_ERROR_NOTZERO;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+uint32_t HAL_FLASH_GetError(void) {
+    return error_code;
+}
+
+HAL_StatusTypeDef FLASH_WaitForLastOperation(uint32_t Timeout) {
+    (void)Timeout;
+    return (error_code == SIM_FLASH_ERROR_NONE) ? HAL_OK : HAL_ERROR; // Operations complete synchronously
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) {
+    unlocked = true;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void) {
+    unlocked = false;
+    return HAL_OK;
+}
+
+void FLASH_PageErase(uint32_t PageAddress) {
+    uint32_t page = PageAddress & ~(SIM_PAGE_SIZE - 1U);
+
+    error_code = SIM_FLASH_ERROR_NONE;
+    if (!unlocked || !sim_in_flash(page, SIM_PAGE_SIZE)) {
+        error_code = SIM_FLASH_ERROR_WRP;
+        return;
+    }
+
+    sim_flash_busy(sim_config.erase_us);
+    memset((void*)(uintptr_t)page, 0, SIM_PAGE_SIZE);
+    sim_stats.pages_erased++;
+    sim_stats.erase_busy_us += sim_config.erase_us;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError) {
+    *PageError = 0xFFFFFFFFU;
+
+    for (uint32_t page = 0; page < pEraseInit->NbPages; page++) {
+        uint32_t address = pEraseInit->PageAddress + page * SIM_PAGE_SIZE;
+
+        FLASH_PageErase(address);
+        if (error_code != SIM_FLASH_ERROR_NONE) {
+            *PageError = address;
+            return HAL_ERROR;
+        }
+    }
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint32_t Data) {
+    (void)TypeProgram;
+    uint32_t* target = (uint32_t*)(uintptr_t)Address;
+
+    if (!sim_program_allowed(sim_in_flash(Address, 4U) && (Address % 4U) == 0U, target, 1U)) {
+        return HAL_ERROR;
+    }
+
+    sim_flash_busy(sim_config.program_us);
+    *target = Data;
+    sim_stats.words_programmed++;
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_HalfPageProgram(uint32_t Address, uint32_t *pBuffer) {
+    uint32_t half_page = Address & ~(SIM_HALF_PAGE_WORDS * 4U - 1U);
+    uint32_t* target = (uint32_t*)(uintptr_t)half_page;
+
+    if (!sim_program_allowed(sim_in_flash(half_page, SIM_HALF_PAGE_WORDS * 4U), target, SIM_HALF_PAGE_WORDS)) {
+        return HAL_ERROR;
+    }
+
+    // Same time as a single word, the point of half-page programming
+    sim_flash_busy(sim_config.program_us);
+    memcpy(target, pBuffer, SIM_HALF_PAGE_WORDS * 4U);
+    sim_stats.half_pages_programmed++;
+
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_DATAEEPROM_Program(uint32_t Address, uint32_t Data) {
+    error_code = SIM_FLASH_ERROR_NONE;
+    if (!unlocked || !sim_in_eeprom(Address, 4U)) {
+        error_code = SIM_FLASH_ERROR_WRP;
+        return HAL_ERROR;
+    }
+
+    // The EEPROM erases the word on its own first
+    sim_flash_busy(sim_config.eeprom_us);
+    *(uint32_t*)(uintptr_t)Address = Data;
+
+    return HAL_OK;
+}
@@ -0,0 +1,578 @@
+#define _GNU_SOURCE
+
+#include "libopencm3/stm32/rcc.h"
+#include "libopencm3/stm32/pwr.h"
+#include "libopencm3/stm32/flash.h"
+#include "libopencm3/stm32/gpio.h"
+#include "libopencm3/stm32/dma.h"
+#include "libopencm3/stm32/l0/usart.h"
+#include "libopencm3/cm3/nvic.h"
+#include "libopencm3/cm3/cortex.h"
+#include "libopencm3/cm3/systick.h"
+
+#include "sim.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_USART_CLOCK (32000000U)
+#define SIM_BITS_PER_BYTE (10U) // Start, 8 data, stop
+#define SIM_HW_PERIOD_NS (20000L) // Hardware thread wakes up every 20 us
+#define SIM_SYSTICK_NS (1000000ULL)
+
+sim_dma_channel_t sim_dma[8];
+sim_usart_t sim_usart2;
+
+static pthread_mutex_t irq_mutex;
+static __thread uint32_t primask = 0U; // Per thread, the hardware thread runs handlers with it set
+
+static volatile bool nvic_usart2 = false;
+static volatile bool nvic_dma1_channel4_7 = false;
+static volatile bool systick_enabled = false;
+static volatile bool systick_pending = false;
+
+static volatile bool tx_dma_request = false; // Set by usart_enable_tx_dma, TXE then drives channel 4
+static pthread_mutex_t tx_mutex = PTHREAD_MUTEX_INITIALIZER; // Between the blocking send and the DMA path
+static uint64_t tx_free_ns = 0; // When the transmitter can take the next byte
+static uint64_t rx_free_ns = 0; // When the next received byte may arrive
+static uint64_t rx_last_ns = 0; // Arrival of the last received byte, for IDLE
+static bool rx_idle_armed = false;
+
+static int line = -1;
+
+// Baud rate negotiation: with --match-baud a byte sent while the host's termios speed and the USART's rate differ
+// arrives as garbage, --baud-drop loses frames to the device sent at a rate other than the one the firmware booted with
+#define SIM_BAUD_TOLERANCE_PERCENT (3U)
+
+static uint32_t boot_brr = 0; // The firmware's first BRR, its boot rate
+static volatile uint32_t host_baud = 0; // 0 while unknown, never a mismatch
+static uint32_t frames_brr = 0; // Rate the frame count below belongs to
+static uint32_t frames_at_rate = 0; // Frames to the device completed since the last rate change
+static uint64_t garble_random[SIM_LINK_DIRECTIONS] = { 0x9E3779B97F4A7C15ULL, 0xBF58476D1CE4E5B9ULL };
+
+static uint64_t sim_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t sim_byte_ns(void) {
+    uint32_t brr = sim_usart2.brr ? sim_usart2.brr : 1U;
+    return (uint64_t)SIM_BITS_PER_BYTE * brr * 1000000000ULL / SIM_USART_CLOCK;
+}
+
+static void deliver_interrupts(void);
+
+void sim_irq_lock(void) {
+    pthread_mutex_lock(&irq_mutex);
+}
+
+void sim_irq_unlock(void) {
+    pthread_mutex_unlock(&irq_mutex);
+}
+
+void sim_stall_us(uint32_t us) {
+    struct timespec duration = { .tv_sec = us / 1000000U, .tv_nsec = (long)(us % 1000000U) * 1000L };
+
+    sim_irq_lock();
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {
+    }
+    sim_irq_unlock();
+
+    // What became pending during the stall is taken now, as on the part. Left to the hardware thread, a core going
+    // from one stall straight into the next can keep it from ever finding the lock free
+    if (!primask) {
+        deliver_interrupts();
+    }
+}
+
+uint32_t cm_mask_interrupts(uint32_t mask) {
+    uint32_t previous = primask;
+
+    if (mask && !previous) {
+        sim_irq_lock();
+    } else if (!mask && previous) {
+        sim_irq_unlock();
+    }
+    primask = mask ? 1U : 0U;
+
+    if (!mask && previous) {
+        deliver_interrupts(); // Pending ones fire the moment PRIMASK clears
+    }
+
+    return previous;
+}
+
+/* Clocks, power, GPIO and flash wait states: nothing to model */
+
+void rcc_periph_clock_enable(enum rcc_periph_clken clken) { (void)clken; }
+void rcc_periph_clock_disable(enum rcc_periph_clken clken) { (void)clken; }
+void rcc_osc_on(enum rcc_osc osc) { (void)osc; }
+void rcc_osc_off(enum rcc_osc osc) { (void)osc; }
+void rcc_wait_for_osc_ready(enum rcc_osc osc) { (void)osc; }
+bool rcc_is_osc_ready(enum rcc_osc osc) { return osc != RCC_PLL; } // Only polled after switching the PLL off
+void rcc_set_hpre(uint32_t hpre) { (void)hpre; }
+void rcc_set_ppre1(uint32_t ppre) { (void)ppre; }
+void rcc_set_ppre2(uint32_t ppre) { (void)ppre; }
+void rcc_set_pll_multiplier(uint32_t factor) { (void)factor; }
+void rcc_set_pll_divider(uint32_t factor) { (void)factor; }
+void rcc_set_pll_source(uint32_t source) { (void)source; }
+void rcc_set_sysclk_source(enum rcc_osc osc) { (void)osc; }
+void pwr_set_vos_scale(uint32_t scale) { (void)scale; }
+void flash_prefetch_enable(void) {}
+void flash_set_ws(uint32_t ws) { (void)ws; }
+void gpio_mode_setup(uint32_t gpioport, uint8_t mode, uint8_t pull_up_down, uint16_t gpios) { (void)gpioport; (void)mode; (void)pull_up_down; (void)gpios; }
+void gpio_set_af(uint32_t gpioport, uint8_t alt_func_num, uint16_t gpios) { (void)gpioport; (void)alt_func_num; (void)gpios; }
+void gpio_toggle(uint32_t gpioport, uint16_t gpios) { (void)gpioport; (void)gpios; }
+
+/* NVIC and SysTick */
+
+void nvic_enable_irq(uint8_t irqn) {
+    if (irqn == NVIC_USART2_IRQ) {
+        nvic_usart2 = true;
+    } else if (irqn == NVIC_DMA1_CHANNEL4_7_IRQ) {
+        nvic_dma1_channel4_7 = true;
+    }
+}
+
+void nvic_disable_irq(uint8_t irqn) {
+    if (irqn == NVIC_USART2_IRQ) {
+        nvic_usart2 = false;
+    } else if (irqn == NVIC_DMA1_CHANNEL4_7_IRQ) {
+        nvic_dma1_channel4_7 = false;
+    }
+}
+
+bool systick_set_frequency(uint32_t freq, uint32_t ahb) {
+    (void)ahb;
+    return freq == 1000U; // The hardware thread ticks at 1 kHz
+}
+
+void systick_counter_enable(void) {}
+void systick_counter_disable(void) {}
+void systick_interrupt_enable(void) { systick_enabled = true; }
+void systick_interrupt_disable(void) { systick_enabled = false; }
+void systick_clear(void) {}
+
+/* USART2 */
+
+static void usart_apply_icr(void) {
+    uint32_t icr = sim_usart2.icr;
+    if (icr != 0U) {
+        sim_usart2.icr = 0U;
+        __atomic_and_fetch(&sim_usart2.isr, ~icr, __ATOMIC_SEQ_CST);
+    }
+}
+
+bool usart_get_flag(uint32_t usart, uint32_t flag) {
+    (void)usart;
+    usart_apply_icr();
+
+    if (flag == USART_FLAG_TC || flag == USART_FLAG_TXE) {
+        pthread_mutex_lock(&tx_mutex);
+        bool idle = (sim_now_ns() >= tx_free_ns) && !(sim_dma[DMA_CHANNEL4].enabled && sim_dma[DMA_CHANNEL4].cndtr);
+        pthread_mutex_unlock(&tx_mutex);
+        return idle;
+    }
+
+    return (sim_usart2.isr & flag) != 0U;
+}
+
+uint16_t usart_recv(uint32_t usart) {
+    (void)usart;
+    __atomic_and_fetch(&sim_usart2.isr, ~USART_ISR_RXNE, __ATOMIC_SEQ_CST);
+    return (uint16_t)sim_usart2.rdr;
+}
+
+static uint32_t sim_speed_baud(speed_t speed) {
+    switch (speed) {
+        case B9600: return 9600U;
+        case B19200: return 19200U;
+        case B38400: return 38400U;
+        case B57600: return 57600U;
+        case B115200: return 115200U;
+        case B230400: return 230400U;
+        case B460800: return 460800U;
+        case B921600: return 921600U;
+        case B1000000: return 1000000U;
+        case B2000000: return 2000000U;
+        default: return 0U;
+    }
+}
+
+// The pty master sees the termios the host set on its end. Read after the pull, so a byte the host wrote before
+// switching may be judged at the new rate but never one written after it at the old rate
+static void host_baud_update(void) {
+    if (!sim_config.match_baud) {
+        return;
+    }
+
+    struct termios attributes;
+    if (tcgetattr(line, &attributes) == 0) {
+        host_baud = sim_speed_baud(cfgetospeed(&attributes));
+    }
+}
+
+static bool baud_mismatch(void) {
+    const uint32_t host = host_baud;
+    if (!sim_config.match_baud || host == 0U) {
+        return false;
+    }
+
+    const uint32_t usart = SIM_USART_CLOCK / (sim_usart2.brr ? sim_usart2.brr : 1U);
+    const uint32_t difference = (usart > host) ? usart - host : host - usart;
+    return difference * 100U > host * SIM_BAUD_TOLERANCE_PERCENT;
+}
+
+// Sampled at the wrong rate a byte comes out as any other, often without a valid stop bit
+static uint8_t baud_garble(sim_link_direction_t direction) {
+    uint64_t* random = &garble_random[direction];
+    *random ^= *random >> 12;
+    *random ^= *random << 25;
+    *random ^= *random >> 27;
+    sim_stats.baud_mismatch_bytes++;
+    return (uint8_t)((*random * 0x2545F4914F6CDD1DULL) >> 56);
+}
+
+// --baud-drop: byte is the host's, counted in frames before any garbling
+static bool baud_frame_lost(uint8_t byte) {
+    if (sim_usart2.brr != frames_brr) {
+        frames_brr = sim_usart2.brr;
+        frames_at_rate = 0U;
+    }
+
+    const bool lost = (sim_config.link.baud_drop != 0U) && (boot_brr != 0U) && (frames_brr != boot_brr) &&
+                      (sim_config.link.directions & (1U << SIM_LINK_TO_DEVICE)) &&
+                      (frames_at_rate + 1U >= sim_config.link.baud_drop);
+    if (byte == 0x00U) {
+        frames_at_rate++; // TL_FRAME_DELIMITER
+    }
+    if (lost) {
+        sim_stats.link[SIM_LINK_TO_DEVICE].bytes_dropped++;
+    }
+
+    return lost;
+}
+
+// Called with tx_mutex held, the link queue hands it to the host
+static void line_write(uint8_t byte) {
+    if (baud_mismatch()) {
+        byte = baud_garble(SIM_LINK_TO_HOST);
+    }
+    sim_link_to_host_push(byte, sim_now_ns());
+    sim_stats.tx_bytes++;
+}
+
+void usart_send_blocking(uint32_t usart, uint16_t data) {
+    (void)usart;
+
+    for (;;) {
+        pthread_mutex_lock(&tx_mutex);
+        uint64_t now = sim_now_ns();
+        if (now >= tx_free_ns) {
+            tx_free_ns = now + sim_byte_ns();
+            line_write((uint8_t)data);
+            pthread_mutex_unlock(&tx_mutex);
+            return;
+        }
+        pthread_mutex_unlock(&tx_mutex);
+        usleep(1);
+    }
+}
+
+void usart_set_flow_control(uint32_t usart, uint32_t flowcontrol) { (void)usart; (void)flowcontrol; }
+void usart_set_databits(uint32_t usart, uint32_t bits) { (void)usart; (void)bits; }
+void usart_set_parity(uint32_t usart, uint32_t parity) { (void)usart; (void)parity; }
+void usart_set_stopbits(uint32_t usart, uint32_t stopbits) { (void)usart; (void)stopbits; }
+void usart_set_mode(uint32_t usart, uint32_t mode) { (void)usart; (void)mode; }
+void usart_enable(uint32_t usart) {
+    (void)usart;
+    boot_brr = boot_brr ? boot_brr : sim_usart2.brr;
+    sim_usart2.cr1 |= USART_CR1_UE;
+}
+void usart_disable(uint32_t usart) { (void)usart; sim_usart2.cr1 &= ~USART_CR1_UE; }
+void usart_enable_rx_interrupt(uint32_t usart) { (void)usart; sim_usart2.cr1 |= USART_CR1_RXNEIE; }
+void usart_disable_rx_interrupt(uint32_t usart) { (void)usart; sim_usart2.cr1 &= ~USART_CR1_RXNEIE; }
+void usart_enable_rx_dma(uint32_t usart) { (void)usart; sim_usart2.cr3 |= USART_CR3_DMAR; }
+void usart_disable_rx_dma(uint32_t usart) { (void)usart; sim_usart2.cr3 &= ~USART_CR3_DMAR; }
+void usart_enable_tx_dma(uint32_t usart) { (void)usart; sim_usart2.cr3 |= USART_CR3_DMAT; tx_dma_request = true; }
+void usart_disable_tx_dma(uint32_t usart) { (void)usart; sim_usart2.cr3 &= ~USART_CR3_DMAT; tx_dma_request = false; }
+
+/* DMA1 */
+
+void dma_channel_reset(uint32_t dma, uint8_t channel) {
+    (void)dma;
+    sim_dma_channel_t cleared = {0};
+    sim_dma[channel] = cleared;
+}
+
+void dma_set_channel_request(uint32_t dma, uint8_t channel, uint8_t request) { (void)dma; sim_dma[channel].request = request; }
+void dma_set_peripheral_address(uint32_t dma, uint8_t channel, uint32_t address) { (void)dma; sim_dma[channel].cpar = address; }
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uint32_t address) { (void)dma; sim_dma[channel].cmar = address; }
+void dma_set_read_from_peripheral(uint32_t dma, uint8_t channel) { (void)dma; sim_dma[channel].from_memory = false; }
+void dma_set_read_from_memory(uint32_t dma, uint8_t channel) { (void)dma; sim_dma[channel].from_memory = true; }
+void dma_enable_memory_increment_mode(uint32_t dma, uint8_t channel) { (void)dma; (void)channel; }
+void dma_set_peripheral_size(uint32_t dma, uint8_t channel, uint32_t peripheral_size) { (void)dma; (void)channel; (void)peripheral_size; }
+void dma_set_memory_size(uint32_t dma, uint8_t channel, uint32_t mem_size) { (void)dma; (void)channel; (void)mem_size; }
+void dma_set_priority(uint32_t dma, uint8_t channel, uint32_t prio) { (void)dma; (void)channel; (void)prio; }
+void dma_enable_circular_mode(uint32_t dma, uint8_t channel) { (void)dma; sim_dma[channel].circular = true; }
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel) { (void)dma; sim_dma[channel].htie = true; }
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel) { (void)dma; sim_dma[channel].tcie = true; }
+
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number) {
+    (void)dma;
+    sim_dma[channel].cndtr = number;
+    sim_dma[channel].reload = number;
+}
+
+void dma_enable_channel(uint32_t dma, uint8_t channel) {
+    (void)dma;
+    pthread_mutex_lock(&tx_mutex);
+    sim_dma[channel].enabled = true;
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+void dma_disable_channel(uint32_t dma, uint8_t channel) {
+    (void)dma;
+    pthread_mutex_lock(&tx_mutex);
+    sim_dma[channel].enabled = false;
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+bool dma_get_interrupt_flag(uint32_t dma, uint8_t channel, uint32_t interrupts) {
+    (void)dma;
+    return (sim_dma[channel].flags & interrupts) != 0U;
+}
+
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts) {
+    (void)dma;
+    __atomic_and_fetch(&sim_dma[channel].flags, ~interrupts, __ATOMIC_SEQ_CST);
+}
+
+// One DMA beat on a channel, returns true once the transfer count ran out
+static bool dma_advance(sim_dma_channel_t* channel) {
+    channel->cndtr--;
+
+    if (channel->cndtr == channel->reload / 2U) {
+        __atomic_or_fetch(&channel->flags, DMA_HTIF | DMA_GIF, __ATOMIC_SEQ_CST);
+    }
+
+    if (channel->cndtr == 0U) {
+        __atomic_or_fetch(&channel->flags, DMA_TCIF | DMA_GIF, __ATOMIC_SEQ_CST);
+        if (channel->circular) {
+            channel->cndtr = channel->reload;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/* The line: bytes arrive from the host at the configured baud rate */
+
+static void rx_byte(uint8_t byte, uint8_t errors) {
+    sim_stats.rx_bytes++;
+
+    if (!(sim_usart2.cr1 & USART_CR1_UE)) {
+        return;
+    }
+
+    // Set with the byte they belong to, which is still received
+    uint32_t flags = 0U;
+    flags |= (errors & SIM_LINK_FRAMING_ERROR) ? USART_ISR_FE : 0U;
+    flags |= (errors & SIM_LINK_NOISE_ERROR) ? USART_ISR_NF : 0U;
+    if (flags != 0U) {
+        __atomic_or_fetch(&sim_usart2.isr, flags, __ATOMIC_SEQ_CST);
+    }
+
+    sim_dma_channel_t* channel = &sim_dma[DMA_CHANNEL5];
+    if ((sim_usart2.cr3 & USART_CR3_DMAR) && channel->enabled && !channel->from_memory && channel->cndtr != 0U) {
+        // Needs no CPU, so it happens even while the core is stalled
+        uint8_t* memory = (uint8_t*)(uintptr_t)channel->cmar;
+        memory[channel->reload - channel->cndtr] = byte;
+        dma_advance(channel);
+    } else if (sim_usart2.isr & USART_ISR_RXNE) {
+        // The previous byte was never read out of RDR
+        __atomic_or_fetch(&sim_usart2.isr, USART_ISR_ORE, __ATOMIC_SEQ_CST);
+        sim_stats.rx_overruns++;
+    } else {
+        sim_usart2.rdr = byte;
+        __atomic_or_fetch(&sim_usart2.isr, USART_ISR_RXNE, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void line_receive(uint64_t now) {
+    sim_link_to_device_pull(line, now);
+    host_baud_update();
+
+    if (rx_free_ns > now) {
+        return;
+    }
+
+    // The link queue holds whatever the host sent, release it no faster than the baud rate allows
+    uint64_t byte_ns = sim_byte_ns();
+    uint64_t budget = (now - rx_free_ns) / byte_ns + 1U;
+    if (rx_free_ns == 0U || budget > 64U) {
+        budget = 64U;
+    }
+
+    // Bytes that were due within one period still arrive one at a time, with the ISR running in between as it
+    // would at the real baud rate. Only a core holding interrupts off sees RDR overrun.
+    uint64_t count = 0;
+    uint8_t byte;
+    uint8_t errors;
+    while (count < budget && sim_link_to_device_pop(now, &byte, &errors)) {
+        count++;
+        if (baud_frame_lost(byte)) {
+            continue;
+        }
+        if (baud_mismatch()) {
+            byte = baud_garble(SIM_LINK_TO_DEVICE);
+            errors |= SIM_LINK_FRAMING_ERROR;
+        }
+        rx_byte(byte, errors);
+        deliver_interrupts();
+    }
+
+    if (count == 0U) {
+        rx_free_ns = now;
+        if (rx_idle_armed && (now - rx_last_ns) >= byte_ns) {
+            __atomic_or_fetch(&sim_usart2.isr, USART_ISR_IDLE, __ATOMIC_SEQ_CST);
+            rx_idle_armed = false;
+        }
+        return;
+    }
+
+    rx_free_ns = ((rx_free_ns > now - byte_ns * count) ? rx_free_ns : now - byte_ns * count) + byte_ns * count;
+    rx_last_ns = rx_free_ns;
+    rx_idle_armed = true;
+}
+
+static void line_transmit(uint64_t now) {
+    sim_dma_channel_t* channel = &sim_dma[DMA_CHANNEL4];
+
+    pthread_mutex_lock(&tx_mutex);
+    while (tx_dma_request && (sim_usart2.cr1 & USART_CR1_UE) && channel->enabled && channel->from_memory && channel->cndtr != 0U) {
+        if (tx_free_ns > now) {
+            break;
+        }
+
+        const uint8_t* memory = (const uint8_t*)(uintptr_t)channel->cmar;
+        line_write(memory[channel->reload - channel->cndtr]);
+        tx_free_ns = ((tx_free_ns > now) ? tx_free_ns : now) + sim_byte_ns();
+        if (dma_advance(channel)) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tx_mutex);
+}
+
+/* Interrupt delivery, level triggered, only while the core is not holding interrupts off */
+
+// Like libopencm3's vector table, a handler the firmware does not define does nothing
+__attribute__((weak)) void usart2_isr(void) {}
+__attribute__((weak)) void dma1_channel4_7_isr(void) {}
+__attribute__((weak)) void sys_tick_handler(void) {}
+
+static bool usart2_irq_pending(void) {
+    usart_apply_icr();
+    uint32_t isr = sim_usart2.isr;
+    uint32_t cr1 = sim_usart2.cr1;
+
+    bool pending = (isr & USART_ISR_RXNE) && (cr1 & USART_CR1_RXNEIE);
+    pending = pending || ((isr & USART_ISR_IDLE) && (cr1 & USART_CR1_IDLEIE));
+    pending = pending || ((isr & USART_ISR_ORE) && ((cr1 & USART_CR1_RXNEIE) || (sim_usart2.cr3 & USART_CR3_EIE)));
+    // Framing error and noise only interrupt through EIE, with DMAR set as ours is
+    pending = pending || ((isr & (USART_ISR_FE | USART_ISR_NF)) && (sim_usart2.cr3 & USART_CR3_EIE));
+
+    return nvic_usart2 && pending;
+}
+
+static bool dma1_channel4_7_irq_pending(void) {
+    for (uint8_t i = DMA_CHANNEL4; i <= DMA_CHANNEL7; i++) {
+        uint32_t flags = sim_dma[i].flags;
+        if (((flags & DMA_HTIF) && sim_dma[i].htie) || ((flags & DMA_TCIF) && sim_dma[i].tcie)) {
+            return nvic_dma1_channel4_7;
+        }
+    }
+
+    return false;
+}
+
+static void deliver_interrupts(void) {
+    if (pthread_mutex_trylock(&irq_mutex) != 0) {
+        return; // Core has interrupts masked or is stalled on flash
+    }
+    primask = 1U;
+
+    if (systick_pending && systick_enabled) {
+        systick_pending = false;
+        sys_tick_handler();
+    }
+
+    // A handler that does not clear its flag would spin the core on the part as well, give up after a few rounds
+    for (int i = 0; i < 4 && dma1_channel4_7_irq_pending(); i++) {
+        dma1_channel4_7_isr();
+    }
+
+    for (int i = 0; i < 4 && usart2_irq_pending(); i++) {
+        usart2_isr();
+    }
+    if (dma1_channel4_7_irq_pending() || usart2_irq_pending()) {
+        sim_stats.irq_stuck++;
+    }
+
+    primask = 0U;
+    pthread_mutex_unlock(&irq_mutex);
+}
+
+static void* sim_hw_thread(void* arg) {
+    (void)arg;
+    uint64_t next_tick = sim_now_ns() + SIM_SYSTICK_NS;
+
+    for (;;) {
+        uint64_t now = sim_now_ns();
+
+        // Only one SysTick can be pending, ticks are lost while the core is stalled for longer, as on the part
+        if (now >= next_tick) {
+            systick_pending = true;
+            while (next_tick <= now) {
+                next_tick += SIM_SYSTICK_NS;
+            }
+        }
+
+        line_receive(now);
+        line_transmit(now);
+        deliver_interrupts();
+
+        pthread_mutex_lock(&tx_mutex);
+        sim_link_to_host_flush(line, now);
+        pthread_mutex_unlock(&tx_mutex);
+
+        struct timespec period = { .tv_sec = 0, .tv_nsec = SIM_HW_PERIOD_NS };
+        nanosleep(&period, NULL);
+    }
+
+    return NULL;
+}
+
+void sim_hw_start(int line_fd) {
+    pthread_mutexattr_t attributes;
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&irq_mutex, &attributes);
+
+    line = line_fd;
+    sim_link_init();
+    sim_usart2.brr = SIM_USART_CLOCK / 115200U;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sim_hw_thread, NULL) != 0) {
+        perror("sim: hardware thread");
+        sim_exit(1);
+    }
+}
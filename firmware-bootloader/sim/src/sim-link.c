@@ -0,0 +1,192 @@
+#include "sim.h"
+
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+// Impaired serial line between the pty and the simulated USART2, one queue per direction.
+// Every byte entering a direction may be dropped, duplicated or get bits flipped, then waits in the queue until
+// its due time (latency plus jitter). Bytes never overtake each other, as on a real wire, so jitter only ever
+// stretches gaps. With every impairment at 0 a byte is due the moment it is queued.
+// Bit errors hit all 10 bits of the frame. A flipped stop bit is a framing error, a flipped start bit is taken as
+// the glitch the USART's start bit detection reports as noise; both still deliver the data bits. Towards the host
+// a framing error arrives as 0x00, as the tty layer passes it on in raw mode.
+
+#define SIM_LINK_QUEUE_SIZE (8192U) // Power of two
+
+typedef struct sim_link_queue_t {
+    uint8_t data[SIM_LINK_QUEUE_SIZE];
+    uint8_t errors[SIM_LINK_QUEUE_SIZE]; // SIM_LINK_FRAMING_ERROR / SIM_LINK_NOISE_ERROR
+    uint64_t due_ns[SIM_LINK_QUEUE_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint64_t last_due_ns;
+    uint64_t random;
+    uint64_t bits_to_flip; // Bits left until the next flipped one
+} sim_link_queue_t;
+
+static sim_link_queue_t queues[SIM_LINK_DIRECTIONS];
+
+static uint64_t link_random(sim_link_queue_t* queue) {
+    // xorshift64*, plenty for test noise and reproducible from --seed
+    queue->random ^= queue->random >> 12;
+    queue->random ^= queue->random << 25;
+    queue->random ^= queue->random >> 27;
+    return queue->random * 0x2545F4914F6CDD1DULL;
+}
+
+static double link_uniform(sim_link_queue_t* queue) {
+    return (double)(link_random(queue) >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+}
+
+static uint64_t link_next_flip(sim_link_queue_t* queue) {
+    // Geometric gap between bit errors, so tiny error rates cost nothing per byte
+    if (sim_config.link.ber <= 0.0) {
+        return UINT64_MAX;
+    }
+    if (sim_config.link.ber >= 1.0) {
+        return 0U;
+    }
+
+    return (uint64_t)floor(log(1.0 - link_uniform(queue)) / log(1.0 - sim_config.link.ber));
+}
+
+static bool link_impaired(sim_link_direction_t direction) {
+    return (sim_config.link.directions & (1U << direction)) != 0U;
+}
+
+static void link_enqueue(sim_link_direction_t direction, uint8_t byte, uint8_t errors, uint64_t now) {
+    sim_link_queue_t* queue = &queues[direction];
+
+    if (queue->head - queue->tail >= SIM_LINK_QUEUE_SIZE) {
+        sim_stats.link[direction].bytes_dropped++; // Only reachable with a huge latency, counts as loss
+        return;
+    }
+
+    uint64_t due_ns = now;
+    if (link_impaired(direction)) {
+        due_ns += (uint64_t)sim_config.link.latency_us * 1000U;
+        if (sim_config.link.jitter_us != 0U) {
+            due_ns += link_random(queue) % ((uint64_t)sim_config.link.jitter_us * 1000U + 1U);
+        }
+    }
+    if (due_ns < queue->last_due_ns) {
+        due_ns = queue->last_due_ns;
+    }
+    queue->last_due_ns = due_ns;
+
+    const uint32_t index = queue->head & (SIM_LINK_QUEUE_SIZE - 1U);
+    queue->data[index] = byte;
+    queue->errors[index] = errors;
+    queue->due_ns[index] = due_ns;
+    queue->head++;
+}
+
+static void link_push(sim_link_direction_t direction, uint8_t byte, uint64_t now) {
+    sim_link_queue_t* queue = &queues[direction];
+    sim_link_stats_t* stats = &sim_stats.link[direction];
+
+    if (!link_impaired(direction)) {
+        link_enqueue(direction, byte, 0U, now);
+        return;
+    }
+
+    if (sim_config.link.drop > 0.0 && link_uniform(queue) < sim_config.link.drop) {
+        stats->bytes_dropped++;
+        return;
+    }
+
+    // Start bit, data bits LSB first, stop bit
+    uint8_t errors = 0U;
+    for (uint32_t bit = 0; bit < 10U; bit++) {
+        if (queue->bits_to_flip == 0U) {
+            if (bit == 0U) {
+                errors |= SIM_LINK_NOISE_ERROR;
+            } else if (bit == 9U) {
+                errors |= SIM_LINK_FRAMING_ERROR;
+            } else {
+                byte ^= (uint8_t)(1U << (bit - 1U));
+            }
+            stats->bits_flipped++;
+            queue->bits_to_flip = link_next_flip(queue);
+        } else if (queue->bits_to_flip != UINT64_MAX) {
+            queue->bits_to_flip--;
+        }
+    }
+
+    if (direction == SIM_LINK_TO_HOST && (errors & SIM_LINK_FRAMING_ERROR)) {
+        byte = 0x00U;
+    }
+
+    link_enqueue(direction, byte, errors, now);
+
+    if (sim_config.link.duplicate > 0.0 && link_uniform(queue) < sim_config.link.duplicate) {
+        stats->bytes_duplicated++;
+        link_enqueue(direction, byte, errors, now);
+    }
+}
+
+void sim_link_init(void) {
+    for (uint32_t direction = 0; direction < SIM_LINK_DIRECTIONS; direction++) {
+        sim_link_queue_t* queue = &queues[direction];
+        queue->head = 0U;
+        queue->tail = 0U;
+        queue->last_due_ns = 0U;
+        queue->random = (sim_config.link.seed * 2U + direction + 1U) * 0x9E3779B97F4A7C15ULL;
+        queue->random = queue->random ? queue->random : 1U;
+        queue->bits_to_flip = link_next_flip(queue);
+    }
+}
+
+void sim_link_to_device_pull(int fd, uint64_t now) {
+    sim_link_queue_t* queue = &queues[SIM_LINK_TO_DEVICE];
+    uint8_t bytes[256];
+
+    // Leave room for every byte to be duplicated
+    uint32_t space = (SIM_LINK_QUEUE_SIZE - (queue->head - queue->tail)) / 2U;
+    if (space > sizeof(bytes)) {
+        space = sizeof(bytes);
+    }
+    if (space == 0U) {
+        return;
+    }
+
+    const ssize_t count = read(fd, bytes, space);
+    for (ssize_t i = 0; i < count; i++) {
+        link_push(SIM_LINK_TO_DEVICE, bytes[i], now);
+    }
+}
+
+bool sim_link_to_device_pop(uint64_t now, uint8_t* byte, uint8_t* errors) {
+    sim_link_queue_t* queue = &queues[SIM_LINK_TO_DEVICE];
+    const uint32_t index = queue->tail & (SIM_LINK_QUEUE_SIZE - 1U);
+
+    if (queue->head == queue->tail || queue->due_ns[index] > now) {
+        return false;
+    }
+
+    *byte = queue->data[index];
+    *errors = queue->errors[index];
+    queue->tail++;
+    return true;
+}
+
+void sim_link_to_host_push(uint8_t byte, uint64_t now) {
+    link_push(SIM_LINK_TO_HOST, byte, now);
+}
+
+void sim_link_to_host_flush(int fd, uint64_t now) {
+    sim_link_queue_t* queue = &queues[SIM_LINK_TO_HOST];
+
+    while (queue->head != queue->tail) {
+        const uint32_t index = queue->tail & (SIM_LINK_QUEUE_SIZE - 1U);
+        if (queue->due_ns[index] > now) {
+            break;
+        }
+
+        if (write(fd, &queue->data[index], 1) != 1 && errno == EAGAIN) {
+            break; // Host is not reading, try again on the next period
+        }
+        queue->tail++;
+    }
+}
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#include "libopencm3/cm3/vector.h"
+
+#include "bl-flash.h"
+#include "core/uart.h"
+#include "sim.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+// firmware-bootloader.c is built with -Dmain=bootloader_main
+int bootloader_main(void);
+
+// Typical STM32L053 figures from the datasheet
+sim_config_t sim_config = {
+    .erase_us = 3200,
+    .program_us = 3200,
+    .eeprom_us = 3200,
+    .flash_file = NULL,
+    .stats_file = NULL,
+    .link = {
+        .directions = (1U << SIM_LINK_TO_DEVICE) | (1U << SIM_LINK_TO_HOST),
+    },
+};
+
+sim_stats_t sim_stats;
+
+static int line_slave = -1; // Kept open so the pty survives the host closing its end
+
+static void sim_print_stats(void) {
+    uart_stats_t uart;
+    uart_get_stats(&uart);
+
+    fprintf(stderr, "sim: rx %llu B, tx %llu B, usart overruns %llu, uart dropped %u, framing errors %u, noise %u\n",
+            (unsigned long long)sim_stats.rx_bytes, (unsigned long long)sim_stats.tx_bytes,
+            (unsigned long long)sim_stats.rx_overruns, uart.dropped, uart.framing_errors, uart.noise_errors);
+    if (sim_stats.baud_mismatch_bytes != 0U) {
+        fprintf(stderr, "sim: %llu bytes garbled by a baud rate mismatch\n",
+                (unsigned long long)sim_stats.baud_mismatch_bytes);
+    }
+    if (sim_stats.irq_stuck != 0U) {
+        fprintf(stderr, "sim: an interrupt flag stayed set after its handler %llu times\n",
+                (unsigned long long)sim_stats.irq_stuck);
+    }
+    fprintf(stderr, "sim: %u pages erased, %u half-pages and %u words programmed, %llu ms stalled on flash\n",
+            sim_stats.pages_erased, sim_stats.half_pages_programmed, sim_stats.words_programmed,
+            (unsigned long long)(sim_stats.flash_busy_us / 1000U));
+    // The bootloader's own view of the last erase or write session: pages it erased, found blank and skipped.
+    // The time is the simulator's, SysTick does not advance while the core is stalled on flash
+    const bl_flash_erase_stats_t* erase = BL_FLASH_ERASE_Get_Stats();
+    fprintf(stderr, "sim: bootloader erased %u pages, skipped %u blank ones, %llu ms erasing\n", erase->pages_erased,
+            erase->pages_skipped, (unsigned long long)(sim_stats.erase_busy_us / 1000U));
+    for (uint32_t direction = 0; direction < SIM_LINK_DIRECTIONS; direction++) {
+        const sim_link_stats_t* link = &sim_stats.link[direction];
+        fprintf(stderr, "sim: link to %s: %llu bits flipped, %llu bytes dropped, %llu duplicated\n",
+                (direction == SIM_LINK_TO_DEVICE) ? "device" : "host", (unsigned long long)link->bits_flipped,
+                (unsigned long long)link->bytes_dropped, (unsigned long long)link->bytes_duplicated);
+    }
+
+    if (sim_config.stats_file == NULL) {
+        return;
+    }
+
+    // Same figures as JSON for the benchmark
+    FILE* file = fopen(sim_config.stats_file, "w");
+    if (file == NULL) {
+        perror("sim: stats file");
+        return;
+    }
+
+    fprintf(file,
+            "{\"rx_bytes\": %llu, \"tx_bytes\": %llu, \"usart_overruns\": %llu, \"uart_overruns\": %u, "
+            "\"uart_dropped\": %u, \"uart_framing_errors\": %u, \"uart_noise_errors\": %u, \"irq_stuck\": %llu, "
+            "\"pages_erased\": %u, \"half_pages_programmed\": %u, \"words_programmed\": %u, \"flash_busy_us\": %llu, "
+            "\"baud_rate\": %u, \"baud_mismatch_bytes\": %llu, \"bl_pages_erased\": %u, \"bl_pages_skipped\": %u, "
+            "\"erase_busy_us\": %llu",
+            (unsigned long long)sim_stats.rx_bytes, (unsigned long long)sim_stats.tx_bytes,
+            (unsigned long long)sim_stats.rx_overruns, uart.overruns, uart.dropped, uart.framing_errors,
+            uart.noise_errors, (unsigned long long)sim_stats.irq_stuck, sim_stats.pages_erased,
+            sim_stats.half_pages_programmed, sim_stats.words_programmed, (unsigned long long)sim_stats.flash_busy_us,
+            uart_get_baudrate(), (unsigned long long)sim_stats.baud_mismatch_bytes, erase->pages_erased,
+            erase->pages_skipped, (unsigned long long)sim_stats.erase_busy_us);
+    for (uint32_t direction = 0; direction < SIM_LINK_DIRECTIONS; direction++) {
+        const sim_link_stats_t* link = &sim_stats.link[direction];
+        const char* name = (direction == SIM_LINK_TO_DEVICE) ? "to_device" : "to_host";
+        fprintf(file, ", \"%s_bits_flipped\": %llu, \"%s_bytes_dropped\": %llu, \"%s_bytes_duplicated\": %llu",
+                name, (unsigned long long)link->bits_flipped, name, (unsigned long long)link->bytes_dropped,
+                name, (unsigned long long)link->bytes_duplicated);
+    }
+    fprintf(file, "}\n");
+    fclose(file);
+}
+
+void sim_exit(int status) {
+    sim_flash_save();
+    sim_print_stats();
+    exit(status);
+}
+
+void sim_jump_to_application(uint32_t address) {
+    fprintf(stderr, "sim: jump to application at 0x%08x\n", address);
+    sim_exit(0);
+}
+
+static void sim_on_signal(int signal_number) {
+    (void)signal_number;
+    sim_exit(2);
+}
+
+static int sim_open_line(void) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("sim: pty");
+        exit(1);
+    }
+
+    line_slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    struct termios attributes;
+    tcgetattr(line_slave, &attributes);
+    cfmakeraw(&attributes);
+    cfsetspeed(&attributes, B115200); // The boot rate, for --match-baud with a host that leaves the speed alone
+    tcsetattr(line_slave, TCSANOW, &attributes);
+
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    printf("%s\n", ptsname(master));
+    fflush(stdout);
+
+    return master;
+}
+
+static void sim_usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [--flash FILE] [--stats FILE] [--erase-us N] [--program-us N] [--eeprom-us N]\n"
+            "       [--ber P] [--drop P] [--dup P] [--latency-us N] [--jitter-us N] [--link-dir both|to-device|to-host]\n"
+            "       [--baud-drop N] [--match-baud] [--seed N]\n"
+            "Runs the bootloader on the host, prints the pty to talk to on stdout.\n"
+            "--ber/--drop/--dup are per bit/byte probabilities of the impaired line, see sim-link.c.\n"
+            "--baud-drop N loses every frame to the device from the Nth one sent at a negotiated rate.\n"
+            "--match-baud garbles bytes while the host's termios speed differs from the USART's rate.\n", name);
+}
+
+static bool sim_parse_link_dir(const char* text) {
+    if (strcmp(text, "both") == 0) {
+        sim_config.link.directions = (1U << SIM_LINK_TO_DEVICE) | (1U << SIM_LINK_TO_HOST);
+    } else if (strcmp(text, "to-device") == 0) {
+        sim_config.link.directions = 1U << SIM_LINK_TO_DEVICE;
+    } else if (strcmp(text, "to-host") == 0) {
+        sim_config.link.directions = 1U << SIM_LINK_TO_HOST;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "flash", required_argument, NULL, 'f' },
+        { "stats", required_argument, NULL, 's' },
+        { "erase-us", required_argument, NULL, 'e' },
+        { "program-us", required_argument, NULL, 'p' },
+        { "eeprom-us", required_argument, NULL, 'E' },
+        { "ber", required_argument, NULL, 'b' },
+        { "drop", required_argument, NULL, 'd' },
+        { "dup", required_argument, NULL, 'u' },
+        { "latency-us", required_argument, NULL, 'l' },
+        { "jitter-us", required_argument, NULL, 'j' },
+        { "link-dir", required_argument, NULL, 'D' },
+        { "baud-drop", required_argument, NULL, 'F' },
+        { "match-baud", no_argument, NULL, 'm' },
+        { "seed", required_argument, NULL, 'S' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "f:s:e:p:E:b:d:u:l:j:D:F:mS:h", options, NULL)) != -1) {
+        switch (option) {
+            case 'f': sim_config.flash_file = optarg; break;
+            case 's': sim_config.stats_file = optarg; break;
+            case 'e': sim_config.erase_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'p': sim_config.program_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'E': sim_config.eeprom_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'b': sim_config.link.ber = strtod(optarg, NULL); break;
+            case 'd': sim_config.link.drop = strtod(optarg, NULL); break;
+            case 'u': sim_config.link.duplicate = strtod(optarg, NULL); break;
+            case 'l': sim_config.link.latency_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'j': sim_config.link.jitter_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'F': sim_config.link.baud_drop = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'm': sim_config.match_baud = true; break;
+            case 'S': sim_config.link.seed = strtoull(optarg, NULL, 0); break;
+            case 'D':
+                if (!sim_parse_link_dir(optarg)) {
+                    sim_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default: sim_usage(argv[0]); return (option == 'h') ? 0 : 1;
+        }
+    }
+
+    signal(SIGINT, sim_on_signal);
+    signal(SIGTERM, sim_on_signal);
+
+    sim_flash_init();
+    sim_hw_start(sim_open_line());
+
+    return bootloader_main();
+}
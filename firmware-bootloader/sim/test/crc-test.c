@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+
+#include "core/crc8.h"
+#include "core/crc32.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Host check of shared/src/core/crc8.c and crc32.c (software backend, CRC32_HARDWARE needs the STM32L0 peripheral):
+// golden vectors, the table code against the bit-by-bit definition on random data, and the throughput of both.
+// `crc-test --vectors` prints the vectors with their CRCs as JSON lines, test/crc-vectors.ts checks the web app's
+// crc8/crc32 in transport-layer.ts against them.
+
+typedef struct crc_vector_t {
+    const char* name;
+    const uint8_t* data;
+    uint32_t length;
+    uint8_t crc8;
+    uint32_t crc32;
+} crc_vector_t;
+
+static uint8_t zeros[32];
+static uint8_t ones[32];
+static uint8_t counting[256];
+static const uint8_t fw_update_req[] = {0x01, 0x00, 0x00, 0x31}; // Wire segment of BL_AL_MESSAGE_FW_UPDATE_REQ
+
+static const crc_vector_t vectors[] = {
+    { "empty", (const uint8_t*)"", 0, 0x00, 0x00000000U },
+    { "check", (const uint8_t*)"123456789", 9, 0xF4, 0xCBF43926U },
+    { "zero byte", zeros, 1, 0x00, 0xD202EF8DU },
+    { "0xff byte", ones, 1, 0xF3, 0xFF000000U },
+    { "32 zeros", zeros, sizeof(zeros), 0x00, 0x190A55ADU },
+    { "32 0xff", ones, sizeof(ones), 0x09, 0xFF6CAB0BU },
+    { "0..255", counting, sizeof(counting), 0x14, 0x29058C73U },
+    { "fw update req", fw_update_req, sizeof(fw_update_req), 0x81, 0xC826B843U },
+    { "fox", (const uint8_t*)"The quick brown fox jumps over the lazy dog", 43, 0xC1, 0x414FA339U },
+};
+
+#define VECTOR_COUNT (sizeof(vectors) / sizeof(vectors[0]))
+
+#define RANDOM_BUFFERS (1000U)
+#define BENCH_SEGMENT (134U) // A full data segment as it goes on the wire
+#define BENCH_BYTES (64U * 1024U * 1024U)
+
+// The definitions the tables are built from, crc8 is the loop crc8.c used before it had a table
+static uint8_t crc8_bitwise(const uint8_t* data, uint32_t length) {
+    uint8_t crc = 0;
+
+    for (uint32_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint32_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x80U) ? (uint8_t)((crc << 1) ^ 0x07U) : (uint8_t)(crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+static uint32_t crc32_bitwise(const uint8_t* data, uint32_t length) {
+    uint32_t crc = CRC32_INIT;
+
+    for (uint32_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (uint32_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 1U) ? ((crc >> 1) ^ 0xEDB88320U) : (crc >> 1);
+        }
+    }
+
+    return crc ^ CRC32_FINAL_XOR;
+}
+
+static uint64_t test_random(uint64_t* state) {
+    // xorshift64*, as in sim-link.c
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double test_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static void test_init_vectors(void) {
+    memset(ones, 0xFF, sizeof(ones));
+    for (uint32_t i = 0; i < sizeof(counting); i++) {
+        counting[i] = (uint8_t)i;
+    }
+}
+
+static void test_print_vectors(void) {
+    for (uint32_t v = 0; v < VECTOR_COUNT; v++) {
+        printf("{\"name\": \"%s\", \"data\": \"", vectors[v].name);
+        for (uint32_t i = 0; i < vectors[v].length; i++) {
+            printf("%02x", vectors[v].data[i]);
+        }
+        printf("\", \"crc8\": %u, \"crc32\": %u}\n", vectors[v].crc8, vectors[v].crc32);
+    }
+}
+
+static uint32_t test_vectors(void) {
+    uint32_t failures = 0;
+
+    for (uint32_t v = 0; v < VECTOR_COUNT; v++) {
+        const crc_vector_t* vector = &vectors[v];
+        const uint8_t crc8_value = crc8((uint8_t*)vector->data, vector->length);
+        const uint32_t crc32_value = crc32(vector->data, vector->length);
+
+        if (crc8_value != vector->crc8 || crc32_value != vector->crc32) {
+            fprintf(stderr, "crc-test: %s: crc8 0x%02x crc32 0x%08x, expected 0x%02x 0x%08x\n", vector->name,
+                    crc8_value, crc32_value, vector->crc8, vector->crc32);
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+// Random lengths and contents, whole and fed to crc32_update in random chunks
+static uint32_t test_random_buffers(void) {
+    static uint8_t buffer[2048];
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    uint32_t failures = 0;
+
+    for (uint32_t n = 0; n < RANDOM_BUFFERS; n++) {
+        const uint32_t length = (uint32_t)(test_random(&state) % sizeof(buffer));
+        for (uint32_t i = 0; i < length; i++) {
+            buffer[i] = (uint8_t)test_random(&state);
+        }
+
+        uint32_t running = CRC32_INIT;
+        for (uint32_t offset = 0; offset < length;) {
+            uint32_t chunk = 1U + (uint32_t)(test_random(&state) % 200U);
+            chunk = (chunk > length - offset) ? length - offset : chunk;
+            running = crc32_update(running, &buffer[offset], chunk);
+            offset += chunk;
+        }
+
+        const uint32_t expected = crc32_bitwise(buffer, length);
+        if (crc8(buffer, length) != crc8_bitwise(buffer, length) || crc32(buffer, length) != expected ||
+            (running ^ CRC32_FINAL_XOR) != expected) {
+            fprintf(stderr, "crc-test: random buffer %u (%u bytes) differs from the bit-by-bit CRC\n", n, length);
+            failures++;
+        }
+    }
+
+    return failures;
+}
+
+static void test_bench(const char* name, uint32_t (*function)(const uint8_t*, uint32_t)) {
+    static uint8_t segment[BENCH_SEGMENT];
+    uint64_t state = 1;
+    for (uint32_t i = 0; i < sizeof(segment); i++) {
+        segment[i] = (uint8_t)test_random(&state);
+    }
+
+    volatile uint32_t sink = 0; // Keeps the calls from being optimised away
+    const double start = test_now();
+    for (uint32_t done = 0; done < BENCH_BYTES; done += sizeof(segment)) {
+        sink += function(segment, sizeof(segment));
+    }
+    const double elapsed = test_now() - start;
+    (void)sink;
+
+    printf("crc-test: %-16s %8.1f MB/s\n", name, (double)BENCH_BYTES / elapsed / 1e6);
+}
+
+static uint32_t bench_crc8_table(const uint8_t* data, uint32_t length) {
+    return crc8((uint8_t*)data, length);
+}
+
+static uint32_t bench_crc8_bitwise(const uint8_t* data, uint32_t length) {
+    return crc8_bitwise(data, length);
+}
+
+int main(int argc, char** argv) {
+    test_init_vectors();
+
+    if (argc > 1 && strcmp(argv[1], "--vectors") == 0) {
+        test_print_vectors();
+        return 0;
+    }
+
+    const uint32_t failures = test_vectors() + test_random_buffers();
+    printf("crc-test: %u golden vectors, %u random buffers: %s\n", (uint32_t)VECTOR_COUNT, RANDOM_BUFFERS,
+           (failures == 0) ? "ok" : "FAILED");
+
+    // 134 byte segments, the host's numbers only compare the two ways of computing each CRC
+    test_bench("crc8 table", bench_crc8_table);
+    test_bench("crc8 bitwise", bench_crc8_bitwise);
+    test_bench("crc32 nibble", crc32);
+    test_bench("crc32 bitwise", crc32_bitwise);
+
+    return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+// Checks the web app's crc8/crc32 against the vectors `crc-test --vectors` prints on stdin, one JSON line each.
+// `node --experimental-strip-types test/crc-vectors.ts`, see the test target in the Makefile.
+import { readFileSync } from "node:fs";
+import { crc8, crc32 } from "../../../firmware-programmer/web-app/src/lib/transport-layer.ts";
+
+let failures = 0;
+let count = 0;
+
+for (const line of readFileSync(0, "utf8").split("\n")) {
+    if (line.trim() == "") {
+        continue;
+    }
+
+    const vector = JSON.parse(line);
+    const data = Uint8Array.from((vector.data.match(/../g) ?? []).map((byte: string) => parseInt(byte, 16)));
+    const crc8Value = crc8(data, data.length);
+    const crc32Value = crc32(data);
+    count++;
+
+    if (crc8Value != vector.crc8 || crc32Value != vector.crc32) {
+        console.error(`crc-vectors: ${vector.name}: crc8 ${crc8Value} crc32 ${crc32Value}, ` +
+            `expected ${vector.crc8} ${vector.crc32}`);
+        failures++;
+    }
+}
+
+console.log(`crc-vectors: web app crc8/crc32 on ${count} vectors: ${failures == 0 ? "ok" : "FAILED"}`);
+process.exit(failures == 0 && count > 0 ? 0 : 1);
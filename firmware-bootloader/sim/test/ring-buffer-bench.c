@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+
+#include "core/ring-buffer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Host throughput of shared/src/core/ring-buffer.c: ring_buffer_write/read a byte at a time against
+// ring_buffer_write_span/commit and read_span/consume. Each round the producer puts a chunk in and the consumer takes
+// it out again, as the UART ISR and the main loop do, and every byte read is checked against what was written.
+
+#define BENCH_RING_SIZE (1024U) // Room for whole 134 byte frames, the size of the DMA ring in uart.c
+#define BENCH_BYTES (64U * 1024U * 1024U)
+
+static uint8_t ring_memory[BENCH_RING_SIZE];
+static uint8_t source[BENCH_RING_SIZE];
+static uint8_t sink[BENCH_RING_SIZE];
+
+static uint64_t bench_random(uint64_t* state) {
+    // xorshift64*, as in sim-link.c
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static uint32_t put_bytes(ring_buffer_t* rb, const uint8_t* data, uint32_t length) {
+    uint32_t done = 0;
+    while (done < length && ring_buffer_write(rb, data[done])) {
+        done++;
+    }
+    return done;
+}
+
+static uint32_t get_bytes(ring_buffer_t* rb, uint8_t* data, uint32_t length) {
+    uint32_t done = 0;
+    while (done < length && ring_buffer_read(rb, &data[done])) {
+        done++;
+    }
+    return done;
+}
+
+// Up to two spans each way, the second one after the wrap
+static uint32_t put_spans(ring_buffer_t* rb, const uint8_t* data, uint32_t length) {
+    uint32_t done = 0;
+    for (uint32_t span = 0; span < 2 && done < length; span++) {
+        uint8_t* destination;
+        uint32_t count = ring_buffer_write_span(rb, &destination);
+        count = (count < length - done) ? count : length - done;
+        if (count == 0) {
+            break;
+        }
+        memcpy(destination, &data[done], count);
+        ring_buffer_commit(rb, count);
+        done += count;
+    }
+    return done;
+}
+
+static uint32_t get_spans(ring_buffer_t* rb, uint8_t* data, uint32_t length) {
+    uint32_t done = 0;
+    for (uint32_t span = 0; span < 2 && done < length; span++) {
+        const uint8_t* origin;
+        uint32_t count = ring_buffer_read_span(rb, &origin);
+        count = (count < length - done) ? count : length - done;
+        if (count == 0) {
+            break;
+        }
+        memcpy(&data[done], origin, count);
+        ring_buffer_consume(rb, count);
+        done += count;
+    }
+    return done;
+}
+
+typedef uint32_t (*put_function_t)(ring_buffer_t* rb, const uint8_t* data, uint32_t length);
+typedef uint32_t (*get_function_t)(ring_buffer_t* rb, uint8_t* data, uint32_t length);
+
+// Returns false if a byte came out different from how it went in
+static bool bench_run(const char* name, put_function_t put, get_function_t get, uint32_t chunk) {
+    ring_buffer_t rb;
+    ring_buffer_setup(&rb, ring_memory, sizeof(ring_memory));
+    // Start part way round so chunks keep straddling the wrap
+    rb.read_index = rb.write_index = 7;
+
+    uint32_t offset = 0; // Into source, moves on by an odd amount each round
+    bool ok = true;
+    const double start = bench_now();
+    for (uint32_t moved = 0; moved < BENCH_BYTES; moved += chunk) {
+        const uint32_t in = put(&rb, &source[offset], chunk);
+        const uint32_t out = get(&rb, sink, chunk);
+        if (in != chunk || out != chunk || memcmp(sink, &source[offset], chunk) != 0) {
+            ok = false;
+            break;
+        }
+        offset = (offset + 13U) % (sizeof(source) - chunk);
+    }
+    const double elapsed = bench_now() - start;
+
+    printf("ring-buffer-bench: %-6s %4u B chunks %8.1f MB/s%s\n", name, chunk, (double)BENCH_BYTES / elapsed / 1e6,
+           ok ? "" : "  DATA MISMATCH");
+    return ok;
+}
+
+int main(void) {
+    uint64_t state = 1;
+    for (uint32_t i = 0; i < sizeof(source); i++) {
+        source[i] = (uint8_t)bench_random(&state);
+    }
+
+    // A byte per RXNE interrupt, a burst of a few, a whole data segment frame as the DMA or the parser sees it
+    static const uint32_t chunks[] = {1U, 16U, 134U};
+    uint32_t failures = 0;
+    for (uint32_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        failures += bench_run("byte", put_bytes, get_bytes, chunks[c]) ? 0U : 1U;
+        failures += bench_run("span", put_spans, get_spans, chunks[c]) ? 0U : 1U;
+    }
+
+    return (failures == 0) ? 0 : 1;
+}
@@ -1,6 +1,8 @@
 #include "bl-flash.h"
 #include "core/system.h"
 
+#include "string.h"
+
 #define __IO volatile /*!< Defines 'read / write' permissions */
 
 typedef enum {
@@ -227,6 +229,26 @@ typedef struct {
 
 #define IS_FLASH_TYPEPROGRAM(_VALUE_) ((_VALUE_) == FLASH_TYPEPROGRAM_WORD)
 
+/* Placed in .ramtext, which the linker script copies to RAM with .data. long_call because RAM is out of BL range from flash */
+#define __RAM_FUNC __attribute__((section(".ramtext"), noinline, long_call))
+
+#define FLASH_HALF_PAGE_WORDS   (16U)                         /*!< Words in a FLASH half-page */
+#define FLASH_HALF_PAGE_SIZE    (FLASH_HALF_PAGE_WORDS * 4U)  /*!< FLASH half-page size in bytes */
+#define FLASH_RAM_TIMEOUT_LOOPS (0x00100000U) /* SysTick is masked while half-page programming, so count busy loops instead */
+
+#define DATA_EEPROM_BASE (0x08080000UL) /*!< DATA EEPROM base address in the alias region */
+#define IS_FLASH_DATA_ADDRESS(__ADDRESS__) (((__ADDRESS__) >= DATA_EEPROM_BASE) && ((__ADDRESS__) < (DATA_EEPROM_BASE + 0x800U)))
+
+#define BL_IMAGE_DESCRIPTOR_ADDRESS (DATA_EEPROM_BASE) /* First words of data EEPROM, survives application erase */
+#define BL_PROGRESS_ADDRESS (DATA_EEPROM_BASE + 0x10U) /* Behind the descriptor */
+
+static uint32_t half_page_buffer[FLASH_HALF_PAGE_WORDS];
+static uint32_t half_page_address = 0;
+static uint32_t half_page_fill = 0; /* Bytes gathered in half_page_buffer */
+
+/* Register level HAL, the host simulator supplies its own (sim/src/sim-flash.c) */
+#if !defined(BL_SIM)
+
 uint32_t HAL_FLASH_GetError(void) {
    return pFlash.ErrorCode;
 }
@@ -473,17 +495,302 @@ HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint
     return status;
 }
 
-uint32_t BL_FLASH_ERASE_Main_Application(void) {
-    static FLASH_EraseInitTypeDef EraseInit;
+/* Must run from RAM: no flash fetch may happen between the 16 word writes, and the whole sequence runs with IRQs masked */
+static __RAM_FUNC HAL_StatusTypeDef FLASH_HalfPageProgram(uint32_t Address, const uint32_t *pBuffer) {
+    uint32_t primask_bit;
+    uint32_t count = 0U;
+    uint32_t timeout = FLASH_RAM_TIMEOUT_LOOPS;
+
+    /* Clean the error context */
+    pFlash.ErrorCode = HAL_FLASH_ERROR_NONE;
+
+    primask_bit = __get_PRIMASK();
+    __disable_irq();
+
+    /* Proceed to program the new half page */
+    SET_BIT(FLASH->PECR, FLASH_PECR_FPRG);
+    SET_BIT(FLASH->PECR, FLASH_PECR_PROG);
+
+    /* Write one half page directly with 16 different words */
+    while (count < FLASH_HALF_PAGE_WORDS) {
+        *(__IO uint32_t *)Address = *pBuffer;
+        Address += 4U;
+        pBuffer++;
+        count++;
+    }
+
+    /* FLASH_WaitForLastOperation lives in flash, poll BSY from here instead */
+    while (__HAL_FLASH_GET_FLAG(FLASH_FLAG_BSY) && (timeout != 0U)) {
+        timeout--;
+    }
+
+    /* If the program operation is completed, disable the PROG and FPRG Bits */
+    CLEAR_BIT(FLASH->PECR, FLASH_PECR_PROG);
+    CLEAR_BIT(FLASH->PECR, FLASH_PECR_FPRG);
+
+    __set_PRIMASK(primask_bit);
+
+    return (timeout == 0U) ? HAL_TIMEOUT : HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_HalfPageProgram(uint32_t Address, uint32_t *pBuffer) {
+    HAL_StatusTypeDef status;
+
+    /* Process Locked */
+    __HAL_LOCK(&pFlash);
+
+    /* Wait for last operation to be completed */
+    status = FLASH_WaitForLastOperation(FLASH_TIMEOUT_VALUE);
+
+    if (status == HAL_OK) {
+        status = FLASH_HalfPageProgram(Address & ~(FLASH_HALF_PAGE_SIZE - 1U), pBuffer);
+
+        if (status == HAL_OK) {
+            /* BSY is already clear, this collects EOP and any error flags */
+            status = FLASH_WaitForLastOperation(FLASH_TIMEOUT_VALUE);
+        }
+    }
+
+    /* Process Unlocked */
+    __HAL_UNLOCK(&pFlash);
+
+    return status;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_DATAEEPROM_Program(uint32_t Address, uint32_t Data) {
+    HAL_StatusTypeDef status;
+
+    /* Process Locked */
+    __HAL_LOCK(&pFlash);
+
+    /* Check the parameters */
+    assert_param(IS_FLASH_DATA_ADDRESS(Address));
+
+    /* Wait for last operation to be completed */
+    status = FLASH_WaitForLastOperation(FLASH_TIMEOUT_VALUE);
+
+    if (status == HAL_OK) {
+        /* Clean the error context */
+        pFlash.ErrorCode = HAL_FLASH_ERROR_NONE;
+
+        /* Program word (32-bit), the EEPROM erases the word first on its own */
+        *(__IO uint32_t *)Address = Data;
+
+        /* Wait for last operation to be completed */
+        status = FLASH_WaitForLastOperation(FLASH_TIMEOUT_VALUE);
+    }
+
+    /* Process Unlocked */
+    __HAL_UNLOCK(&pFlash);
+
+    return status;
+}
+
+#endif /* !BL_SIM */
+
+const bl_image_descriptor_t* BL_FLASH_IMAGE_Get_Descriptor(void) {
+    return (const bl_image_descriptor_t *)BL_IMAGE_DESCRIPTOR_ADDRESS;
+}
+
+HAL_StatusTypeDef BL_FLASH_IMAGE_Write_Descriptor(const bl_image_descriptor_t* descriptor) {
+    HAL_StatusTypeDef status;
+
+    HAL_FLASH_Unlock();
+    /* Magic goes last, a reset half way through leaves an invalid descriptor rather than a wrong one */
+    status = HAL_FLASHEx_DATAEEPROM_Program(BL_IMAGE_DESCRIPTOR_ADDRESS + 4U, descriptor->length);
+    if (status == HAL_OK) {
+        status = HAL_FLASHEx_DATAEEPROM_Program(BL_IMAGE_DESCRIPTOR_ADDRESS + 8U, descriptor->crc32);
+    }
+    if (status == HAL_OK) {
+        status = HAL_FLASHEx_DATAEEPROM_Program(BL_IMAGE_DESCRIPTOR_ADDRESS, descriptor->magic);
+    }
+    HAL_FLASH_Lock();
+
+    return status;
+}
+
+HAL_StatusTypeDef BL_FLASH_IMAGE_Invalidate_Descriptor(void) {
+    HAL_StatusTypeDef status;
+
+    HAL_FLASH_Unlock();
+    status = HAL_FLASHEx_DATAEEPROM_Program(BL_IMAGE_DESCRIPTOR_ADDRESS, 0x00000000U);
+    HAL_FLASH_Lock();
+
+    return status;
+}
+
+const bl_progress_t* BL_FLASH_PROGRESS_Get(void) {
+    return (const bl_progress_t *)BL_PROGRESS_ADDRESS;
+}
+
+HAL_StatusTypeDef BL_FLASH_PROGRESS_Commit(uint32_t offset, uint32_t crc32) {
+    const bl_progress_t* progress = BL_FLASH_PROGRESS_Get();
+    HAL_StatusTypeDef status;
+
+    HAL_FLASH_Unlock();
+    /* Two separate word writes: a reset between them leaves an offset and CRC-32 that do not match flash, which the
+       bootloader checks before it offers the record to the host */
+    status = HAL_FLASHEx_DATAEEPROM_Program(BL_PROGRESS_ADDRESS + 4U, offset);
+    if (status == HAL_OK) {
+        status = HAL_FLASHEx_DATAEEPROM_Program(BL_PROGRESS_ADDRESS + 8U, crc32);
+    }
+    /* Only the first commit of a transfer pays for the magic */
+    if ((status == HAL_OK) && (progress->magic != BL_PROGRESS_MAGIC)) {
+        status = HAL_FLASHEx_DATAEEPROM_Program(BL_PROGRESS_ADDRESS, BL_PROGRESS_MAGIC);
+    }
+    HAL_FLASH_Lock();
+
+    return status;
+}
+
+HAL_StatusTypeDef BL_FLASH_PROGRESS_Clear(void) {
+    HAL_StatusTypeDef status = HAL_OK;
+
+    if (BL_FLASH_PROGRESS_Get()->magic != 0x00000000U) {
+        HAL_FLASH_Unlock();
+        status = HAL_FLASHEx_DATAEEPROM_Program(BL_PROGRESS_ADDRESS, 0x00000000U);
+        HAL_FLASH_Lock();
+    }
+
+    return status;
+}
+
+static bl_flash_erase_stats_t erase_stats = {0};
+
+static bool write_erase_as_you_go = false;
+static uint32_t write_erased_end = 0; /* First page the writer has not erased yet */
+
+static bool BL_FLASH_Is_Blank(const uint32_t *word, uint32_t nb_words) {
+    /* Erased L0 flash reads 0x00 */
+    for (uint32_t i = 0; i < nb_words; i++) {
+        if (word[i] != 0x00000000U) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool BL_FLASH_Is_Page_Blank(uint32_t PageAddress) {
+    return BL_FLASH_Is_Blank((const uint32_t *)PageAddress, FLASH_PAGE_SIZE / 4U);
+}
+
+/* FLASH must already be unlocked */
+static HAL_StatusTypeDef BL_FLASH_ERASE_Page(uint32_t PageAddress, bool skip_blank_page) {
+    FLASH_EraseInitTypeDef EraseInit;
     uint32_t PageError;
+    HAL_StatusTypeDef status;
+    if (skip_blank_page && BL_FLASH_Is_Page_Blank(PageAddress)) {
+        erase_stats.pages_skipped++;
+        return HAL_OK;
+    }
 
     EraseInit.TypeErase = FLASH_TYPEERASE_PAGES;
-    EraseInit.PageAddress = MAIN_APPLICATION_START_ADDRESS;
-    EraseInit.NbPages = 384;
+    EraseInit.PageAddress = PageAddress;
+    EraseInit.NbPages = 1;
+
+    status = HAL_FLASHEx_Erase(&EraseInit, &PageError);
+    if (status == HAL_OK) {
+        erase_stats.pages_erased++;
+    }
+
+    return status;
+}
+
+uint32_t BL_FLASH_ERASE_Main_Application(uint32_t offset, uint32_t size, bool skip_blank_pages) {
+    uint32_t nb_pages = (size + FLASH_PAGE_SIZE - 1U) / FLASH_PAGE_SIZE;
+
+    erase_stats.pages_erased = 0;
+    erase_stats.pages_skipped = 0;
+
+    HAL_FLASH_Unlock();
+    for (uint32_t page = offset / FLASH_PAGE_SIZE; page < nb_pages; page++) {
+        if (BL_FLASH_ERASE_Page(MAIN_APPLICATION_START_ADDRESS + (page * FLASH_PAGE_SIZE), skip_blank_pages) != HAL_OK) {
+            break;
+        }
+    }
+    HAL_FLASH_Lock();
+
+    return erase_stats.pages_erased;
+}
+
+const bl_flash_erase_stats_t* BL_FLASH_ERASE_Get_Stats(void) {
+    return &erase_stats;
+}
+
+void BL_FLASH_WRITE_Begin(uint32_t address, bool erase_as_you_go) {
+    half_page_address = address & ~(FLASH_HALF_PAGE_SIZE - 1U);
+    half_page_fill = 0;
+
+    write_erase_as_you_go = erase_as_you_go;
+    write_erased_end = address & ~(FLASH_PAGE_SIZE - 1U);
+    if (erase_as_you_go) {
+        erase_stats.pages_erased = 0;
+        erase_stats.pages_skipped = 0;
+    }
+}
+
+HAL_StatusTypeDef BL_FLASH_WRITE_Data(const uint8_t *data, uint32_t length) {
+    HAL_StatusTypeDef status = HAL_OK;
+
+    while (length > 0) {
+        uint32_t chunk = FLASH_HALF_PAGE_SIZE - half_page_fill;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        memcpy((uint8_t *)half_page_buffer + half_page_fill, data, chunk);
+        half_page_fill += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (half_page_fill == FLASH_HALF_PAGE_SIZE) {
+            status = BL_FLASH_WRITE_Flush();
+            if (status != HAL_OK) {
+                break;
+            }
+        }
+    }
+
+    return status;
+}
+
+void BL_FLASH_WRITE_Skip(uint32_t length) {
+    half_page_address += length;
+
+    /* Whatever we skipped over must not be erased when programming picks up again behind it */
+    if (write_erased_end < (half_page_address & ~(FLASH_PAGE_SIZE - 1U))) {
+        write_erased_end = half_page_address & ~(FLASH_PAGE_SIZE - 1U);
+    }
+}
+
+HAL_StatusTypeDef BL_FLASH_WRITE_Flush(void) {
+    HAL_StatusTypeDef status = HAL_OK;
+
+    if (half_page_fill == 0) {
+        return HAL_OK;
+    }
+
+    /* Erased L0 flash reads 0x00, so a short tail is padded with zeros to leave the rest of the half-page untouched */
+    memset((uint8_t *)half_page_buffer + half_page_fill, 0x00, FLASH_HALF_PAGE_SIZE - half_page_fill);
 
     HAL_FLASH_Unlock();
-    HAL_FLASHEx_Erase(&EraseInit, &PageError);
+
+    /* First half-page of a page we have not erased yet, erase it right before programming it */
+    if (write_erase_as_you_go && (half_page_address >= write_erased_end)) {
+        status = BL_FLASH_ERASE_Page(write_erased_end, true);
+        write_erased_end += FLASH_PAGE_SIZE;
+    }
+
+    /* A half-page of zeros already reads back right from erased flash, skip programming it */
+    if ((status == HAL_OK) && !BL_FLASH_Is_Blank(half_page_buffer, FLASH_HALF_PAGE_WORDS)) {
+        status = HAL_FLASHEx_HalfPageProgram(half_page_address, half_page_buffer);
+    }
+
     HAL_FLASH_Lock();
 
-    return 0;
+    half_page_address += FLASH_HALF_PAGE_SIZE;
+    half_page_fill = 0;
+
+    return status;
 }
@@ -6,9 +6,12 @@
 #include "core/system.h"
 #include "core/uart.h"
 #include "core/timer.h"
+#include "core/crc32.h"
 #include "transport-layer.h"
 #include "bl-flash.h"
 
+#include "string.h"
+
 #define BOOTLOADER_SIZE (0x4000U) // 16 KByte (16384 Byte)
 #define MAIN_APPLICATION_START_ADDRESS (FLASH_BASE + BOOTLOADER_SIZE) // 0x08000000 + 0x4000 (0x08004000)
 
@@ -29,9 +32,28 @@
 
 #define DEFAULT_TIMEOUT (5000)
 
+// Both sides go back to the old rate if the probe or the first segment after it does not arrive in time
+#define BAUD_PROBE_TIMEOUT (500)
+#define BAUD_PROBE_LENGTH (9)
+
+#define ERASE_SKIP_BLANK_PAGES (true) // Blank check is a 128 byte read, far cheaper than a ~3.2 ms page erase
+#define ERASE_AS_YOU_GO (true) // Erase each page while receiving instead of erasing everything before READY_FOR_DATA
+
+#define RLE_RUN_CHUNK (16) // Runs are expanded through a small stack buffer this many bytes at a time
+
+#define DELTA_PAGE_SIZE (128U) // A delta is rebuilt one flash page at a time in RAM, see DELTA_COPY
+
+// Progress is committed to data EEPROM every this many bytes (a whole number of pages, two ~3.2 ms word writes each),
+// an interrupted transfer resumes from the last commit
+#define PROGRESS_INTERVAL (2048U)
+// Without a segment for this long the host is gone, wait for a new sync so it can resume
+#define RECEIVE_IDLE_TIMEOUT (10000)
+
 typedef enum bl_al_state_t {
     BL_AL_STATE_Sync,
     BL_AL_STATE_WaitForUpdateReq,
+    BL_AL_STATE_BaudProbe,
+    BL_AL_STATE_BaudConfirm,
     BL_AL_STATE_DeviceIDReq,
     BL_AL_STATE_DeviceIDRes,
     BL_AL_STATE_FirmwareLengthReq,
@@ -44,10 +66,24 @@ typedef enum bl_al_state_t {
 static bl_al_state_t state = BL_AL_STATE_Sync;
 static uint32_t firmware_size = 0;
 static uint32_t bytes_written = 0;
+static uint32_t firmware_crc = 0; // CRC-32 the host announced for the image
+static uint32_t running_crc = CRC32_INIT; // CRC-32 of what we have received so far, updated per segment
+static uint32_t next_commit = 0; // bytes_written at which the next progress record is written
+static uint32_t resume_offset = 0; // Offered in FW_LENGTH_REQ, 0 if there is nothing to resume
+static bool delta_base = false; // Flash holds the image the host made its delta against
+static uint8_t delta_page[DELTA_PAGE_SIZE]; // Page being rebuilt from delta tokens, programmed once complete
+static uint8_t delta_previous[DELTA_PAGE_SIZE]; // What the page before it held until it was rebuilt
+static uint32_t delta_fill = 0;
 static uint8_t sync_seq[4] = {0};
 static tl_segment_t temp_segment;
 
 static timer_t timer;
+static timer_t baud_timer;
+static uint32_t previous_baud_rate = 0;
+static uint32_t boot_baud_rate = 0;
+
+// Every bit transition the line can have, at both ends of the byte
+static const uint8_t baud_probe_pattern[BAUD_PROBE_LENGTH - 1] = {0x00, 0xFF, 0x55, 0xAA, 0x0F, 0xF0, 0x33, 0xCC};
 
 static void GPIO_Init(void) {
     rcc_periph_clock_enable(RCC_GPIOA);
@@ -61,8 +97,12 @@ static void GPIO_Init_Reset(void) {
 }
 
 static void Jump_To_Main_Application(void) {
+#if defined(BL_SIM)
+    sim_jump_to_application(MAIN_APPLICATION_START_ADDRESS);
+#else
     vector_table_t* main_vector_table = (vector_table_t*)(MAIN_APPLICATION_START_ADDRESS);
     main_vector_table->reset();
+#endif
 }
 
 static bool IS_MESSAGE_Device_ID(const tl_segment_t* segment) {
@@ -70,7 +110,7 @@ static bool IS_MESSAGE_Device_ID(const tl_segment_t* segment) {
         return false;
     }
 
-    if (segment->segment_type == SEGMENT_ACK || segment->segment_type == SEGMENT_RETX || segment->segment_type != 0) {
+    if (segment->segment_type != SEGMENT_DATA) {
         return false;
     }
 
@@ -78,21 +118,63 @@ static bool IS_MESSAGE_Device_ID(const tl_segment_t* segment) {
         return false;
     }
 
-    for (uint8_t i = 2; i < SEGMENT_DATA_SIZE; i++) {
-        if (segment->data[i] != 0xff) {
-            return false;
-        }
+    return true;
+}
+
+static bool IS_IMAGE_Valid(void) {
+    const bl_image_descriptor_t* descriptor = BL_FLASH_IMAGE_Get_Descriptor();
+
+    if (descriptor->magic != BL_IMAGE_DESCRIPTOR_MAGIC) {
+        return false;
     }
 
-    return true;
+    if (descriptor->length == 0 || descriptor->length > MAX_FIRMWARE_SIZE) {
+        return false;
+    }
+
+    return crc32((const uint8_t*)MAIN_APPLICATION_START_ADDRESS, descriptor->length) == descriptor->crc32;
+}
+
+static bool IS_MESSAGE_Baud_Req(const tl_segment_t* segment) {
+    if (segment->segment_data_size != 5 || segment->segment_type != SEGMENT_DATA) {
+        return false;
+    }
+
+    return segment->data[0] == BL_AL_MESSAGE_BAUD_REQ;
+}
+
+static bool IS_MESSAGE_Baud_Probe(const tl_segment_t* segment) {
+    if (segment->segment_data_size != BAUD_PROBE_LENGTH || segment->segment_type != SEGMENT_DATA) {
+        return false;
+    }
+
+    if (segment->data[0] != BL_AL_MESSAGE_BAUD_PROBE) {
+        return false;
+    }
+
+    return memcmp(&segment->data[1], baud_probe_pattern, sizeof(baud_probe_pattern)) == 0;
+}
+
+static void BAUD_Revert(void) {
+    uart_set_baudrate(previous_baud_rate);
+    TL_Init();
+    state = BL_AL_STATE_WaitForUpdateReq;
+}
+
+// Every way back to Sync: a host syncs at the rate we booted with, whatever it negotiated before
+static void STATE_Back_To_Sync(void) {
+    uart_set_baudrate(boot_baud_rate);
+    state = BL_AL_STATE_Sync;
 }
 
 static bool IS_MESSAGE_Firmware_Size(const tl_segment_t* segment) {
-    if (segment->segment_data_size != 5) {
+    // BL_AL_MESSAGE_FW_LENGTH_RES, length (4 bytes LE), CRC-32 of the image (4 bytes LE), optional resume offset,
+    // optional delta base length and CRC-32
+    if (segment->segment_data_size != 9 && segment->segment_data_size != 13 && segment->segment_data_size != 21) {
         return false;
     }
 
-    if (segment->segment_type == SEGMENT_ACK || segment->segment_type == SEGMENT_RETX || segment->segment_type != 0) {
+    if (segment->segment_type != SEGMENT_DATA) {
         return false;
     }
 
@@ -100,21 +182,273 @@ static bool IS_MESSAGE_Firmware_Size(const tl_segment_t* segment) {
         return false;
     }
 
-    for (uint8_t i = 5; i < SEGMENT_DATA_SIZE; i++) {
-        if (segment->data[i] != 0xff) {
-            return false;
+    return true;
+}
+
+static uint32_t PROGRESS_Resume_Offset(void) {
+    const bl_progress_t* progress = BL_FLASH_PROGRESS_Get();
+
+    if (progress->magic != BL_PROGRESS_MAGIC) {
+        return 0;
+    }
+
+    if (progress->offset == 0 || progress->offset > MAX_FIRMWARE_SIZE || (progress->offset % PROGRESS_INTERVAL) != 0) {
+        return 0;
+    }
+
+    // Catches a record torn by a reset as well as flash that changed since it was written
+    if (crc32((const uint8_t*)MAIN_APPLICATION_START_ADDRESS, progress->offset) != progress->crc32) {
+        return 0;
+    }
+
+    return progress->offset;
+}
+
+static void WRITE_Firmware(const uint8_t* data, uint32_t length) {
+    // Anything past the announced size is not part of the image
+    if (length > firmware_size - bytes_written) {
+        length = firmware_size - bytes_written;
+    }
+
+    while (length > 0) {
+        // Split at the next commit, the record has to describe exactly the bytes up to it
+        uint32_t chunk = next_commit - bytes_written;
+        if (chunk > length) {
+            chunk = length;
+        }
+
+        BL_FLASH_WRITE_Data(data, chunk);
+
+        // Hash as the data arrives, so checking the image needs no second pass over flash
+        running_crc = crc32_update(running_crc, data, chunk);
+        bytes_written += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (bytes_written == next_commit) {
+            // PROGRESS_INTERVAL is a whole number of half-pages, so the writer has just programmed all of it
+            BL_FLASH_PROGRESS_Commit(bytes_written, running_crc ^ CRC32_FINAL_XOR);
+            next_commit += PROGRESS_INTERVAL;
         }
     }
+}
 
-    return true;
+static void WRITE_Firmware_RLE(const uint8_t* data, uint32_t length) {
+    uint8_t run_buffer[RLE_RUN_CHUNK];
+    uint32_t i = 0;
+
+    while (i < length) {
+        uint8_t control = data[i++];
+
+        if (control & RLE_RUN_FLAG) {
+            if (i >= length) {
+                break;
+            }
+
+            uint32_t run = (control & ~RLE_RUN_FLAG) + RLE_MIN_RUN;
+            memset(run_buffer, data[i++], sizeof(run_buffer));
+            while (run > 0) {
+                uint32_t chunk = (run > sizeof(run_buffer)) ? sizeof(run_buffer) : run;
+                WRITE_Firmware(run_buffer, chunk);
+                run -= chunk;
+            }
+        } else {
+            uint32_t literal = (uint32_t)control + 1;
+            if (literal > length - i) {
+                literal = length - i;
+            }
+            WRITE_Firmware(&data[i], literal);
+            i += literal;
+        }
+    }
+}
+
+static bool IS_MESSAGE_Page_Hash_Req(const tl_segment_t* segment) {
+    if (segment->segment_data_size != 4 || segment->segment_type != SEGMENT_DATA) {
+        return false;
+    }
+
+    return segment->data[0] == BL_AL_MESSAGE_PAGE_HASH_REQ;
+}
+
+static bool IS_DELTA_Base(uint32_t length, uint32_t crc) {
+    // No base: the host made the delta from PAGE_HASH_RES, it only copies pages it knows we have
+    if (length == 0) {
+        return true;
+    }
+
+    if (length > MAX_FIRMWARE_SIZE) {
+        return false;
+    }
+
+    // Checked against flash, not the descriptor, so an image that was flashed some other way counts as well
+    return crc32((const uint8_t*)MAIN_APPLICATION_START_ADDRESS, length) == crc;
+}
+
+// Bytes flash already holds: hashed and counted like written ones but left alone. Whole pages only, so they never
+// straddle a progress commit
+static void WRITE_Firmware_Unchanged(const uint8_t* data, uint32_t length) {
+    BL_FLASH_WRITE_Skip(length);
+    running_crc = crc32_update(running_crc, data, length);
+    bytes_written += length;
+
+    if (bytes_written == next_commit) {
+        BL_FLASH_PROGRESS_Commit(bytes_written, running_crc ^ CRC32_FINAL_XOR);
+        next_commit += PROGRESS_INTERVAL;
+    }
+}
+
+static void DELTA_Flush_Page(void) {
+    const uint8_t* current = (const uint8_t*)(MAIN_APPLICATION_START_ADDRESS + bytes_written);
+    memcpy(delta_previous, current, DELTA_PAGE_SIZE);
+
+    // An unchanged page is neither erased nor programmed, which is most of them for a small change
+    if (memcmp(current, delta_page, delta_fill) == 0) {
+        WRITE_Firmware_Unchanged(delta_page, delta_fill);
+    } else {
+        WRITE_Firmware(delta_page, delta_fill);
+    }
+    delta_fill = 0;
+}
+
+static void DELTA_Append(const uint8_t* data, uint32_t length) {
+    while (length > 0 && bytes_written + delta_fill < firmware_size) {
+        uint32_t chunk = DELTA_PAGE_SIZE - delta_fill;
+        if (chunk > length) {
+            chunk = length;
+        }
+        if (chunk > firmware_size - bytes_written - delta_fill) {
+            chunk = firmware_size - bytes_written - delta_fill;
+        }
+
+        memcpy(&delta_page[delta_fill], data, chunk);
+        delta_fill += chunk;
+        data += chunk;
+        length -= chunk;
+
+        if (delta_fill == DELTA_PAGE_SIZE || bytes_written + delta_fill == firmware_size) {
+            DELTA_Flush_Page();
+        }
+    }
+}
+
+static void DELTA_Copy(uint32_t source, uint32_t length) {
+    while (length > 0 && bytes_written + delta_fill < firmware_size) {
+        // The page being built starts at bytes_written, sources are resolved as the host did when making the delta
+        uint32_t chunk = DELTA_PAGE_SIZE - delta_fill;
+        uint32_t previous = bytes_written - DELTA_PAGE_SIZE;
+        const uint8_t* data;
+
+        if (bytes_written >= DELTA_PAGE_SIZE && source < previous) {
+            // Already rebuilt
+            data = (const uint8_t*)(MAIN_APPLICATION_START_ADDRESS + source);
+            chunk = (chunk > previous - source) ? previous - source : chunk;
+        } else if (bytes_written >= DELTA_PAGE_SIZE && source < bytes_written) {
+            // Rebuilt just now, its old contents are still in RAM
+            data = &delta_previous[source - previous];
+            chunk = (chunk > bytes_written - source) ? bytes_written - source : chunk;
+        } else {
+            // Not rebuilt yet, the page being built included
+            data = (const uint8_t*)(MAIN_APPLICATION_START_ADDRESS + source);
+        }
+        chunk = (chunk > length) ? length : chunk;
+
+        DELTA_Append(data, chunk);
+        source += chunk;
+        length -= chunk;
+    }
+}
+
+static void WRITE_Firmware_Delta(const uint8_t* data, uint32_t length) {
+    uint8_t run_buffer[RLE_RUN_CHUNK];
+    uint32_t i = 0;
+
+    while (i < length) {
+        uint8_t control = data[i++];
+
+        if ((control & DELTA_TOKEN_MASK) == DELTA_COPY) {
+            if (length - i < 3) {
+                break;
+            }
+
+            uint32_t count = (((uint32_t)(control & ~DELTA_TOKEN_MASK) << 8) | data[i]) + 1;
+            uint32_t source = (uint32_t)data[i + 1] | ((uint32_t)data[i + 2] << 8);
+            i += 3;
+            if (source + count > MAX_FIRMWARE_SIZE) {
+                break;
+            }
+            DELTA_Copy(source, count);
+        } else if ((control & DELTA_TOKEN_MASK) == DELTA_RUN) {
+            if (i >= length) {
+                break;
+            }
+
+            uint32_t run = (control & ~DELTA_TOKEN_MASK) + RLE_MIN_RUN;
+            memset(run_buffer, data[i++], sizeof(run_buffer));
+            while (run > 0) {
+                uint32_t chunk = (run > sizeof(run_buffer)) ? sizeof(run_buffer) : run;
+                DELTA_Append(run_buffer, chunk);
+                run -= chunk;
+            }
+        } else {
+            uint32_t literal = (uint32_t)control + 1;
+            if (literal > length - i) {
+                literal = length - i;
+            }
+            DELTA_Append(&data[i], literal);
+            i += literal;
+        }
+    }
+}
+
+static void CREATE_MESSAGE_Firmware_Length_Req(tl_segment_t* segment) {
+    // Advertise the largest payload and window we take, the host chooses its segment size from these
+    tl_create_single_byte_segment(segment, BL_AL_MESSAGE_FW_LENGTH_REQ);
+    segment->segment_data_size = 11;
+    segment->data[1] = SEGMENT_DATA_SIZE;
+    segment->data[2] = TL_WINDOW_SIZE;
+
+    // Where an interrupted transfer got to. The host only resumes if its image has the same CRC-32 up to there
+    resume_offset = PROGRESS_Resume_Offset();
+    const uint32_t resume_crc = (resume_offset != 0) ? BL_FLASH_PROGRESS_Get()->crc32 : 0;
+    memcpy(&segment->data[3], &resume_offset, sizeof(resume_offset));
+    memcpy(&segment->data[7], &resume_crc, sizeof(resume_crc));
+}
+
+static void CREATE_MESSAGE_Page_Hash_Res(tl_segment_t* segment, uint32_t first, uint32_t count) {
+    const uint32_t pages = MAX_FIRMWARE_SIZE / DELTA_PAGE_SIZE;
+    first = (first > pages) ? pages : first;
+    count = (count > PAGE_HASH_MAX_COUNT) ? PAGE_HASH_MAX_COUNT : count;
+    count = (count > pages - first) ? pages - first : count;
+
+    tl_create_single_byte_segment(segment, BL_AL_MESSAGE_PAGE_HASH_RES);
+    segment->segment_data_size = 4 + 4 * count;
+    segment->data[1] = (uint8_t)first;
+    segment->data[2] = (uint8_t)(first >> 8);
+    segment->data[3] = (uint8_t)count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* page = (const uint8_t*)(MAIN_APPLICATION_START_ADDRESS + (first + i) * DELTA_PAGE_SIZE);
+        const uint32_t hash = crc32(page, DELTA_PAGE_SIZE);
+        memcpy(&segment->data[4 + 4 * i], &hash, sizeof(hash));
+    }
+}
+
+static void CREATE_MESSAGE_Ready_For_Data(tl_segment_t* segment, uint32_t offset, bool delta) {
+    tl_create_single_byte_segment(segment, BL_AL_MESSAGE_READY_FOR_DATA);
+    segment->segment_data_size = 6;
+    memcpy(&segment->data[1], &offset, sizeof(offset));
+    segment->data[5] = delta ? 1 : 0;
 }
 
 int main(void) {
     SYSTEM_Init();
     GPIO_Init();
     UART_Init();
+    CRC32_Init();
     TL_Init();
     TIMER_Init(&timer, DEFAULT_TIMEOUT, false);
+    boot_baud_rate = uart_get_baudrate();
 
     while (state != BL_AL_STATE_Done) {
         if (state == BL_AL_STATE_Sync) {
@@ -130,12 +464,14 @@ int main(void) {
                 is_match = is_match && (sync_seq[3] == SYNC_SEQ_3);
             
                 if (is_match) {
+                    TL_Init();
                     tl_create_single_byte_segment(&temp_segment, BL_AL_MESSAGE_SEQ_OBSERVED);
                     tl_write(&temp_segment);
                     state = BL_AL_STATE_WaitForUpdateReq;
                 } else {
                     if (TIMER_Is_Elapsed(&timer)) {
-                        state = BL_AL_STATE_Done;
+                        // The timer is one-shot, with no valid image we keep waiting for a host from now on
+                        state = IS_IMAGE_Valid() ? BL_AL_STATE_Done : BL_AL_STATE_Sync;
                         continue;
                     } else {
                         continue;
@@ -143,7 +479,8 @@ int main(void) {
                 }
             } else {
                 if (TIMER_Is_Elapsed(&timer)) {
-                    state = BL_AL_STATE_Done;
+                    // The timer is one-shot, with no valid image we keep waiting for a host from now on
+                    state = IS_IMAGE_Valid() ? BL_AL_STATE_Done : BL_AL_STATE_Sync;
                     continue;
                 } else {
                     continue;
@@ -162,6 +499,24 @@ int main(void) {
                         tl_create_single_byte_segment(&temp_segment,  BL_AL_MESSAGE_FW_UPDATE_RES);
                         tl_write(&temp_segment);
                         state = BL_AL_STATE_DeviceIDReq;
+                    } else if (IS_MESSAGE_Baud_Req(&temp_segment)) {
+                        uint32_t baud_rate;
+                        memcpy(&baud_rate, &temp_segment.data[1], sizeof(baud_rate));
+                        const bool accepted = uart_baudrate_supported(baud_rate);
+
+                        tl_create_single_byte_segment(&temp_segment, BL_AL_MESSAGE_BAUD_RES);
+                        temp_segment.segment_data_size = 2;
+                        temp_segment.data[1] = accepted ? 1 : 0;
+                        tl_write(&temp_segment);
+
+                        if (accepted) {
+                            // uart_set_baudrate lets BAUD_RES leave at the old rate, then both sides start over
+                            previous_baud_rate = uart_get_baudrate();
+                            uart_set_baudrate(baud_rate);
+                            TL_Init();
+                            TIMER_Init(&baud_timer, BAUD_PROBE_TIMEOUT, false);
+                            state = BL_AL_STATE_BaudProbe;
+                        }
                     } else {
                         continue;
                     }
@@ -169,6 +524,36 @@ int main(void) {
                     continue;
                 }
             } break;
+
+            case BL_AL_STATE_BaudProbe: {
+                if (tl_segment_available()) {
+                    tl_read(&temp_segment);
+
+                    if (IS_MESSAGE_Baud_Probe(&temp_segment)) {
+                        // Echo it, the host only keeps the new rate if this comes back intact
+                        tl_write(&temp_segment);
+                        TIMER_Init(&baud_timer, BAUD_PROBE_TIMEOUT, false);
+                        state = BL_AL_STATE_BaudConfirm;
+                    } else {
+                        BAUD_Revert();
+                    }
+                } else if (TIMER_Is_Elapsed(&baud_timer)) {
+                    BAUD_Revert();
+                } else {
+                    continue;
+                }
+            } break;
+
+            case BL_AL_STATE_BaudConfirm: {
+                // Any good segment at the new rate means the host got the echo, WaitForUpdateReq handles it
+                if (tl_segment_available()) {
+                    state = BL_AL_STATE_WaitForUpdateReq;
+                } else if (TIMER_Is_Elapsed(&baud_timer)) {
+                    BAUD_Revert();
+                } else {
+                    continue;
+                }
+            } break;
             
             case BL_AL_STATE_DeviceIDReq: {
                 tl_create_single_byte_segment(&temp_segment, BL_AL_MESSAGE_DEVICE_ID_REQ);
@@ -191,7 +576,7 @@ int main(void) {
             } break;
             
             case BL_AL_STATE_FirmwareLengthReq: {
-                tl_create_single_byte_segment(&temp_segment, BL_AL_MESSAGE_FW_LENGTH_REQ);
+                CREATE_MESSAGE_Firmware_Length_Req(&temp_segment);
                 tl_write(&temp_segment);
                 state = BL_AL_STATE_FirmwareLengthRes;
             } break;
@@ -199,14 +584,48 @@ int main(void) {
             case BL_AL_STATE_FirmwareLengthRes: {
                 if (tl_segment_available()) {
                     tl_read(&temp_segment);
+
+                    // The host asks for what flash holds page by page, so it can send only the pages that differ
+                    if (IS_MESSAGE_Page_Hash_Req(&temp_segment)) {
+                        const uint32_t first = temp_segment.data[1] | ((uint32_t)temp_segment.data[2] << 8);
+                        CREATE_MESSAGE_Page_Hash_Res(&temp_segment, first, temp_segment.data[3]);
+                        tl_write(&temp_segment);
+                        continue;
+                    }
+
                     firmware_size = (
                         (temp_segment.data[1])       |
                         (temp_segment.data[2] << 8)  |
                         (temp_segment.data[3] << 16) |
                         (temp_segment.data[4] << 24) 
                     );
+                    firmware_crc = (
+                        (temp_segment.data[5])       |
+                        (temp_segment.data[6] << 8)  |
+                        (temp_segment.data[7] << 16) |
+                        (temp_segment.data[8] << 24) 
+                    );
 
-                    if (IS_MESSAGE_Firmware_Size(&temp_segment) && (firmware_size <= MAX_FIRMWARE_SIZE) && (firmware_size % 4 == 0)) {
+                    if (IS_MESSAGE_Firmware_Size(&temp_segment) && (firmware_size > 0) && (firmware_size <= MAX_FIRMWARE_SIZE) && (firmware_size % 4 == 0)) {
+                        uint32_t requested_offset = 0;
+                        if (temp_segment.segment_data_size == 13) {
+                            memcpy(&requested_offset, &temp_segment.data[9], sizeof(requested_offset));
+                        }
+
+                        // Anything but the offset we offered starts over, READY_FOR_DATA tells the host which it got
+                        if (requested_offset == 0 || requested_offset != resume_offset || requested_offset >= firmware_size) {
+                            resume_offset = 0;
+                        }
+
+                        // A delta only makes sense against the image it was made from, else the host sends it all
+                        delta_base = false;
+                        if (temp_segment.segment_data_size == 21 && requested_offset == 0) {
+                            uint32_t base_length;
+                            uint32_t base_crc;
+                            memcpy(&base_length, &temp_segment.data[13], sizeof(base_length));
+                            memcpy(&base_crc, &temp_segment.data[17], sizeof(base_crc));
+                            delta_base = IS_DELTA_Base(base_length, base_crc);
+                        }
                         state = BL_AL_STATE_EraseApplication;
                     } else {
                         continue;
@@ -217,44 +636,81 @@ int main(void) {
             } break;
             
             case BL_AL_STATE_EraseApplication: {
-                BL_FLASH_ERASE_Main_Application();
-                tl_create_single_byte_segment(&temp_segment, BL_AL_MESSAGE_READY_FOR_DATA);
+                // From here on the old image is gone, make sure it can't be booted until the new one checks out
+                BL_FLASH_IMAGE_Invalidate_Descriptor();
+                if (resume_offset != 0) {
+                    // The record was checked against flash when it was offered, carry on hashing from there
+                    running_crc = BL_FLASH_PROGRESS_Get()->crc32 ^ CRC32_FINAL_XOR;
+                } else {
+                    BL_FLASH_PROGRESS_Clear();
+                    running_crc = CRC32_INIT;
+                }
+                bytes_written = resume_offset;
+                next_commit = resume_offset + PROGRESS_INTERVAL;
+
+                // A delta reads the old image while it is being replaced, so its pages are only erased one by one
+                if (!ERASE_AS_YOU_GO && !delta_base) {
+                    BL_FLASH_ERASE_Main_Application(resume_offset, firmware_size, ERASE_SKIP_BLANK_PAGES);
+                }
+                BL_FLASH_WRITE_Begin(MAIN_APPLICATION_START_ADDRESS + resume_offset, ERASE_AS_YOU_GO || delta_base);
+                delta_fill = 0;
+                CREATE_MESSAGE_Ready_For_Data(&temp_segment, resume_offset, delta_base);
                 tl_write(&temp_segment);
+                TIMER_Init(&timer, RECEIVE_IDLE_TIMEOUT, false);
                 state = BL_AL_STATE_ReceiveFirmware; 
             } break;
             
             case BL_AL_STATE_ReceiveFirmware: {
-                if (tl_segment_available()) {
-                    tl_read(&temp_segment);
-                    
-                    for (uint8_t i = 0; i < temp_segment.segment_data_size; i = i + 4) {
-                        uint32_t firmware_data = (
-                            (temp_segment.data[i])           |
-                            (temp_segment.data[i + 1] << 8)  |
-                            (temp_segment.data[i + 2] << 16) |
-                            (temp_segment.data[i + 3] << 24) 
-                        );
-                        HAL_FLASH_Unlock();
-                        HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, MAIN_APPLICATION_START_ADDRESS + bytes_written, firmware_data);
-                        HAL_FLASH_Lock();
-                        bytes_written += 4;
+                const tl_segment_t* segment = tl_borrow();
+                if (segment != NULL) {
+                    // Program straight out of the segment queue, the segment is ACKed once it is released
+                    if (segment->segment_type == SEGMENT_DATA_RLE) {
+                        WRITE_Firmware_RLE(segment->data, segment->segment_data_size);
+                    } else if (segment->segment_type == SEGMENT_DATA_DELTA) {
+                        WRITE_Firmware_Delta(segment->data, segment->segment_data_size);
+                    } else {
+                        WRITE_Firmware(segment->data, segment->segment_data_size);
                     }
+                    tl_release();
+                    TIMER_Reset(&timer);
                     
-                    if (bytes_written >= MAX_FIRMWARE_SIZE) {
-                        tl_create_single_byte_segment(&temp_segment, BL_AL_MESSAGE_UPDATE_SUCCESSFUL);
-                        tl_write(&temp_segment);
-                        state = BL_AL_STATE_Done;
-                    } else {
-                        tl_create_single_byte_segment(&temp_segment, BL_AL_MESSAGE_READY_FOR_DATA);
-                        tl_write(&temp_segment);
+                    // The transport ACK for each segment paces the host, no per-segment READY_FOR_DATA needed
+                    if (bytes_written >= firmware_size) {
+                        BL_FLASH_WRITE_Flush();
+
+                        if ((running_crc ^ CRC32_FINAL_XOR) == firmware_crc) {
+                            bl_image_descriptor_t descriptor = {
+                                .magic = BL_IMAGE_DESCRIPTOR_MAGIC,
+                                .length = firmware_size,
+                                .crc32 = firmware_crc,
+                            };
+                            BL_FLASH_IMAGE_Write_Descriptor(&descriptor);
+                            BL_FLASH_PROGRESS_Clear();
+
+                            tl_segment_t* response = tl_acquire();
+                            tl_create_single_byte_segment(response, BL_AL_MESSAGE_UPDATE_SUCCESSFUL);
+                            tl_write(response);
+                            state = BL_AL_STATE_Done;
+                        } else {
+                            // Corrupt image, never boot it. Stay in the bootloader so the host can sync and retry.
+                            // The progress record stays: the host only resumes from it if the CRC-32 up to there
+                            // matches its image, so a corrupt stretch before the last commit means starting over
+                            tl_segment_t* response = tl_acquire();
+                            tl_create_single_byte_segment(response, BL_AL_MESSAGE_NACK);
+                            tl_write(response);
+                            STATE_Back_To_Sync();
+                        }
                     }
+                } else if (TIMER_Is_Elapsed(&timer)) {
+                    // Link dropped mid-image, the progress record lets the host resume
+                    STATE_Back_To_Sync();
                 } else {
                     continue;
                 }
             } break;
 
             default: {
-                state = BL_AL_STATE_Sync;
+                STATE_Back_To_Sync();
             }
         }
     }
@@ -4,28 +4,54 @@
 
 #include "string.h"
 
-#define SEGMENT_BUFFER_LENGTH (8)
+#define SEGMENT_BUFFER_LENGTH (2 * TL_WINDOW_SIZE) // Power of 2, one slot always stays free
+#define TL_RX_CHUNK_SIZE (64) // Bytes taken out of the UART per parser pass
 
 typedef enum tl_state_t {
-    TL_State_Segment_Data_Size,
-    TL_State_Segment_Type,
-    TL_State_Data,
-    TL_State_Segment_CRC,
+    TL_State_Frame_Code, // Next byte is a COBS code byte, or the delimiter that ends the frame
+    TL_State_Frame_Block, // Copying the non-zero bytes of a COBS block
+    TL_State_Frame_Discard, // Frame is broken, skip everything up to the next delimiter
 } tl_state_t;
 
-static tl_state_t state = TL_State_Segment_Data_Size;
-static uint8_t data_byte_count = 0;
+static tl_state_t state = TL_State_Frame_Code;
+static uint8_t frame_length = 0; // Decoded bytes of the current frame, written straight into rx_segment
+static uint8_t block_remaining = 0; // Bytes left in the current COBS block
+static bool block_zero = false; // The current block stands for a zero after it, unless the frame ends there
+static bool frame_open = false; // Something other than a delimiter arrived since the last frame ended
+
+// Encoded outgoing segment, uart_write copies it into the TX queue so one buffer is enough
+static uint8_t tx_frame[SEGMENT_FRAME_LENGTH(SEGMENT_DATA_SIZE)];
 
-static tl_segment_t temp_segment = { .segment_data_size = 0, .data = {0}, .segment_crc = 0 };
 static tl_segment_t retx_segment = { .segment_data_size = 0, .data = {0}, .segment_crc = 0 };
 static tl_segment_t ack_segment = { .segment_data_size = 0, .data = {0}, .segment_crc = 0 };
-static tl_segment_t last_transmitted_segment = { .segment_data_size = 0, .data = {0}, .segment_crc = 0 };
 
 static tl_segment_t segment_buffer[SEGMENT_BUFFER_LENGTH];
 static uint32_t segment_read_index = 0;
 static uint32_t segment_write_index = 0;
 static uint32_t segment_buffer_mask = SEGMENT_BUFFER_LENGTH - 1;
 
+// The parser fills the free slot at segment_write_index in place, accepting a segment is just advancing the index.
+// There is always one free slot, so it never touches a segment the application has borrowed.
+static tl_segment_t* rx_segment = &segment_buffer[0];
+
+// Receive side: segments are only accepted in order and ACKed once the application has read them
+static uint8_t rx_next_seq = 0; // Next sequence number accepted into segment_buffer
+static uint8_t rx_ack_seq = 0; // Cumulative ACK: sequence number after the last segment handed to tl_read
+static bool rx_retx_pending = false; // A RETX for rx_next_seq is outstanding, drop out-of-order segments quietly
+static bool rx_ack_pending = false; // tl_read handed a segment out, ACK it once the application is done with it
+static bool rx_busy = false; // segment_buffer was full and we told the host, RETX rx_next_seq once there is room
+
+// Transmit side: the last TL_WINDOW_SIZE data segments are kept until the host ACKs them
+static tl_segment_t retransmit_queue[TL_WINDOW_SIZE];
+static uint8_t tx_next_seq = 0; // Sequence number of the next data segment we send
+static uint8_t tx_base_seq = 0; // Oldest data segment not yet ACKed by the host
+
+// Both queues grow with TL_WINDOW_SIZE (3 segments per window slot), what is left of the 8 KByte RAM goes to the RX
+// DMA ring, the TX queue, the flash writer's buffers and the stack
+#define TL_QUEUE_RAM_BUDGET (3328U)
+_Static_assert(sizeof(segment_buffer) + sizeof(retransmit_queue) <= TL_QUEUE_RAM_BUDGET,
+               "TL_WINDOW_SIZE too large for the segment queues to fit in RAM");
+
 bool tl_is_retx_segment(const tl_segment_t* segment) {
     if (segment->segment_data_size != 0) {
         return false;
@@ -35,12 +61,6 @@ bool tl_is_retx_segment(const tl_segment_t* segment) {
         return false;
     }
 
-    for (uint8_t i = 0; i < SEGMENT_DATA_SIZE; i++) {
-        if (segment->data[i] != 0xff) {
-            return false;
-        }
-    }
-
     return true;
 }
 
@@ -53,10 +73,16 @@ bool tl_is_ack_segment(const tl_segment_t* segment) {
         return false;
     }
 
-    for (uint8_t i = 0; i < SEGMENT_DATA_SIZE; i++) {
-        if (segment->data[i] != 0xff) {
-            return false;
-        }
+    return true;
+}
+
+bool tl_is_busy_segment(const tl_segment_t* segment) {
+    if (segment->segment_data_size != 0) {
+        return false;
+    }
+
+    if (segment->segment_type != SEGMENT_BUSY) {
+        return false;
     }
 
     return true;
@@ -67,7 +93,8 @@ bool tl_is_single_byte_segment(const tl_segment_t* segment, const uint8_t byte)
         return false;
     }
 
-    if (segment->segment_type == SEGMENT_ACK || segment->segment_type == SEGMENT_RETX || segment->segment_type != 0) {
+    // Messages only travel in plain DATA segments, never in ACK, RETX, BUSY or the RLE/delta firmware data
+    if (segment->segment_type != SEGMENT_DATA) {
         return false;
     }
 
@@ -75,26 +102,30 @@ bool tl_is_single_byte_segment(const tl_segment_t* segment, const uint8_t byte)
         return false;
     }
 
-    for (uint8_t i = 1; i < SEGMENT_DATA_SIZE; i++) {
-        if (segment->data[i] != 0xff) {
-            return false;
-        }
-    }
-
     return true;
 }
 
-void tl_create_retx_segment(tl_segment_t* segment) {
+void tl_create_retx_segment(tl_segment_t* segment, uint8_t seq) {
     memset(segment, 0xff, sizeof(tl_segment_t));
     segment->segment_data_size = 0;
     segment->segment_type = SEGMENT_RETX;
+    segment->segment_seq = seq;
     segment->segment_crc = tl_compute_crc(segment);
 }
 
-void tl_create_ack_segment(tl_segment_t* segment) {
+void tl_create_ack_segment(tl_segment_t* segment, uint8_t seq) {
     memset(segment, 0xff, sizeof(tl_segment_t));
     segment->segment_data_size = 0;
     segment->segment_type = SEGMENT_ACK;
+    segment->segment_seq = seq;
+    segment->segment_crc = tl_compute_crc(segment);
+}
+
+void tl_create_busy_segment(tl_segment_t* segment, uint8_t seq) {
+    memset(segment, 0xff, sizeof(tl_segment_t));
+    segment->segment_data_size = 0;
+    segment->segment_type = SEGMENT_BUSY;
+    segment->segment_seq = seq;
     segment->segment_crc = tl_compute_crc(segment);
 }
 
@@ -106,83 +137,328 @@ void tl_create_single_byte_segment(tl_segment_t* segment, uint8_t byte) {
     segment->segment_crc = tl_compute_crc(segment);
 }
 
-void TL_Init(void) {
-    tl_create_retx_segment(&retx_segment);
-    tl_create_ack_segment(&ack_segment);
+static void tl_send(const tl_segment_t* segment) {
+    // COBS: every zero is replaced by the distance to the next one, the first distance leads the frame.
+    // Segments are shorter than 254 bytes, so a block never needs splitting.
+    const uint8_t* bytes = (const uint8_t*)segment;
+    const uint32_t length = SEGMENT_HEADER_SIZE + segment->segment_data_size;
+    uint32_t code_index = 0;
+    uint32_t out = 1;
+
+    for (uint32_t i = 0; i <= length; i++) {
+        const uint8_t byte = (i < length) ? bytes[i] : segment->segment_crc;
+        if (byte == 0) {
+            tx_frame[code_index] = (uint8_t)(out - code_index);
+            code_index = out++;
+        } else {
+            tx_frame[out++] = byte;
+        }
+    }
+    tx_frame[code_index] = (uint8_t)(out - code_index);
+    tx_frame[out++] = TL_FRAME_DELIMITER;
+
+    uart_write(tx_frame, out);
 }
 
-void TL_Update(void) {
-    while (uart_data_available()) {
+static void tl_send_ack(uint8_t seq) {
+    tl_create_ack_segment(&ack_segment, seq);
+    tl_send(&ack_segment);
+}
+
+// The ACK for a segment goes out on the next TL_Update or tl_write, i.e. after the application has finished with it
+// (flash erase/program included). A slow flash therefore holds back the host's window instead of overrunning us.
+static void tl_flush_ack(void) {
+    if (rx_ack_pending) {
+        rx_ack_pending = false;
+        tl_send_ack(rx_ack_seq);
+    }
+}
+
+static void tl_send_retx(uint8_t seq) {
+    tl_create_retx_segment(&retx_segment, seq);
+    tl_send(&retx_segment);
+}
+
+// After a BUSY, the RETX for the first dropped segment is what lets the host go on
+static void tl_flush_busy(void) {
+    uint32_t next_write_index = (segment_write_index + 1) & segment_buffer_mask;
+
+    if (rx_busy && next_write_index != segment_read_index) {
+        rx_busy = false;
+        tl_send_retx(rx_next_seq);
+    }
+}
+
+static void tl_handle_ack(uint8_t seq) {
+    // Cumulative, release everything before seq as long as it is inside the outstanding window
+    if ((uint8_t)(seq - tx_base_seq) <= (uint8_t)(tx_next_seq - tx_base_seq)) {
+        tx_base_seq = seq;
+    }
+}
+
+static void tl_handle_retx(uint8_t seq) {
+    // Go back to seq and re-send it along with every segment sent after it
+    if ((uint8_t)(seq - tx_base_seq) >= (uint8_t)(tx_next_seq - tx_base_seq)) {
+        return;
+    }
+
+    for (uint8_t i = seq; i != tx_next_seq; i++) {
+        tl_send(&retransmit_queue[i & (TL_WINDOW_SIZE - 1)]);
+    }
+}
+
+static void tl_handle_data(void) {
+    if (rx_segment->segment_seq != rx_next_seq) {
+        uint8_t behind = (uint8_t)(rx_next_seq - rx_segment->segment_seq);
+        if (behind >= 1 && behind <= TL_WINDOW_SIZE) {
+            // Duplicate of something we already have, our ACK was probably lost
+            tl_send_ack(rx_ack_seq);
+        } else if (!rx_retx_pending) {
+            // A segment went missing, ask for it once and drop everything until it shows up
+            tl_send_retx(rx_next_seq);
+            rx_retx_pending = true;
+        }
+        return;
+    }
+
+    uint32_t next_write_index = (segment_write_index + 1) & segment_buffer_mask;
+    if (next_write_index == segment_read_index) {
+        // Host ignored the window (or the application is slow to release), drop it and tell the host to pause.
+        // Everything after it is dropped quietly, as for a gap, until the RETX from tl_flush_busy.
+        if (!rx_busy) {
+            tl_create_busy_segment(&retx_segment, rx_next_seq);
+            tl_send(&retx_segment);
+            rx_busy = true;
+        }
+        rx_retx_pending = true;
+        return;
+    }
+
+    segment_write_index = next_write_index;
+    rx_segment = &segment_buffer[segment_write_index];
+    rx_next_seq++;
+    rx_retx_pending = false;
+}
+
+static void tl_frame_reset(void) {
+    state = TL_State_Frame_Code;
+    frame_length = 0;
+    block_remaining = 0;
+    block_zero = false;
+    frame_open = false;
+}
+
+// A frame that did not decode to a good segment, ask for rx_next_seq again as for a CRC error
+static void tl_frame_error(void) {
+    tl_send_retx(rx_next_seq);
+    rx_retx_pending = true;
+}
+
+static void tl_handle_segment(void) {
+    if (rx_segment->segment_crc != tl_compute_crc(rx_segment)) {
+        tl_frame_error();
+        return;
+    }
+
+    if (tl_is_retx_segment(rx_segment)) {
+        tl_handle_retx(rx_segment->segment_seq);
+        return;
+    }
+
+    if (tl_is_ack_segment(rx_segment)) {
+        tl_handle_ack(rx_segment->segment_seq);
+        return;
+    }
+
+    if (tl_is_busy_segment(rx_segment)) {
+        // We never send faster than the host ACKs, nothing to pause
+        return;
+    }
+
+    tl_handle_data();
+}
+
+static void tl_handle_frame(void) {
+    if (!frame_open) {
+        // Back to back delimiters, e.g. a host flushing the line, not a frame
+        return;
+    }
+
+    // The decoded frame is the segment as it is laid out in tl_segment_t, the CRC byte lands right behind the
+    // data and is moved to segment_crc (for a full segment it already is segment_crc)
+    if ((frame_length < SEGMENT_HEADER_SIZE + SEGMENT_CRC_SIZE) ||
+        (rx_segment->segment_data_size != frame_length - SEGMENT_HEADER_SIZE - SEGMENT_CRC_SIZE)) {
+        tl_frame_error();
+        return;
+    }
+
+    rx_segment->segment_crc = ((uint8_t*)rx_segment)[frame_length - 1];
+    tl_handle_segment();
+}
+
+static bool tl_frame_append(const uint8_t* bytes, uint32_t count) {
+    if (frame_length + count > SEGMENT_LENGTH) {
+        return false;
+    }
+
+    memcpy(&((uint8_t*)rx_segment)[frame_length], bytes, count);
+    frame_length += count;
+    return true;
+}
+
+static void tl_parse(const uint8_t* bytes, uint32_t count) {
+    static const uint8_t zero = 0;
+    uint32_t i = 0;
+
+    while (i < count) {
         switch (state) {
-            case TL_State_Segment_Data_Size: {
-                temp_segment.segment_data_size = uart_read_byte();
-                state = TL_State_Segment_Type;
-            }  break;
-            
-            case TL_State_Segment_Type: {
-                temp_segment.segment_type = uart_read_byte();
-                state = TL_State_Data;
-            } break;
+            case TL_State_Frame_Code: {
+                const uint8_t code = bytes[i++];
+                if (code == TL_FRAME_DELIMITER) {
+                    tl_handle_frame();
+                    tl_frame_reset();
+                    break;
+                }
 
-            case TL_State_Data: {
-                temp_segment.data[data_byte_count++] = uart_read_byte();
-                if (data_byte_count >= SEGMENT_DATA_SIZE) {
-                    data_byte_count = 0;
-                    state = TL_State_Segment_CRC;
+                frame_open = true;
+                if (block_zero && !tl_frame_append(&zero, 1)) {
+                    state = TL_State_Frame_Discard;
+                    break;
                 }
+                block_remaining = code - 1;
+                block_zero = (code != 0xFF);
+                state = (block_remaining != 0) ? TL_State_Frame_Block : TL_State_Frame_Code;
             } break;
 
-            case TL_State_Segment_CRC: {
-                temp_segment.segment_crc = uart_read_byte();
-                if (temp_segment.segment_crc != tl_compute_crc(&temp_segment)) {
-                    tl_write(&retx_segment);
-                    state = TL_State_Segment_Data_Size;
-                    break;
+            case TL_State_Frame_Block: {
+                // Take whatever of the block has arrived in one go rather than byte by byte
+                uint32_t span = count - i;
+                if (span > block_remaining) {
+                    span = block_remaining;
                 }
 
-                if (tl_is_retx_segment(&temp_segment)) {
-                    tl_write(&last_transmitted_segment);
-                    state = TL_State_Segment_Data_Size;
+                // A delimiter inside a block means bytes went missing, the frame ends early and is broken
+                const uint8_t* delimiter = memchr(&bytes[i], TL_FRAME_DELIMITER, span);
+                if (delimiter != NULL) {
+                    i = (uint32_t)(delimiter - bytes) + 1;
+                    tl_frame_error();
+                    tl_frame_reset();
                     break;
                 }
 
-                if (tl_is_ack_segment(&temp_segment)) {
-                    state = TL_State_Segment_Data_Size;
+                if (!tl_frame_append(&bytes[i], span)) {
+                    state = TL_State_Frame_Discard;
                     break;
                 }
+                i += span;
+                block_remaining -= span;
+                if (block_remaining == 0) {
+                    state = TL_State_Frame_Code;
+                }
+            } break;
 
-                uint32_t next_write_index = (segment_write_index + 1) & segment_buffer_mask;
-                if (next_write_index == segment_read_index) {
-                    __asm__("BKPT #0");
+            case TL_State_Frame_Discard: {
+                const uint8_t* delimiter = memchr(&bytes[i], TL_FRAME_DELIMITER, count - i);
+                if (delimiter == NULL) {
+                    i = count;
+                    break;
                 }
-                
-                memcpy(&segment_buffer[segment_write_index], &temp_segment, sizeof(tl_segment_t));
-                segment_write_index = next_write_index;
-                tl_write(&ack_segment);
-                state = TL_State_Segment_Data_Size;
+
+                i = (uint32_t)(delimiter - bytes) + 1;
+                tl_frame_error();
+                tl_frame_reset();
             } break;
 
             default: {
-                state = TL_State_Segment_Data_Size;
+                tl_frame_reset();
             }
         }
     }
 }
 
+// Also used to start over after a re-sync, the host restarts its sequence numbers at 0
+void TL_Init(void) {
+    tl_frame_reset();
+    segment_read_index = 0;
+    segment_write_index = 0;
+    rx_segment = &segment_buffer[0];
+
+    rx_next_seq = 0;
+    rx_ack_seq = 0;
+    rx_retx_pending = false;
+    rx_ack_pending = false;
+    rx_busy = false;
+
+    tx_next_seq = 0;
+    tx_base_seq = 0;
+
+    tl_create_retx_segment(&retx_segment, 0);
+    tl_create_ack_segment(&ack_segment, 0);
+}
+
+void TL_Update(void) {
+    tl_flush_ack();
+    tl_flush_busy();
+
+    uint8_t chunk[TL_RX_CHUNK_SIZE];
+    while (uart_data_available()) {
+        const uint32_t count = uart_read(chunk, sizeof(chunk));
+        tl_parse(chunk, count);
+    }
+}
+
 bool tl_segment_available(void) {
     return segment_read_index != segment_write_index;
 }
 
+tl_segment_t* tl_acquire(void) {
+    return &retransmit_queue[tx_next_seq & (TL_WINDOW_SIZE - 1)];
+}
+
 void tl_write(tl_segment_t* segment) {
-    uart_write((uint8_t*)segment, SEGMENT_LENGTH);
-    memcpy(&last_transmitted_segment, segment, sizeof(tl_segment_t));
+    tl_flush_ack();
+
+    if ((uint8_t)(tx_next_seq - tx_base_seq) >= TL_WINDOW_SIZE) {
+        // The host never ACKed the oldest segment, it falls out of the retransmit queue
+        tx_base_seq++;
+    }
+
+    tl_segment_t* slot = tl_acquire();
+    segment->segment_seq = tx_next_seq;
+    segment->segment_crc = tl_compute_crc(segment);
+    if (segment != slot) {
+        // Built outside the queue, keep a copy for retransmission
+        memcpy(slot, segment, SEGMENT_HEADER_SIZE + segment->segment_data_size);
+        slot->segment_crc = segment->segment_crc;
+    }
+    tx_next_seq++;
+    tl_send(slot);
 }
 
-void tl_read(tl_segment_t* segment) {
-    memcpy(segment, &segment_buffer[segment_read_index], sizeof(tl_segment_t));
+const tl_segment_t* tl_borrow(void) {
+    if (!tl_segment_available()) {
+        return NULL;
+    }
+
+    return &segment_buffer[segment_read_index];
+}
+
+void tl_release(void) {
+    const tl_segment_t* segment = &segment_buffer[segment_read_index];
+
+    // ACK on release rather than on receipt, so in-flight segments always fit in segment_buffer
+    rx_ack_seq = segment->segment_seq + 1;
+    rx_ack_pending = true;
     segment_read_index = (segment_read_index + 1) & segment_buffer_mask;
 }
 
+void tl_read(tl_segment_t* segment) {
+    const tl_segment_t* borrowed = tl_borrow();
+    memcpy(segment, borrowed, sizeof(tl_segment_t));
+    tl_release();
+}
+
 uint8_t tl_compute_crc(tl_segment_t* segment) {
-    return crc8((uint8_t*)segment, SEGMENT_LENGTH - SEGMENT_CRC_SIZE);
+    // Header and data are contiguous in tl_segment_t, covers exactly the bytes that go on the wire
+    return crc8((uint8_t*)segment, SEGMENT_HEADER_SIZE + segment->segment_data_size);
 }
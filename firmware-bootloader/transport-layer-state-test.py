@@ -1,66 +1,41 @@
-import serial # pyright: ignore[reportMissingModuleSource]\
+import os
+import sys
 import time
-from array import array
-from enum import Enum
 
-serial = serial.Serial(port='/dev/tty.usbmodem1203', baudrate=115200, timeout=0)
+# Framing, CRC and the sync sequence come from the simulator's host, so this stays in step with the bootloader
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "sim"))
+import bl_host  # noqa: E402
 
-SEGMENT_BUFFER_LENGTH = 8
+# A serial port or the pty printed by sim/firmware-bootloader-sim
+port = sys.argv[1] if len(sys.argv) > 1 else "/dev/tty.usbmodem1203"
+link = bl_host.Link(port, bl_host.DEFAULT_BAUD_RATE)
 
-SEGMENT_DATA_SIZE = 32 # Up to 32 Bytes
-SEGMENT_TYPE_SIZE = 1 # 1 Byte
-SEGMENT_LENGTH_SIZE = 1 # 1 Byte
-SEGMENT_CRC_SIZE = 1 # 1 Byte
-SEGMENT_LENGTH = (SEGMENT_DATA_SIZE + SEGMENT_LENGTH_SIZE + SEGMENT_CRC_SIZE + SEGMENT_TYPE_SIZE) # Up to 35 Byte
-
-# Define the states
-class TL_STATE_T(Enum):
-    TL_State_Segment_Data_Size = 1
-    TL_State_Segment_Type = 2
-    TL_State_Data = 3
-    TL_State_Segment_CRC = 4
-
-test_segment = array('B', [0xFF] * 35)
-
-#define SYNC_SEQ_0 (0x01)
-#define SYNC_SEQ_1 (0x02)
-#define SYNC_SEQ_2 (0x03)
-#define SYNC_SEQ_3 (0x04)
-
-while(True):
-    test_segment[0] = 0x00
-    test_segment[1] = 0x00
-
-    serial.write(0x01)
-    serial.write(0x02)
-    serial.write(0x03)
-    serial.write(0x04)
-
-    # for i in range(35):
-    #     segment_to_send = test_segment[i].to_bytes(1)
-        
-    #     segment_to_send_convert = segment_to_send[0]
-    #     print(f"test_segment[{i}] sent = 0x{segment_to_send_convert:02x}")
+while True:
+    link.discard()
+    link.write(bl_host.SYNC_SEQ)
     print("\n")
 
-    time.sleep(4)
-
-    segment_data_size = serial.read(1)
-    segment_type = serial.read(1)
-    segment_data = []
-    for i in range(32):
-        segment_data.append(serial.read(1))
-    segment_crc = serial.read(1)
-    
-    segment_length_converted = segment_data_size[0]
-    segment_type_converted = segment_type[0]
-    segment_crc_converted = segment_crc[0]
-
-    print(f"Segment Length = 0x{segment_length_converted:02x}")
-    print(f"Segment Type = 0x{segment_type_converted:02x}")
-    for i in range(32):
-        print(f"Data[{i}] = 0x{segment_data[i][0]:02x}")
-    print(f"Segment CRC = {segment_crc_converted}")
-    print("\n")
+    # Every COBS frame that arrives within 4 s, each one ends at a TL_FRAME_DELIMITER
+    deadline = time.monotonic() + 4
+    while link.fill(deadline - time.monotonic()):
+        while bytes([bl_host.TL_FRAME_DELIMITER]) in link.buffer:
+            end = link.buffer.index(bl_host.TL_FRAME_DELIMITER)
+            frame = bytes(link.buffer[:end])
+            del link.buffer[:end + 1]
+            if not frame:
+                continue
+
+            segment = bl_host.parse_segment(frame)
+            if segment is None:
+                print(f"Bad frame = {frame.hex()}")
+                continue
+
+            segment_type, segment_seq, segment_data = segment
+            print(f"Segment Length = 0x{len(segment_data):02x}")
+            print(f"Segment Type = 0x{segment_type:02x}")
+            print(f"Segment Seq = 0x{segment_seq:02x}")
+            for i, byte in enumerate(segment_data):
+                print(f"Data[{i}] = 0x{byte:02x}")
+            print("\n")
 
     time.sleep(1)
@@ -0,0 +1,133 @@
+#ifndef INC_PROGRAMMER_H
+#define INC_PROGRAMMER_H
+
+#include "common-defines.h"
+#include "transport-layer.h"
+
+#include <stddef.h>
+
+// Native host of the bootloader protocol, see cli/Makefile.
+// One reader owns the line for the whole session: every read goes into the same buffer and through the same COBS
+// frame parser, so nothing that arrives between two requests is ever thrown away. Data segments are written a whole
+// window at a time and topped up as ACKs come in (go-back-N, as in transport-layer.c).
+
+#define PROG_DEFAULT_BAUD_RATE (115200U)
+#define PROG_DEFAULT_TIMEOUT_MS (2000U)
+#define PROG_DEVICE_ID (0x01)
+#define PROG_BITS_PER_BYTE (10U)
+#define PROG_FLASH_US_PER_BYTE (100U) // Erase plus two half-page programs per 128 byte page, rounded up
+#define PROG_BAUD_PROBE_TIMEOUT_MS (500U) // BAUD_PROBE_TIMEOUT in firmware-bootloader.c
+#define PROG_MAX_FIRMWARE_SIZE (0xC000U) // 48 KByte application region
+#define PROG_MAX_WINDOW (127U) // Go-back-N with 8-bit sequence numbers
+#define PROG_UPDATE_ATTEMPTS (3U) // Tries at an image the bootloader NACKs, see prog_restart
+#define PROG_PAGE_SIZE (128U) // Flash page, what PAGE_HASH_RES hashes and the bootloader skips if unchanged
+#define PROG_MAX_PAGES (PROG_MAX_FIRMWARE_SIZE / PROG_PAGE_SIZE)
+
+#define PROG_RX_BUFFER_SIZE (4096U)
+
+typedef enum prog_phase_t {
+    PROG_PHASE_Sync,
+    PROG_PHASE_Baud,
+    PROG_PHASE_Handshake,
+    PROG_PHASE_Erase,
+    PROG_PHASE_Transfer,
+    PROG_PHASE_Verify,
+    PROG_PHASES
+} prog_phase_t;
+
+typedef struct prog_link_t {
+    int fd;
+    uint8_t rx_buffer[PROG_RX_BUFFER_SIZE]; // Bytes read but not parsed yet
+    uint32_t rx_start;
+    uint32_t rx_end;
+    uint8_t frame[SEGMENT_FRAME_LENGTH(SEGMENT_DATA_SIZE)]; // COBS bytes of the frame being received
+    uint32_t frame_length;
+    bool frame_overflow; // Frame longer than any segment, dropped at its delimiter
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint32_t bad_frames; // Frames that did not decode to a segment with a good CRC
+} prog_link_t;
+
+typedef struct prog_stats_t {
+    uint32_t segments_sent;
+    uint32_t segments_resent;
+    uint32_t retx_received;
+    uint32_t busy_received;
+    uint32_t ack_timeouts;
+    uint32_t handshake_retries;
+    uint32_t faults;
+    uint32_t baud_fallbacks; // Negotiated rates given up because the bootloader never confirmed them
+    uint32_t nacks; // Images the bootloader received whole but with the wrong CRC-32
+    uint32_t recoveries; // Faults (RETX or ACK timeout) that ended with an ACK making progress
+    double recovery_total_s;
+    double recovery_max_s;
+} prog_stats_t;
+
+typedef struct prog_session_t {
+    prog_link_t* link;
+    uint32_t baud_rate;
+    uint32_t fallback_baud_rate; // Rate before the negotiated one until the bootloader answers at it, 0 after that
+    uint32_t timeout_ms; // Per request, split across its retries
+    uint8_t tx_seq;
+    uint8_t rx_seq;
+    uint8_t payload_size; // Advertised by the bootloader in FW_LENGTH_REQ, may be lowered before prog_send_image
+    uint8_t window;
+    uint32_t resume_offset; // Where READY_FOR_DATA says the data starts, non-zero when an interrupted update goes on
+    bool delta; // READY_FOR_DATA confirmed the base we offered, the image goes out as a delta against it
+    uint32_t page_hashes[PROG_MAX_PAGES]; // CRC-32 of each page the bootloader holds, if asked for in the handshake
+    uint32_t page_count;
+    double phase_s[PROG_PHASES];
+    bool phase_done[PROG_PHASES];
+    prog_stats_t stats;
+} prog_session_t;
+
+typedef struct prog_payloads_t {
+    uint8_t segment_type; // SEGMENT_DATA, SEGMENT_DATA_RLE or SEGMENT_DATA_DELTA
+    uint32_t count;
+    uint8_t* lengths;
+    uint8_t (*data)[SEGMENT_DATA_SIZE];
+    uint32_t* decoded; // Image bytes each payload makes the bootloader program, sizes the ACK timeout
+    uint32_t wire_bytes; // Payload bytes only, for comparing encodings
+} prog_payloads_t;
+
+typedef enum prog_result_t {
+    PROG_Result_Ok,
+    PROG_Result_Timeout,
+    PROG_Result_Protocol, // Unexpected message or refused request
+    PROG_Result_Nack, // The image arrived but its CRC-32 did not match, a corrupt segment passed the CRC-8
+    PROG_Result_Link, // Read or write on the line failed
+} prog_result_t;
+
+// programmer-link.c
+double prog_now(void);
+bool prog_link_open(prog_link_t* link, const char* path, uint32_t baud_rate);
+bool prog_link_set_baudrate(prog_link_t* link, uint32_t baud_rate);
+void prog_link_close(prog_link_t* link);
+bool prog_link_write(prog_link_t* link, const uint8_t* data, uint32_t length);
+bool prog_link_send(prog_link_t* link, const tl_segment_t* segment);
+prog_result_t prog_link_receive(prog_link_t* link, tl_segment_t* segment, double deadline);
+void prog_link_discard(prog_link_t* link);
+
+// programmer-protocol.c
+void prog_session_init(prog_session_t* session, prog_link_t* link, uint32_t timeout_ms);
+prog_result_t prog_sync(prog_session_t* session);
+prog_result_t prog_negotiate_baud_rate(prog_session_t* session, uint32_t baud_rate);
+prog_result_t prog_handshake(prog_session_t* session, const uint8_t* image, uint32_t length, bool resume,
+                             const uint8_t* base, uint32_t base_length, bool pages);
+prog_result_t prog_send_image(prog_session_t* session, const prog_payloads_t* payloads);
+prog_result_t prog_restart(prog_session_t* session);
+const char* prog_result_name(prog_result_t result);
+const char* prog_phase_name(prog_phase_t phase);
+
+// programmer-image.c
+bool prog_payloads_raw(prog_payloads_t* payloads, const uint8_t* image, uint32_t length, uint8_t payload_size);
+bool prog_payloads_rle(prog_payloads_t* payloads, const uint8_t* image, uint32_t length, uint8_t payload_size);
+// Rebuilds image in place over base, the image the bootloader holds, see DELTA_COPY in transport-layer.h
+bool prog_payloads_delta(prog_payloads_t* payloads, const uint8_t* base, uint32_t base_length, const uint8_t* image,
+                         uint32_t length, uint8_t payload_size);
+// Only the pages whose CRC-32 differs from page_hashes (PAGE_HASH_RES), the rest is copied in place
+bool prog_payloads_pages(prog_payloads_t* payloads, const uint32_t* page_hashes, uint32_t page_count,
+                         const uint8_t* image, uint32_t length, uint8_t payload_size);
+void prog_payloads_free(prog_payloads_t* payloads);
+
+#endif
@@ -0,0 +1,391 @@
+#include "programmer.h"
+#include "core/crc32.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// RLE token limits, see RLE_RUN_FLAG in transport-layer.h
+#define RLE_MAX_RUN (0x7F + RLE_MIN_RUN)
+#define RLE_MAX_LITERAL (128)
+
+// Delta token limits, see DELTA_COPY in transport-layer.h
+#define DELTA_MAX_COPY (0x3FFFU + 1U)
+#define DELTA_MAX_RUN (0x3FU + RLE_MIN_RUN)
+#define DELTA_MIN_COPY (8U) // A copy token is 4 bytes, shorter matches go out as literals
+#define DELTA_MAX_SOURCE (0x10000U) // Source offsets are 2 bytes
+#define DELTA_PAGE_SIZE (128U) // The bootloader rebuilds the image one flash page at a time
+#define DELTA_HASH_BITS (16U)
+#define DELTA_CHAIN_LENGTH (16U) // Most recent positions tried per 4 byte prefix
+
+static bool prog_payloads_alloc(prog_payloads_t* payloads, uint32_t capacity) {
+    payloads->lengths = calloc(capacity, sizeof(*payloads->lengths));
+    payloads->data = calloc(capacity, sizeof(*payloads->data));
+    payloads->decoded = calloc(capacity, sizeof(*payloads->decoded));
+    if (payloads->lengths == NULL || payloads->data == NULL || payloads->decoded == NULL) {
+        prog_payloads_free(payloads);
+        return false;
+    }
+    return true;
+}
+
+void prog_payloads_free(prog_payloads_t* payloads) {
+    free(payloads->lengths);
+    free(payloads->data);
+    free(payloads->decoded);
+    memset(payloads, 0, sizeof(*payloads));
+}
+
+bool prog_payloads_raw(prog_payloads_t* payloads, const uint8_t* image, uint32_t length, uint8_t payload_size) {
+    memset(payloads, 0, sizeof(*payloads));
+    if (payload_size == 0 || payload_size > SEGMENT_DATA_SIZE) {
+        return false;
+    }
+
+    const uint32_t count = (length + payload_size - 1U) / payload_size;
+    if (!prog_payloads_alloc(payloads, count ? count : 1U)) {
+        return false;
+    }
+
+    payloads->segment_type = SEGMENT_DATA;
+    for (uint32_t offset = 0; offset < length; offset += payload_size) {
+        const uint32_t size = (length - offset < payload_size) ? length - offset : payload_size;
+        memcpy(payloads->data[payloads->count], &image[offset], size);
+        payloads->lengths[payloads->count] = (uint8_t)size;
+        payloads->decoded[payloads->count] = size;
+        payloads->count++;
+        payloads->wire_bytes += size;
+    }
+
+    return true;
+}
+
+// Appends one token, starting a new payload if it does not fit into the current one. Tokens never span two payloads.
+static void prog_rle_token(prog_payloads_t* payloads, uint8_t payload_size, const uint8_t* token, uint32_t length,
+                           uint32_t decoded) {
+    uint32_t index = payloads->count - 1U;
+    if (payloads->count == 0 || payloads->lengths[index] + length > payload_size) {
+        index = payloads->count++;
+    }
+
+    memcpy(&payloads->data[index][payloads->lengths[index]], token, length);
+    payloads->lengths[index] += (uint8_t)length;
+    payloads->decoded[index] += decoded;
+    payloads->wire_bytes += length;
+}
+
+static void prog_rle_literal(prog_payloads_t* payloads, uint8_t payload_size, const uint8_t* data, uint32_t length) {
+    // A literal token is its control byte plus the bytes, it has to fit into one payload
+    const uint32_t max_literal = (payload_size - 1U < RLE_MAX_LITERAL) ? payload_size - 1U : RLE_MAX_LITERAL;
+    uint8_t token[1 + RLE_MAX_LITERAL];
+
+    while (length > 0) {
+        const uint32_t chunk = (length < max_literal) ? length : max_literal;
+        token[0] = (uint8_t)(chunk - 1U);
+        memcpy(&token[1], data, chunk);
+        prog_rle_token(payloads, payload_size, token, chunk + 1U, chunk);
+        data += chunk;
+        length -= chunk;
+    }
+}
+
+bool prog_payloads_rle(prog_payloads_t* payloads, const uint8_t* image, uint32_t length, uint8_t payload_size) {
+    memset(payloads, 0, sizeof(*payloads));
+    if (payload_size < 2 || payload_size > SEGMENT_DATA_SIZE) {
+        return false;
+    }
+
+    // Worst case every payload carries a single one byte literal (2 bytes) next to a token that did not fit
+    const uint32_t capacity = length + 1U;
+    if (!prog_payloads_alloc(payloads, capacity)) {
+        return false;
+    }
+
+    payloads->segment_type = SEGMENT_DATA_RLE;
+    uint32_t literal_start = 0;
+    uint32_t i = 0;
+    while (i < length) {
+        uint32_t run = 1;
+        while (i + run < length && run < RLE_MAX_RUN && image[i + run] == image[i]) {
+            run++;
+        }
+
+        if (run >= RLE_MIN_RUN) {
+            prog_rle_literal(payloads, payload_size, &image[literal_start], i - literal_start);
+            const uint8_t token[2] = {(uint8_t)(RLE_RUN_FLAG | (run - RLE_MIN_RUN)), image[i]};
+            prog_rle_token(payloads, payload_size, token, sizeof(token), run);
+            i += run;
+            literal_start = i;
+        } else {
+            i += run;
+        }
+    }
+    prog_rle_literal(payloads, payload_size, &image[literal_start], length - literal_start);
+
+    return true;
+}
+
+// Hash chains over the 4 byte prefixes of a buffer, newest position first
+typedef struct prog_delta_chains_t {
+    int32_t* head;
+    int32_t* previous;
+} prog_delta_chains_t;
+
+static uint32_t prog_delta_hash(const uint8_t* data) {
+    const uint32_t key = (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) |
+                         ((uint32_t)data[3] << 24);
+    return (key * 2654435761U) >> (32U - DELTA_HASH_BITS);
+}
+
+static bool prog_delta_chains_alloc(prog_delta_chains_t* chains, uint32_t length) {
+    chains->head = malloc((1U << DELTA_HASH_BITS) * sizeof(*chains->head));
+    chains->previous = malloc((length ? length : 1U) * sizeof(*chains->previous));
+    if (chains->head == NULL || chains->previous == NULL) {
+        return false;
+    }
+    memset(chains->head, 0xFF, (1U << DELTA_HASH_BITS) * sizeof(*chains->head));
+    return true;
+}
+
+static void prog_delta_chains_free(prog_delta_chains_t* chains) {
+    free(chains->head);
+    free(chains->previous);
+}
+
+static void prog_delta_chains_insert(prog_delta_chains_t* chains, const uint8_t* data, uint32_t position) {
+    const uint32_t hash = prog_delta_hash(&data[position]);
+    chains->previous[position] = chains->head[hash];
+    chains->head[hash] = (int32_t)position;
+}
+
+// Bytes from source that match the image at destination, read the way the bootloader reads them while it rebuilds
+// the page at destination: base from the page before it on (that one is kept in RAM), the new image below
+static uint32_t prog_delta_match(const uint8_t* base, uint32_t base_length, const uint8_t* image, uint32_t source,
+                                 uint32_t destination, uint32_t limit) {
+    uint32_t n = 0;
+
+    while (n < limit) {
+        const uint32_t page = (destination + n) & ~(DELTA_PAGE_SIZE - 1U);
+        const uint32_t rebuilt = (page >= DELTA_PAGE_SIZE) ? page - DELTA_PAGE_SIZE : 0;
+        const uint32_t at = source + n;
+
+        // Flash behind the base holds nothing we know of
+        if (at >= rebuilt && at >= base_length) {
+            break;
+        }
+        if (((at < rebuilt) ? image[at] : base[at]) != image[destination + n]) {
+            break;
+        }
+        n++;
+    }
+
+    return n;
+}
+
+// Turns the decoded length of each delta payload into the bytes it makes the bootloader program, changed per page
+static void prog_delta_programmed(prog_payloads_t* payloads, const bool* changed, uint32_t length) {
+    uint32_t position = 0;
+    for (uint32_t i = 0; i < payloads->count; i++) {
+        const uint32_t end = position + payloads->decoded[i];
+        uint32_t programmed = 0;
+        for (uint32_t page = position & ~(DELTA_PAGE_SIZE - 1U); page < end; page += DELTA_PAGE_SIZE) {
+            const uint32_t page_end = (page + DELTA_PAGE_SIZE < length) ? page + DELTA_PAGE_SIZE : length;
+            if (changed[page / DELTA_PAGE_SIZE]) {
+                programmed += ((end < page_end) ? end : page_end) - ((position > page) ? position : page);
+            }
+        }
+        payloads->decoded[i] = programmed;
+        position = end;
+    }
+}
+
+// Appends copies of count bytes from source, split at the token limit
+static void prog_delta_copy(prog_payloads_t* payloads, uint8_t payload_size, uint32_t source, uint32_t count) {
+    while (count > 0) {
+        const uint32_t chunk = (count < DELTA_MAX_COPY) ? count : DELTA_MAX_COPY;
+        const uint32_t copy = chunk - 1U;
+        const uint8_t token[4] = {(uint8_t)(DELTA_COPY | (copy >> 8)), (uint8_t)copy, (uint8_t)source,
+                                  (uint8_t)(source >> 8)};
+        prog_rle_token(payloads, payload_size, token, sizeof(token), chunk);
+        source += chunk;
+        count -= chunk;
+    }
+}
+
+bool prog_payloads_delta(prog_payloads_t* payloads, const uint8_t* base, uint32_t base_length, const uint8_t* image,
+                         uint32_t length, uint8_t payload_size) {
+    memset(payloads, 0, sizeof(*payloads));
+    if (payload_size < 4 || payload_size > SEGMENT_DATA_SIZE) {
+        return false;
+    }
+
+    prog_delta_chains_t base_chains = {0};
+    prog_delta_chains_t image_chains = {0};
+    bool* changed = calloc(length / DELTA_PAGE_SIZE + 1U, sizeof(*changed));
+    if (changed == NULL || !prog_delta_chains_alloc(&base_chains, base_length) ||
+        !prog_delta_chains_alloc(&image_chains, length) || !prog_payloads_alloc(payloads, length + 1U)) {
+        free(changed);
+        prog_delta_chains_free(&base_chains);
+        prog_delta_chains_free(&image_chains);
+        return false;
+    }
+
+    for (uint32_t position = 0; position + 4U <= base_length; position++) {
+        prog_delta_chains_insert(&base_chains, base, position);
+    }
+
+    payloads->segment_type = SEGMENT_DATA_DELTA;
+    uint32_t indexed = 0; // Image positions below this are in image_chains, only what is rebuilt in flash
+    int64_t distance = 0; // Source minus destination of the last copy
+    uint32_t literal_start = 0;
+    uint32_t d = 0;
+
+    while (d < length) {
+        const uint32_t page = d & ~(DELTA_PAGE_SIZE - 1U);
+        const uint32_t rebuilt = (page >= DELTA_PAGE_SIZE) ? page - DELTA_PAGE_SIZE : 0;
+        while (indexed + 4U <= rebuilt) {
+            prog_delta_chains_insert(&image_chains, image, indexed++);
+        }
+
+        const uint32_t limit = (length - d < DELTA_MAX_COPY) ? length - d : DELTA_MAX_COPY;
+        uint32_t best_length = 0;
+        uint32_t best_source = 0;
+
+        // Same offset first (unchanged code), then where the last copy came from (code that moved), then the chains
+        int64_t candidates[2 + 2 * DELTA_CHAIN_LENGTH];
+        uint32_t count = 0;
+        candidates[count++] = d;
+        candidates[count++] = (int64_t)d + distance;
+        if (d + 4U <= length) {
+            const prog_delta_chains_t* chains[2] = {&base_chains, &image_chains};
+            for (uint32_t c = 0; c < 2; c++) {
+                int32_t position = chains[c]->head[prog_delta_hash(&image[d])];
+                for (uint32_t depth = 0; position >= 0 && depth < DELTA_CHAIN_LENGTH; depth++) {
+                    candidates[count++] = position;
+                    position = chains[c]->previous[position];
+                }
+            }
+        }
+
+        for (uint32_t c = 0; c < count; c++) {
+            if (candidates[c] < 0 || candidates[c] >= DELTA_MAX_SOURCE) {
+                continue;
+            }
+            const uint32_t source = (uint32_t)candidates[c];
+            const uint32_t match = prog_delta_match(base, base_length, image, source, d, limit);
+            if (match > best_length) {
+                best_length = match;
+                best_source = source;
+            }
+        }
+
+        uint32_t run = 1;
+        while (run < limit && run < DELTA_MAX_RUN && image[d + run] == image[d]) {
+            run++;
+        }
+
+        if (best_length >= DELTA_MIN_COPY && best_length >= run) {
+            prog_rle_literal(payloads, payload_size, &image[literal_start], d - literal_start);
+            prog_delta_copy(payloads, payload_size, best_source, best_length);
+            distance = (int64_t)best_source - d;
+            d += best_length;
+            literal_start = d;
+        } else if (run >= RLE_MIN_RUN) {
+            prog_rle_literal(payloads, payload_size, &image[literal_start], d - literal_start);
+            const uint8_t token[2] = {(uint8_t)(DELTA_RUN | (run - RLE_MIN_RUN)), image[d]};
+            prog_rle_token(payloads, payload_size, token, sizeof(token), run);
+            d += run;
+            literal_start = d;
+        } else {
+            d++;
+        }
+    }
+    prog_rle_literal(payloads, payload_size, &image[literal_start], length - literal_start);
+
+    // The bootloader leaves pages that come out the same alone, only the others take flash time
+    for (uint32_t page = 0; page < length; page += DELTA_PAGE_SIZE) {
+        const uint32_t page_end = (page + DELTA_PAGE_SIZE < length) ? page + DELTA_PAGE_SIZE : length;
+        changed[page / DELTA_PAGE_SIZE] = (page_end > base_length) ||
+                                           memcmp(&image[page], &base[page], page_end - page) != 0;
+    }
+    prog_delta_programmed(payloads, changed, length);
+
+    free(changed);
+    prog_delta_chains_free(&base_chains);
+    prog_delta_chains_free(&image_chains);
+    return true;
+}
+
+// A page the bootloader holds at the same offset is an in-place copy it leaves alone without an erase, one it holds
+// elsewhere is copied from there if it still reads the old contents, that is from the page before on (see
+// DELTA_COPY). Changed pages go out as runs and literals, a partial last page always does.
+bool prog_payloads_pages(prog_payloads_t* payloads, const uint32_t* page_hashes, uint32_t page_count,
+                         const uint8_t* image, uint32_t length, uint8_t payload_size) {
+    memset(payloads, 0, sizeof(*payloads));
+    if (payload_size < 4 || payload_size > SEGMENT_DATA_SIZE) {
+        return false;
+    }
+
+    bool* changed = calloc(length / DELTA_PAGE_SIZE + 1U, sizeof(*changed));
+    if (changed == NULL || !prog_payloads_alloc(payloads, length + 1U)) {
+        free(changed);
+        return false;
+    }
+
+    payloads->segment_type = SEGMENT_DATA_DELTA;
+    uint32_t copy_source = 0;
+    uint32_t copy_length = 0;
+    for (uint32_t d = 0; d < length; d += DELTA_PAGE_SIZE) {
+        const uint32_t page_length = (length - d < DELTA_PAGE_SIZE) ? length - d : DELTA_PAGE_SIZE;
+        const uint32_t page = d / DELTA_PAGE_SIZE;
+        int64_t source = -1;
+        if (page_length == DELTA_PAGE_SIZE) {
+            const uint32_t hash = crc32(&image[d], DELTA_PAGE_SIZE);
+            if (page < page_count && page_hashes[page] == hash) {
+                source = d;
+            }
+            for (uint32_t i = (page > 0) ? page - 1U : 0; source < 0 && i < page_count; i++) {
+                if (page_hashes[i] == hash) {
+                    source = (int64_t)i * DELTA_PAGE_SIZE;
+                }
+            }
+        }
+
+        if (source >= 0 && copy_length > 0 && copy_source + copy_length == source) {
+            copy_length += DELTA_PAGE_SIZE;
+            continue;
+        }
+        prog_delta_copy(payloads, payload_size, copy_source, copy_length);
+        copy_length = 0;
+        if (source >= 0) {
+            copy_source = (uint32_t)source;
+            copy_length = DELTA_PAGE_SIZE;
+            continue;
+        }
+
+        changed[page] = true;
+        uint32_t literal_start = d;
+        uint32_t i = d;
+        while (i < d + page_length) {
+            uint32_t run = 1;
+            while (i + run < d + page_length && run < DELTA_MAX_RUN && image[i + run] == image[i]) {
+                run++;
+            }
+
+            if (run >= RLE_MIN_RUN) {
+                prog_rle_literal(payloads, payload_size, &image[literal_start], i - literal_start);
+                const uint8_t token[2] = {(uint8_t)(DELTA_RUN | (run - RLE_MIN_RUN)), image[i]};
+                prog_rle_token(payloads, payload_size, token, sizeof(token), run);
+                i += run;
+                literal_start = i;
+            } else {
+                i += run;
+            }
+        }
+        prog_rle_literal(payloads, payload_size, &image[literal_start], d + page_length - literal_start);
+    }
+    prog_delta_copy(payloads, payload_size, copy_source, copy_length);
+
+    prog_delta_programmed(payloads, changed, length);
+    free(changed);
+    return true;
+}
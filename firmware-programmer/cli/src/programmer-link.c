@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include "programmer.h"
+#include "core/crc8.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+double prog_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec * 1e-9;
+}
+
+static speed_t prog_link_speed(uint32_t baud_rate) {
+    switch (baud_rate) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+#if defined(B460800)
+        case 460800: return B460800;
+        case 921600: return B921600;
+        case 1000000: return B1000000;
+        case 2000000: return B2000000;
+#endif
+        default: return B0;
+    }
+}
+
+bool prog_link_set_baudrate(prog_link_t* link, uint32_t baud_rate) {
+    const speed_t speed = prog_link_speed(baud_rate);
+    struct termios attributes;
+
+    if (speed == B0 || tcgetattr(link->fd, &attributes) != 0) {
+        return false;
+    }
+
+    // Let whatever is still queued leave at the old rate first
+    tcdrain(link->fd);
+    cfsetispeed(&attributes, speed);
+    cfsetospeed(&attributes, speed);
+    return tcsetattr(link->fd, TCSANOW, &attributes) == 0;
+}
+
+bool prog_link_open(prog_link_t* link, const char* path, uint32_t baud_rate) {
+    memset(link, 0, sizeof(*link));
+
+    link->fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (link->fd < 0) {
+        return false;
+    }
+
+    struct termios attributes;
+    if (tcgetattr(link->fd, &attributes) != 0) {
+        close(link->fd);
+        return false;
+    }
+    cfmakeraw(&attributes);
+    attributes.c_cflag |= CLOCAL | CREAD;
+    attributes.c_cflag &= ~(CSTOPB | CRTSCTS);
+    attributes.c_cc[VMIN] = 0;
+    attributes.c_cc[VTIME] = 0;
+    tcsetattr(link->fd, TCSANOW, &attributes);
+
+    // A pty has no baud rate, only a real serial port has to accept it
+    if (!prog_link_set_baudrate(link, baud_rate) && isatty(link->fd) && strncmp(path, "/dev/pts/", 9) != 0) {
+        close(link->fd);
+        return false;
+    }
+
+    tcflush(link->fd, TCIOFLUSH);
+    return true;
+}
+
+void prog_link_close(prog_link_t* link) {
+    if (link->fd >= 0) {
+        tcdrain(link->fd);
+        close(link->fd);
+        link->fd = -1;
+    }
+}
+
+bool prog_link_write(prog_link_t* link, const uint8_t* data, uint32_t length) {
+    while (length > 0) {
+        const ssize_t written = write(link->fd, data, length);
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                return false;
+            }
+
+            struct pollfd pfd = { .fd = link->fd, .events = POLLOUT };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        data += written;
+        length -= (uint32_t)written;
+        link->bytes_written += (uint64_t)written;
+    }
+
+    return true;
+}
+
+bool prog_link_send(prog_link_t* link, const tl_segment_t* segment) {
+    // Same COBS frame tl_send builds: the distance to the next zero replaces each zero, then the delimiter
+    uint8_t frame[SEGMENT_FRAME_LENGTH(SEGMENT_DATA_SIZE)];
+    const uint8_t* bytes = (const uint8_t*)segment;
+    const uint32_t length = SEGMENT_HEADER_SIZE + segment->segment_data_size;
+    uint32_t code_index = 0;
+    uint32_t out = 1;
+
+    for (uint32_t i = 0; i <= length; i++) {
+        const uint8_t byte = (i < length) ? bytes[i] : segment->segment_crc;
+        if (byte == 0) {
+            frame[code_index] = (uint8_t)(out - code_index);
+            code_index = out++;
+        } else {
+            frame[out++] = byte;
+        }
+    }
+    frame[code_index] = (uint8_t)(out - code_index);
+    frame[out++] = TL_FRAME_DELIMITER;
+
+    return prog_link_write(link, frame, out);
+}
+
+static bool prog_link_decode(const uint8_t* frame, uint32_t length, tl_segment_t* segment) {
+    uint8_t* decoded = (uint8_t*)segment;
+    uint32_t decoded_length = 0;
+    uint32_t i = 0;
+
+    while (i < length) {
+        const uint32_t code = frame[i];
+        if (code == 0 || i + code > length + 1 || decoded_length + code - 1 > SEGMENT_LENGTH) {
+            return false;
+        }
+
+        memcpy(&decoded[decoded_length], &frame[i + 1], code - 1);
+        decoded_length += code - 1;
+        i += code;
+        if (code != 0xFF && i < length) {
+            if (decoded_length >= SEGMENT_LENGTH) {
+                return false;
+            }
+            decoded[decoded_length++] = 0;
+        }
+    }
+
+    // As in tl_handle_frame: the CRC byte lands right behind the data
+    if (decoded_length < SEGMENT_HEADER_SIZE + SEGMENT_CRC_SIZE ||
+        segment->segment_data_size != decoded_length - SEGMENT_HEADER_SIZE - SEGMENT_CRC_SIZE) {
+        return false;
+    }
+    segment->segment_crc = decoded[decoded_length - 1];
+
+    return segment->segment_crc == crc8(decoded, decoded_length - SEGMENT_CRC_SIZE);
+}
+
+// Next complete frame out of the bytes already read, false once they are used up
+static bool prog_link_parse(prog_link_t* link, tl_segment_t* segment) {
+    while (link->rx_start < link->rx_end) {
+        const uint8_t byte = link->rx_buffer[link->rx_start++];
+
+        if (byte != TL_FRAME_DELIMITER) {
+            if (link->frame_length < sizeof(link->frame)) {
+                link->frame[link->frame_length++] = byte;
+            } else {
+                link->frame_overflow = true;
+            }
+            continue;
+        }
+
+        const uint32_t length = link->frame_length;
+        const bool overflow = link->frame_overflow;
+        link->frame_length = 0;
+        link->frame_overflow = false;
+
+        if (length == 0) {
+            continue;
+        }
+        if (!overflow && prog_link_decode(link->frame, length, segment)) {
+            return true;
+        }
+        link->bad_frames++;
+    }
+
+    return false;
+}
+
+prog_result_t prog_link_receive(prog_link_t* link, tl_segment_t* segment, double deadline) {
+    for (;;) {
+        if (prog_link_parse(link, segment)) {
+            return PROG_Result_Ok;
+        }
+
+        const double remaining = deadline - prog_now();
+        if (remaining <= 0.0) {
+            return PROG_Result_Timeout;
+        }
+
+        struct pollfd pfd = { .fd = link->fd, .events = POLLIN };
+        const int ready = poll(&pfd, 1, (int)(remaining * 1000.0) + 1);
+        if (ready < 0 && errno != EINTR) {
+            return PROG_Result_Link;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        // Everything before rx_start has been parsed, so the whole buffer is free again
+        const ssize_t count = read(link->fd, link->rx_buffer, sizeof(link->rx_buffer));
+        if (count < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        if (count <= 0) {
+            // Port gone, or the simulator hung up after jumping to the application
+            return PROG_Result_Link;
+        }
+        link->rx_start = 0;
+        link->rx_end = (uint32_t)count;
+        link->bytes_read += (uint64_t)count;
+    }
+}
+
+void prog_link_discard(prog_link_t* link) {
+    tcflush(link->fd, TCIFLUSH);
+    link->rx_start = 0;
+    link->rx_end = 0;
+    link->frame_length = 0;
+    link->frame_overflow = false;
+}
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+
+#include "programmer.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct prog_options_t {
+    const char* port;
+    const char* image_file;
+    const char* base_file; // Image the bootloader holds now, only a delta against it is sent if it confirms that
+    const char* stats_file; // Result, per-phase timing and counters as JSON, for the benchmark
+    uint32_t baud_rate; // Negotiated after sync, 0 to stay at PROG_DEFAULT_BAUD_RATE
+    uint32_t payload_size; // 0 for what the bootloader advertises
+    uint32_t window; // 0 for what the bootloader advertises
+    uint32_t force_window; // Used whatever the bootloader advertises, above that it answers with BUSY
+    uint32_t timeout_ms;
+    bool rle;
+    bool quiet;
+    bool no_resume; // Start over even if the bootloader offers to continue an interrupted update
+    bool pages; // Without a base, send only the pages whose CRC-32 differs from what the bootloader reports
+} prog_options_t;
+
+static void prog_usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s --port PORT [--baud N] [--rle] [--payload N] [--window N] [--timeout-ms N]\n"
+            "       [--no-resume] [--base OLD.bin | --pages] [--force-window N] [--stats FILE] [--quiet] IMAGE.bin\n"
+            "Updates the application over the bootloader's UART protocol: sync, device ID, length, erase, data.\n"
+            "PORT is a serial port or the pty printed by firmware-bootloader-sim. --baud switches the link to N\n"
+            "after sync if the bootloader accepts it. The image is padded with 0xFF to a whole word.\n"
+            "An update that was interrupted is continued where the bootloader committed it last, if the image\n"
+            "matches up to there, unless --no-resume is given.\n"
+            "With --base, the image the device runs now, only a delta against it is sent if the bootloader\n"
+            "confirms it holds exactly that image. Otherwise the whole image goes out as usual.\n"
+            "With --pages the bootloader is asked for the CRC-32 of each flash page instead, and only the pages\n"
+            "that differ are sent and programmed.\n"
+            "--force-window sends N segments ahead even past the window the bootloader advertises, to test its\n"
+            "BUSY flow control.\n", name);
+}
+
+static uint8_t* prog_load_image(const char* path, uint32_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+
+    // Read one byte past the limit to tell a maximum size image from a too large one
+    uint8_t* image = malloc(PROG_MAX_FIRMWARE_SIZE + 4U);
+    size_t size = (image != NULL) ? fread(image, 1, PROG_MAX_FIRMWARE_SIZE + 1U, file) : 0;
+    fclose(file);
+    if (image == NULL || size == 0 || size > PROG_MAX_FIRMWARE_SIZE) {
+        free(image);
+        return NULL;
+    }
+
+    // The bootloader programs whole words and stops at the announced length, so only word-align the image
+    while (size % 4U) {
+        image[size++] = 0xFF;
+    }
+    *length = (uint32_t)size;
+    return image;
+}
+
+static void prog_print_phases(const prog_session_t* session, uint32_t image_length) {
+    for (uint32_t phase = 0; phase < PROG_PHASES; phase++) {
+        if (session->phase_done[phase]) {
+            fprintf(stderr, "  %-10s %8.3f s\n", prog_phase_name((prog_phase_t)phase), session->phase_s[phase]);
+        }
+    }
+
+    const double data_s = session->phase_s[PROG_PHASE_Transfer] + session->phase_s[PROG_PHASE_Verify];
+    if (session->phase_done[PROG_PHASE_Verify] && data_s > 0.0) {
+        fprintf(stderr, "  goodput    %8.1f B/s at %u baud\n", (double)(image_length - session->resume_offset) / data_s,
+                session->baud_rate);
+    }
+
+    const prog_stats_t* stats = &session->stats;
+    fprintf(stderr, "  segments %u sent, %u resent, %u RETX, %u BUSY, %u ACK timeouts, %u bad frames\n",
+            stats->segments_sent, stats->segments_resent, stats->retx_received, stats->busy_received,
+            stats->ack_timeouts, session->link->bad_frames);
+}
+
+static void prog_write_stats(const char* path, const prog_session_t* session, prog_result_t result,
+                             prog_phase_t failed_phase, double total_s, uint32_t wire_payload_bytes) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror("programmer: stats file");
+        return;
+    }
+
+    const prog_stats_t* stats = &session->stats;
+    fprintf(file, "{\"ok\": %s, \"error\": ", (result == PROG_Result_Ok) ? "true" : "false");
+    if (result == PROG_Result_Ok) {
+        fprintf(file, "null, \"failed_phase\": null");
+    } else {
+        fprintf(file, "\"%s\", \"failed_phase\": \"%s\"", prog_result_name(result), prog_phase_name(failed_phase));
+    }
+    fprintf(file, ", \"total_s\": %.4f, \"baud_rate\": %u, \"phases_s\": {", total_s, session->baud_rate);
+    for (uint32_t phase = 0; phase < PROG_PHASES; phase++) {
+        fprintf(file, "%s\"%s\": ", phase ? ", " : "", prog_phase_name((prog_phase_t)phase));
+        if (session->phase_done[phase]) {
+            fprintf(file, "%.4f", session->phase_s[phase]);
+        } else {
+            fprintf(file, "null");
+        }
+    }
+    fprintf(file,
+            "}, \"host\": {\"segments_sent\": %u, \"segments_resent\": %u, \"retx_received\": %u, "
+            "\"busy_received\": %u, \"ack_timeouts\": %u, \"crc_errors\": %u, \"handshake_retries\": %u, "
+            "\"faults\": %u, \"baud_fallbacks\": %u, \"nacks\": %u, \"payload_size\": %u, \"window\": %u, "
+            "\"wire_payload_bytes\": %u, \"bytes_written\": %llu, \"bytes_read\": %llu, \"resume_offset\": %u, "
+            "\"delta\": %s}",
+            stats->segments_sent, stats->segments_resent, stats->retx_received, stats->busy_received,
+            stats->ack_timeouts, session->link->bad_frames, stats->handshake_retries, stats->faults,
+            stats->baud_fallbacks, stats->nacks, session->payload_size, session->window, wire_payload_bytes,
+            (unsigned long long)session->link->bytes_written, (unsigned long long)session->link->bytes_read,
+            session->resume_offset, session->delta ? "true" : "false");
+    fprintf(file, ", \"recovery\": {\"count\": %u, \"total_s\": %.6f, \"max_s\": %.6f}}\n",
+            stats->recoveries, stats->recovery_total_s, stats->recovery_max_s);
+    fclose(file);
+}
+
+static prog_phase_t prog_failed_phase(const prog_session_t* session, bool negotiate) {
+    for (uint32_t phase = 0; phase < PROG_PHASES; phase++) {
+        if (!session->phase_done[phase] && (phase != PROG_PHASE_Baud || negotiate)) {
+            return (prog_phase_t)phase;
+        }
+    }
+    return PROG_PHASE_Verify; // Every phase ran, the bootloader NACKed the image
+}
+
+static prog_result_t prog_update(prog_session_t* session, const prog_options_t* config, const uint8_t* image,
+                                 uint32_t image_length, const uint8_t* base, uint32_t base_length,
+                                 prog_payloads_t* payloads) {
+    prog_result_t result = prog_handshake(session, image, image_length, !config->no_resume, base, base_length,
+                                          config->pages);
+    if (result != PROG_Result_Ok) {
+        return result;
+    }
+
+    // Whole words only, as the web programmer negotiates it
+    uint32_t payload_size = session->payload_size;
+    if (config->payload_size != 0 && config->payload_size < payload_size) {
+        payload_size = config->payload_size;
+    }
+    session->payload_size = (uint8_t)(payload_size & ~3U);
+    if (config->window != 0 && config->window < session->window) {
+        session->window = (uint8_t)config->window;
+    }
+    if (config->force_window != 0) {
+        session->window = (uint8_t)config->force_window;
+    }
+
+    // Only what the bootloader does not have yet
+    const uint8_t* data = &image[session->resume_offset];
+    const uint32_t data_length = image_length - session->resume_offset;
+    bool built;
+    if (session->delta && base == NULL) {
+        built = prog_payloads_pages(payloads, session->page_hashes, session->page_count, data, data_length,
+                                    session->payload_size);
+    } else if (session->delta) {
+        built = prog_payloads_delta(payloads, base, base_length, data, data_length, session->payload_size);
+    } else if (config->rle) {
+        built = prog_payloads_rle(payloads, data, data_length, session->payload_size);
+    } else {
+        built = prog_payloads_raw(payloads, data, data_length, session->payload_size);
+    }
+    return built ? prog_send_image(session, payloads) : PROG_Result_Protocol;
+}
+
+int main(int argc, char** argv) {
+    static const struct option options[] = {
+        { "port", required_argument, NULL, 'p' },
+        { "baud", required_argument, NULL, 'b' },
+        { "rle", no_argument, NULL, 'r' },
+        { "payload", required_argument, NULL, 'P' },
+        { "window", required_argument, NULL, 'w' },
+        { "force-window", required_argument, NULL, 'W' },
+        { "timeout-ms", required_argument, NULL, 't' },
+        { "stats", required_argument, NULL, 's' },
+        { "quiet", no_argument, NULL, 'q' },
+        { "no-resume", no_argument, NULL, 'n' },
+        { "base", required_argument, NULL, 'B' },
+        { "pages", no_argument, NULL, 'g' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+
+    prog_options_t config = { .timeout_ms = PROG_DEFAULT_TIMEOUT_MS };
+    int option;
+    while ((option = getopt_long(argc, argv, "p:b:rP:w:W:t:s:qnB:gh", options, NULL)) != -1) {
+        switch (option) {
+            case 'p': config.port = optarg; break;
+            case 'b': config.baud_rate = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'r': config.rle = true; break;
+            case 'P': config.payload_size = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'w': config.window = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 'W': config.force_window = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 't': config.timeout_ms = (uint32_t)strtoul(optarg, NULL, 0); break;
+            case 's': config.stats_file = optarg; break;
+            case 'q': config.quiet = true; break;
+            case 'n': config.no_resume = true; break;
+            case 'B': config.base_file = optarg; break;
+            case 'g': config.pages = true; break;
+            default: prog_usage(argv[0]); return (option == 'h') ? 0 : 1;
+        }
+    }
+    if (config.port == NULL || optind != argc - 1 || config.payload_size > SEGMENT_DATA_SIZE ||
+        config.force_window > PROG_MAX_WINDOW) {
+        prog_usage(argv[0]);
+        return 1;
+    }
+    config.image_file = argv[optind];
+
+    uint32_t image_length = 0;
+    uint8_t* image = prog_load_image(config.image_file, &image_length);
+    if (image == NULL) {
+        fprintf(stderr, "programmer: %s: no image of 1 to %u bytes\n", config.image_file, PROG_MAX_FIRMWARE_SIZE);
+        return 1;
+    }
+
+    uint32_t base_length = 0;
+    uint8_t* base = NULL;
+    if (config.base_file != NULL) {
+        base = prog_load_image(config.base_file, &base_length);
+        if (base == NULL) {
+            fprintf(stderr, "programmer: %s: no image of 1 to %u bytes\n", config.base_file, PROG_MAX_FIRMWARE_SIZE);
+            free(image);
+            return 1;
+        }
+    }
+
+    static prog_link_t link;
+    if (!prog_link_open(&link, config.port, PROG_DEFAULT_BAUD_RATE)) {
+        perror("programmer: port");
+        free(base);
+        free(image);
+        return 1;
+    }
+
+    prog_session_t session;
+    prog_session_init(&session, &link, config.timeout_ms);
+    prog_payloads_t payloads = {0};
+    bool negotiate = (config.baud_rate != 0) && (config.baud_rate != PROG_DEFAULT_BAUD_RATE);
+    const double start = prog_now();
+
+    prog_result_t result = prog_sync(&session);
+    if (result == PROG_Result_Ok && negotiate) {
+        result = prog_negotiate_baud_rate(&session, config.baud_rate);
+        if (result == PROG_Result_Timeout || result == PROG_Result_Protocol) {
+            // Refused or no echo, both ends are back at the boot rate and the update goes on there
+            if (!config.quiet) {
+                fprintf(stderr, "programmer: %u baud not taken, staying at %u\n", config.baud_rate, session.baud_rate);
+            }
+            negotiate = false;
+            result = PROG_Result_Ok;
+        }
+    }
+    // A NACK means a corrupt segment got past its CRC-8, the whole exchange is repeated from a fresh sync
+    for (uint32_t attempt = 0; result == PROG_Result_Ok; attempt++) {
+        prog_payloads_free(&payloads);
+        result = prog_update(&session, &config, image, image_length, base, base_length, &payloads);
+        if (result != PROG_Result_Nack || attempt + 1U == PROG_UPDATE_ATTEMPTS) {
+            break;
+        }
+        result = prog_restart(&session);
+        negotiate = false; // The retry stays at the boot rate
+    }
+    const double total_s = prog_now() - start;
+    const prog_phase_t failed_phase = prog_failed_phase(&session, negotiate);
+
+    if (!config.quiet) {
+        if (result == PROG_Result_Ok && session.resume_offset != 0) {
+            fprintf(stderr, "programmer: %u bytes updated in %.3f s, resumed at %u\n", image_length, total_s,
+                    session.resume_offset);
+        } else if (result == PROG_Result_Ok && session.delta) {
+            fprintf(stderr, "programmer: %u bytes updated in %.3f s, %u byte delta\n", image_length, total_s,
+                    payloads.wire_bytes);
+        } else if (result == PROG_Result_Ok) {
+            fprintf(stderr, "programmer: %u bytes updated in %.3f s\n", image_length, total_s);
+        } else {
+            fprintf(stderr, "programmer: update failed in %s (%s) after %.3f s\n", prog_phase_name(failed_phase),
+                    prog_result_name(result), total_s);
+        }
+        prog_print_phases(&session, image_length);
+    }
+    if (config.stats_file != NULL) {
+        prog_write_stats(config.stats_file, &session, result, failed_phase, total_s, payloads.wire_bytes);
+    }
+
+    prog_payloads_free(&payloads);
+    prog_link_close(&link);
+    free(base);
+    free(image);
+
+    return (result == PROG_Result_Ok) ? 0 : 2;
+}
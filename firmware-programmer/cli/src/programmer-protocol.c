@@ -0,0 +1,485 @@
+#define _GNU_SOURCE
+
+#include "programmer.h"
+#include "core/crc8.h"
+#include "core/crc32.h"
+
+#include <string.h>
+#include <time.h>
+
+// Same sequence and messages as firmware-bootloader.c, see also bl_host.py in the simulator
+static const uint8_t sync_seq[4] = {0x01, 0x02, 0x03, 0x04};
+static const uint8_t baud_probe_pattern[8] = {0x00, 0xFF, 0x55, 0xAA, 0x0F, 0xF0, 0x33, 0xCC};
+
+#define PROG_SYNC_ATTEMPTS (3)
+#define PROG_REQUEST_RETRIES (3)
+// Until READY_FOR_DATA the bootloader only writes a few words of data EEPROM and checks a delta base's CRC-32, pages
+// are erased as they are received. 2 s per attempt still covers a build without ERASE_AS_YOU_GO: 384 pages * 3.2 ms
+#define PROG_ERASE_TIMEOUT_MS (8000U)
+#define PROG_VERIFY_TIMEOUT_MS (5000U)
+
+void prog_session_init(prog_session_t* session, prog_link_t* link, uint32_t timeout_ms) {
+    memset(session, 0, sizeof(*session));
+    session->link = link;
+    session->baud_rate = PROG_DEFAULT_BAUD_RATE;
+    session->timeout_ms = timeout_ms;
+    session->payload_size = SEGMENT_DATA_SIZE;
+    session->window = 1;
+}
+
+const char* prog_result_name(prog_result_t result) {
+    switch (result) {
+        case PROG_Result_Ok: return "ok";
+        case PROG_Result_Timeout: return "timeout";
+        case PROG_Result_Protocol: return "protocol";
+        case PROG_Result_Nack: return "nack";
+        case PROG_Result_Link: return "link";
+        default: return "unknown";
+    }
+}
+
+const char* prog_phase_name(prog_phase_t phase) {
+    static const char* names[PROG_PHASES] = {"sync", "baud", "handshake", "erase", "transfer", "verify"};
+    return (phase < PROG_PHASES) ? names[phase] : "unknown";
+}
+
+static void prog_phase_end(prog_session_t* session, prog_phase_t phase, double start) {
+    session->phase_s[phase] = prog_now() - start;
+    session->phase_done[phase] = true;
+}
+
+static double prog_byte_time(const prog_session_t* session) {
+    return (double)PROG_BITS_PER_BYTE / (double)session->baud_rate;
+}
+
+static void prog_create_segment(tl_segment_t* segment, uint8_t type, uint8_t seq, const uint8_t* data, uint8_t length) {
+    segment->segment_data_size = length;
+    segment->segment_type = type;
+    segment->segment_seq = seq;
+    if (length > 0) {
+        memcpy(segment->data, data, length);
+    }
+    segment->segment_crc = crc8((uint8_t*)segment, SEGMENT_HEADER_SIZE + length);
+}
+
+static bool prog_send(prog_session_t* session, uint8_t type, uint8_t seq, const uint8_t* data, uint8_t length) {
+    tl_segment_t segment;
+    prog_create_segment(&segment, type, seq, data, length);
+    return prog_link_send(session->link, &segment);
+}
+
+static bool prog_send_message(prog_session_t* session, const uint8_t* data, uint8_t length) {
+    return prog_send(session, SEGMENT_DATA, session->tx_seq++, data, length);
+}
+
+// Next DATA segment from the bootloader, ACKed. Control segments in between are skipped.
+static prog_result_t prog_receive_message(prog_session_t* session, tl_segment_t* segment, double timeout_s) {
+    const double deadline = prog_now() + timeout_s;
+
+    for (;;) {
+        const prog_result_t result = prog_link_receive(session->link, segment, deadline);
+        if (result != PROG_Result_Ok) {
+            return result;
+        }
+
+        if (segment->segment_type == SEGMENT_DATA) {
+            session->rx_seq = segment->segment_seq + 1;
+            if (!prog_send(session, SEGMENT_ACK, session->rx_seq, NULL, 0)) {
+                return PROG_Result_Link;
+            }
+            return PROG_Result_Ok;
+        }
+    }
+}
+
+// Send data (NULL to only wait) and wait for message. On a timeout ask for everything from rx_seq again and repeat
+// data, the bootloader ACKs a duplicate and resends nothing it has not sent yet.
+static prog_result_t prog_request(prog_session_t* session, const uint8_t* data, uint8_t length, uint8_t message,
+                                  tl_segment_t* response, uint32_t timeout_ms, uint32_t retries) {
+    const uint8_t seq = session->tx_seq;
+    if (data != NULL && !prog_send_message(session, data, length)) {
+        return PROG_Result_Link;
+    }
+
+    const double timeout_s = (double)timeout_ms / 1000.0 / (double)(retries + 1);
+    for (uint32_t attempt = 0;; attempt++) {
+        const prog_result_t result = prog_receive_message(session, response, timeout_s);
+        if (result == PROG_Result_Ok) {
+            return (response->segment_data_size > 0 && response->data[0] == message) ? PROG_Result_Ok
+                                                                                     : PROG_Result_Protocol;
+        }
+        if (result != PROG_Result_Timeout || attempt == retries) {
+            return result;
+        }
+
+        session->stats.handshake_retries++;
+        bool sent = prog_send(session, SEGMENT_RETX, session->rx_seq, NULL, 0);
+        if (data != NULL) {
+            sent = sent && prog_send(session, SEGMENT_DATA, seq, data, length);
+        }
+        if (!sent) {
+            return PROG_Result_Link;
+        }
+    }
+}
+
+prog_result_t prog_sync(prog_session_t* session) {
+    const double start = prog_now();
+    tl_segment_t response;
+    prog_result_t result = PROG_Result_Timeout;
+
+    prog_link_discard(session->link);
+    session->tx_seq = 0;
+    session->rx_seq = 0;
+
+    // A lost SEQ_OBSERVED is asked for again, a sync sequence that did not arrive intact is repeated
+    for (uint32_t attempt = 0; attempt < PROG_SYNC_ATTEMPTS && result == PROG_Result_Timeout; attempt++) {
+        if (!prog_link_write(session->link, sync_seq, sizeof(sync_seq))) {
+            return PROG_Result_Link;
+        }
+        result = prog_request(session, NULL, 0, BL_AL_MESSAGE_SEQ_OBSERVED, &response,
+                              session->timeout_ms / PROG_SYNC_ATTEMPTS, 1);
+    }
+
+    if (result == PROG_Result_Ok) {
+        prog_phase_end(session, PROG_PHASE_Sync, start);
+    }
+    return result;
+}
+
+static void prog_sleep_ms(uint32_t ms) {
+    const struct timespec duration = { .tv_sec = ms / 1000U, .tv_nsec = (long)(ms % 1000U) * 1000000L };
+    nanosleep(&duration, NULL);
+}
+
+prog_result_t prog_negotiate_baud_rate(prog_session_t* session, uint32_t baud_rate) {
+    const double start = prog_now();
+    tl_segment_t response;
+
+    const uint8_t request[5] = {
+        BL_AL_MESSAGE_BAUD_REQ,
+        (uint8_t)baud_rate, (uint8_t)(baud_rate >> 8), (uint8_t)(baud_rate >> 16), (uint8_t)(baud_rate >> 24),
+    };
+    prog_result_t result = prog_request(session, request, sizeof(request), BL_AL_MESSAGE_BAUD_RES, &response,
+                                        PROG_BAUD_PROBE_TIMEOUT_MS, PROG_REQUEST_RETRIES);
+    if (result != PROG_Result_Ok) {
+        return result;
+    }
+    if (response.segment_data_size < 2 || response.data[1] != 1) {
+        return PROG_Result_Protocol;
+    }
+
+    // Both transports start over at the new rate
+    const uint32_t previous_baud_rate = session->baud_rate;
+    if (!prog_link_set_baudrate(session->link, baud_rate)) {
+        return PROG_Result_Link;
+    }
+    session->tx_seq = 0;
+    session->rx_seq = 0;
+    prog_link_discard(session->link);
+
+    uint8_t probe[1 + sizeof(baud_probe_pattern)];
+    probe[0] = BL_AL_MESSAGE_BAUD_PROBE;
+    memcpy(&probe[1], baud_probe_pattern, sizeof(baud_probe_pattern));
+    if (!prog_send_message(session, probe, sizeof(probe))) {
+        return PROG_Result_Link;
+    }
+
+    result = prog_receive_message(session, &response, (double)PROG_BAUD_PROBE_TIMEOUT_MS / 1000.0);
+    if (result == PROG_Result_Ok &&
+        (response.segment_data_size != sizeof(probe) || memcmp(response.data, probe, sizeof(probe)) != 0)) {
+        result = PROG_Result_Protocol;
+    }
+
+    if (result != PROG_Result_Ok) {
+        // The bootloader goes back on its own once the probe times out, wait for that before following it
+        prog_link_set_baudrate(session->link, previous_baud_rate);
+        prog_sleep_ms(2U * PROG_BAUD_PROBE_TIMEOUT_MS);
+        session->tx_seq = 0;
+        session->rx_seq = 0;
+        prog_link_discard(session->link);
+        return result;
+    }
+
+    session->fallback_baud_rate = previous_baud_rate;
+    session->baud_rate = baud_rate;
+    prog_phase_end(session, PROG_PHASE_Baud, start);
+    return PROG_Result_Ok;
+}
+
+static uint32_t prog_get_u32(const uint8_t* bytes) {
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void prog_put_u32(uint8_t* bytes, uint32_t value) {
+    bytes[0] = (uint8_t)value;
+    bytes[1] = (uint8_t)(value >> 8);
+    bytes[2] = (uint8_t)(value >> 16);
+    bytes[3] = (uint8_t)(value >> 24);
+}
+
+prog_result_t prog_handshake(prog_session_t* session, const uint8_t* image, uint32_t length, bool resume,
+                             const uint8_t* base, uint32_t base_length, bool pages) {
+    double start = prog_now();
+    tl_segment_t response;
+    prog_result_t result;
+
+    const uint8_t update_req = BL_AL_MESSAGE_FW_UPDATE_REQ;
+    result = prog_request(session, &update_req, 1, BL_AL_MESSAGE_FW_UPDATE_RES, &response, session->timeout_ms,
+                          PROG_REQUEST_RETRIES);
+    if (result == PROG_Result_Timeout && session->fallback_baud_rate != 0) {
+        // The echo came back but nothing after it got through: the bootloader has long given up on the new rate
+        // (BAUD_PROBE_TIMEOUT without a good segment), follow it back and ask once more
+        prog_link_set_baudrate(session->link, session->fallback_baud_rate);
+        session->baud_rate = session->fallback_baud_rate;
+        session->tx_seq = 0;
+        session->rx_seq = 0;
+        prog_link_discard(session->link);
+        session->stats.baud_fallbacks++;
+        result = prog_request(session, &update_req, 1, BL_AL_MESSAGE_FW_UPDATE_RES, &response, session->timeout_ms,
+                              PROG_REQUEST_RETRIES);
+    }
+    session->fallback_baud_rate = 0;
+    if (result != PROG_Result_Ok) {
+        return result;
+    }
+
+    result = prog_request(session, NULL, 0, BL_AL_MESSAGE_DEVICE_ID_REQ, &response, session->timeout_ms,
+                          PROG_REQUEST_RETRIES);
+    if (result != PROG_Result_Ok) {
+        return result;
+    }
+
+    const uint8_t device_id_res[2] = {BL_AL_MESSAGE_DEVICE_ID_RES, PROG_DEVICE_ID};
+    result = prog_request(session, device_id_res, sizeof(device_id_res), BL_AL_MESSAGE_FW_LENGTH_REQ, &response,
+                          session->timeout_ms, PROG_REQUEST_RETRIES);
+    if (result != PROG_Result_Ok) {
+        return result;
+    }
+    // [FW_LENGTH_REQ, max payload, window, resume offset, CRC-32 up to it], older bootloaders send less
+    session->payload_size = (response.segment_data_size > 1) ? response.data[1] : SEGMENT_DATA_SIZE;
+    session->window = (response.segment_data_size > 2) ? response.data[2] : 1;
+    const uint32_t offered = (response.segment_data_size >= 11) ? prog_get_u32(&response.data[3]) : 0;
+    const uint32_t offered_crc = (response.segment_data_size >= 11) ? prog_get_u32(&response.data[7]) : 0;
+    // Only continue an interrupted update if the bootloader holds the same bytes as our image up to there
+    const bool can_resume = resume && offered > 0 && offered < length && crc32(image, offered) == offered_crc;
+
+    // Without a base, ask what flash holds page by page so only the pages that differ go out
+    session->page_count = 0;
+    if (pages && base == NULL && !can_resume) {
+        const uint32_t count = length / PROG_PAGE_SIZE;
+        while (session->page_count < count) {
+            const uint32_t first = session->page_count;
+            const uint32_t left = count - first;
+            const uint8_t hash_req[4] = {BL_AL_MESSAGE_PAGE_HASH_REQ, (uint8_t)first, (uint8_t)(first >> 8),
+                                         (uint8_t)((left < PAGE_HASH_MAX_COUNT) ? left : PAGE_HASH_MAX_COUNT)};
+            result = prog_request(session, hash_req, sizeof(hash_req), BL_AL_MESSAGE_PAGE_HASH_RES, &response,
+                                  session->timeout_ms, PROG_REQUEST_RETRIES);
+            if (result != PROG_Result_Ok) {
+                return result;
+            }
+            // [PAGE_HASH_RES, first page, count, CRC-32 per page], none left past the end of the application region
+            const uint32_t returned = (response.segment_data_size >= 4) ? response.data[3] : 0;
+            if (returned == 0 || (response.data[1] | ((uint32_t)response.data[2] << 8)) != first ||
+                response.segment_data_size < 4U + 4U * returned) {
+                break;
+            }
+            for (uint32_t i = 0; i < returned && session->page_count < count; i++) {
+                session->page_hashes[session->page_count++] = prog_get_u32(&response.data[4U + 4U * i]);
+            }
+        }
+    }
+    prog_phase_end(session, PROG_PHASE_Handshake, start);
+
+    // Erase covers everything until READY_FOR_DATA: invalidating the descriptor and the progress record and checking
+    // the delta base. The pages themselves are erased during the transfer, each just before it is programmed
+    start = prog_now();
+    uint8_t length_res[21] = {BL_AL_MESSAGE_FW_LENGTH_RES};
+    uint32_t length_res_size = 9;
+    uint32_t proposed = 0;
+    prog_put_u32(&length_res[1], length);
+    prog_put_u32(&length_res[5], crc32(image, length));
+
+    if (can_resume) {
+        proposed = offered;
+        prog_put_u32(&length_res[9], proposed);
+        length_res_size = 13;
+    } else if (base != NULL) {
+        // Nothing to resume, offer the image we think the bootloader holds so only a delta against it goes out
+        prog_put_u32(&length_res[9], 0);
+        prog_put_u32(&length_res[13], base_length);
+        prog_put_u32(&length_res[17], crc32(base, base_length));
+        length_res_size = 21;
+    } else if (pages) {
+        // Base length 0, the delta only copies pages PAGE_HASH_RES said the bootloader has
+        memset(&length_res[9], 0, 12);
+        length_res_size = 21;
+    }
+
+    const uint32_t erase_timeout_ms = (session->timeout_ms > PROG_ERASE_TIMEOUT_MS) ? session->timeout_ms
+                                                                                     : PROG_ERASE_TIMEOUT_MS;
+    result = prog_request(session, length_res, length_res_size, BL_AL_MESSAGE_READY_FOR_DATA, &response,
+                          erase_timeout_ms, PROG_REQUEST_RETRIES);
+    if (result != PROG_Result_Ok) {
+        return result;
+    }
+
+    // [READY_FOR_DATA, offset, delta], either the offset we proposed or 0 if the bootloader starts over
+    session->resume_offset = (response.segment_data_size >= 5) ? prog_get_u32(&response.data[1]) : 0;
+    if (session->resume_offset != 0 && session->resume_offset != proposed) {
+        return PROG_Result_Protocol;
+    }
+    session->delta = (length_res_size == 21) && (response.segment_data_size >= 6) && (response.data[5] == 1);
+    prog_phase_end(session, PROG_PHASE_Erase, start);
+
+    return PROG_Result_Ok;
+}
+
+// Go-back-N over the payloads. The window is written back to back and topped up on every ACK, a RETX or an ACK
+// timeout resends from the oldest unACKed segment, BUSY pauses until the bootloader's next RETX.
+prog_result_t prog_send_image(prog_session_t* session, const prog_payloads_t* payloads) {
+    double start = prog_now();
+    const uint8_t base_seq = session->tx_seq;
+    const uint32_t count = payloads->count;
+    const uint32_t window = session->window ? session->window : 1;
+    prog_stats_t* stats = &session->stats;
+
+    uint32_t acked = 0; // Payloads before this one are ACKed
+    uint32_t next_index = 0; // Next payload to put on the wire
+    uint32_t sent_until = 0; // Payloads before this one went out at least once
+    bool paused = false;
+    double retx_holdoff = 0.0; // Ignore repeats of the RETX we just served until the resent window is out
+    uint8_t retx_holdoff_seq = 0;
+    double fault_start = -1.0;
+    tl_segment_t response;
+    bool have_response = false;
+
+    // Resending while the bootloader is still programming would only pile a second window into its RX buffer, so
+    // the timeout covers the flash time of the largest window (an RLE or delta segment can expand to kilobytes)
+    uint32_t largest = 0;
+    uint32_t in_flight = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        in_flight += payloads->decoded[i];
+        in_flight -= (i >= window) ? payloads->decoded[i - window] : 0;
+        largest = (in_flight > largest) ? in_flight : largest;
+    }
+    const double window_time = window * SEGMENT_FRAME_LENGTH(SEGMENT_DATA_SIZE) * prog_byte_time(session);
+    const double flash_time = largest * PROG_FLASH_US_PER_BYTE * 1e-6;
+    double ack_timeout = 2.0 * window_time + 2.0 * flash_time;
+    ack_timeout = (ack_timeout > 0.2) ? ack_timeout : 0.2;
+
+    while (acked < count) {
+        while (!paused && next_index < count && next_index - acked < window) {
+            if (!prog_send(session, payloads->segment_type, (uint8_t)(base_seq + next_index),
+                           payloads->data[next_index], payloads->lengths[next_index])) {
+                return PROG_Result_Link;
+            }
+            if (next_index < sent_until) {
+                stats->segments_resent++;
+            } else {
+                stats->segments_sent++;
+                sent_until = next_index + 1;
+            }
+            next_index++;
+        }
+
+        tl_segment_t segment;
+        const prog_result_t result = prog_link_receive(session->link, &segment, prog_now() + ack_timeout);
+        const double now = prog_now();
+
+        if (result == PROG_Result_Timeout) {
+            // Lost ACK, RETX or BUSY release, go back to the oldest outstanding segment
+            stats->ack_timeouts++;
+            if (fault_start < 0.0) {
+                stats->faults++;
+                fault_start = now - ack_timeout;
+            }
+            next_index = acked;
+            paused = false;
+            continue;
+        }
+        if (result != PROG_Result_Ok) {
+            return result;
+        }
+
+        // Counted from the oldest unACKed payload, sequence numbers wrap every 256 but the window never does
+        const uint32_t index = acked + (uint8_t)(segment.segment_seq - base_seq - acked);
+        if (segment.segment_type == SEGMENT_ACK) {
+            if (acked < index && index <= next_index) {
+                acked = index;
+                if (fault_start >= 0.0) {
+                    const double recovery = now - fault_start;
+                    stats->recoveries++;
+                    stats->recovery_total_s += recovery;
+                    stats->recovery_max_s = (recovery > stats->recovery_max_s) ? recovery : stats->recovery_max_s;
+                    fault_start = -1.0;
+                }
+            }
+        } else if (segment.segment_type == SEGMENT_RETX) {
+            stats->retx_received++;
+            if (fault_start < 0.0) {
+                stats->faults++;
+                fault_start = now;
+            }
+            const bool repeat = (segment.segment_seq == retx_holdoff_seq) && (now < retx_holdoff);
+            if (acked <= index && index <= next_index && (paused || !repeat)) {
+                // One RETX per loss is enough, the rest come from segments that were already in flight
+                retx_holdoff_seq = segment.segment_seq;
+                retx_holdoff = now + window_time + 0.02;
+                next_index = index;
+                paused = false;
+            }
+        } else if (segment.segment_type == SEGMENT_BUSY) {
+            stats->busy_received++;
+            if (acked <= index && index <= next_index) {
+                next_index = index;
+                paused = true;
+            }
+        } else if (segment.segment_type == SEGMENT_DATA) {
+            // The last ACK may have been lost with the final message right behind it
+            session->rx_seq = segment.segment_seq + 1;
+            if (!prog_send(session, SEGMENT_ACK, session->rx_seq, NULL, 0)) {
+                return PROG_Result_Link;
+            }
+            response = segment;
+            have_response = true;
+            break;
+        }
+    }
+
+    session->tx_seq = (uint8_t)(base_seq + count);
+    prog_phase_end(session, PROG_PHASE_Transfer, start);
+
+    start = prog_now();
+    if (!have_response) {
+        const uint32_t timeout_ms = (session->timeout_ms > PROG_VERIFY_TIMEOUT_MS) ? session->timeout_ms
+                                                                                   : PROG_VERIFY_TIMEOUT_MS;
+        const prog_result_t result = prog_receive_message(session, &response, (double)timeout_ms / 1000.0);
+        if (result != PROG_Result_Ok) {
+            return result;
+        }
+    }
+    prog_phase_end(session, PROG_PHASE_Verify, start);
+
+    if (response.segment_data_size > 0 && response.data[0] == BL_AL_MESSAGE_NACK) {
+        session->stats.nacks++;
+        return PROG_Result_Nack; // The image CRC-32 did not match, the old image stays invalid
+    }
+    if (response.segment_data_size == 0 || response.data[0] != BL_AL_MESSAGE_UPDATE_SUCCESSFUL) {
+        return PROG_Result_Protocol;
+    }
+    return PROG_Result_Ok;
+}
+
+// After a NACK the bootloader waits for a sync at the rate it booted with. It keeps its last progress record, the
+// next handshake only resumes from it if the CRC-32 up to there matches our image
+prog_result_t prog_restart(prog_session_t* session) {
+    if (session->baud_rate != PROG_DEFAULT_BAUD_RATE) {
+        prog_link_set_baudrate(session->link, PROG_DEFAULT_BAUD_RATE);
+        session->baud_rate = PROG_DEFAULT_BAUD_RATE;
+    }
+    // Phases are timed again for the retry
+    memset(session->phase_done, 0, sizeof(session->phase_done));
+    memset(session->phase_s, 0, sizeof(session->phase_s));
+    return prog_sync(session);
+}
@@ -2,6 +2,21 @@ import { useState } from "react";
 import "../src/App.css";
 
 import FileSelector from "../src/components/FileSelector";
+import { SerialLink, negotiateBaudRate } from "../src/lib/serial-link";
+import {
+	BL_AL_MESSAGE_DEVICE_ID_REQ,
+	BL_AL_MESSAGE_DEVICE_ID_RES,
+	BL_AL_MESSAGE_FW_LENGTH_REQ,
+	BL_AL_MESSAGE_FW_UPDATE_REQ,
+	BL_AL_MESSAGE_FW_UPDATE_RES,
+	DEVICE_ID,
+	SEGMENT_DATA_SIZE,
+	TL_WINDOW_SIZE,
+	negotiatePayloadSize,
+	resumeOffer,
+	toHexString,
+	type ResumeOffer,
+} from "../src/lib/transport-layer";
 
 type ALStateMachine = 
 	"AL_STATE_Sync" | 
@@ -9,45 +24,12 @@ type ALStateMachine =
 	"AL_STATE_Firmware_Update" | 
 	"AL_STATE_Done";
 
-async function readBytes(port: SerialPort, byteCount: number): Promise<Uint8Array> {
-  	const reader = port.readable.getReader();
-  	const buffer = new Uint8Array(byteCount);
-  	let offset = 0;
-
-  	while (offset < byteCount) {
-    	const { value, done } = await reader.read();
-    	if (done) break;
-
-		if (value) {
-			buffer.set(value.slice(0, byteCount - offset), offset);
-			offset += value.length;
-		}
-  	}
-
-  	reader.releaseLock();
-  	return buffer;
-}
-
-function toHexString(bytes: Uint8Array) {
-  	return Array
-		.from(bytes)
-		.map((b) => b.toString(16)
-		.toUpperCase()
-		.padStart(2, "0"))
-    	.join(" ");
-}
-
-const ACK = new Uint8Array([
-	0x00, 0x02, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
-	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
-	0xff, 0xff, 0x31,
-]);
-
 function App() {
-  	const [port, setPort] = useState<SerialPort | null>(null);
+  	const [link, setLink] = useState<SerialLink | null>(null);
 	const [stateMachine, setStateMachine] = useState<ALStateMachine>("AL_STATE_Sync");
+	const [payloadSize, setPayloadSize] = useState<number>(SEGMENT_DATA_SIZE);
+	const [windowSize, setWindowSize] = useState<number>(TL_WINDOW_SIZE);
+	const [resume, setResume] = useState<ResumeOffer>({ offset: 0, crc: 0 });
 
 	const filters = [
 		{ usbVendorId: 0x0483, usbProductId: 0x3748 }, // ST-LINK/V2
@@ -63,56 +45,35 @@ function App() {
 				return;
 			}
 			const selectedPort = await navigator.serial.requestPort({ filters });
-			await selectedPort.open({ baudRate: 115200 });
+			await link?.close();
+			setLink(null);
 			const { usbProductId, usbVendorId } = selectedPort.getInfo();
-			setPort(selectedPort);
 			console.log("Port selected:", selectedPort);
 			console.log("USB Vendor ID: 0x" + usbVendorId.toString(16));
 			console.log("USB Product ID: 0x" + usbProductId.toString(16));
-			const writer = selectedPort.writable.getWriter();
 
-			// Sync Sequence
-			const syncSeq = new Uint8Array([0x01, 0x02, 0x03, 0x04]);
-			await writer.write(syncSeq);
-			let data = await readBytes(selectedPort, 35);
-			console.log("Value: " + toHexString(data));
-			
-			// BL_AL_MESSAGE_FW_UPDATE_REQ
-			const BL_AL_MESSAGE_FW_UPDATE_REQ = new Uint8Array([
-				0x01, 0x00, 0x31, 0xff, 0xff, 0xff, 0xff, 0xff,
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
-				0xff, 0xff, 0x6C,
-			]);
-			await writer.write(BL_AL_MESSAGE_FW_UPDATE_REQ);
-			data = await readBytes(selectedPort, 105);
-			console.log("Value: " + toHexString(data));
+			// One reader for the whole session, everything the bootloader sends ends up in the link's queue
+			const session = await SerialLink.open(selectedPort);
+			setLink(session);
+
+			// Sync Sequence -> SEQ_OBSERVED
+			await session.sync();
+
+			// Switch to the fastest baud rate the link carries, the port is reopened for each try
+			await negotiateBaudRate(session);
+
+			// BL_AL_MESSAGE_FW_UPDATE_REQ -> FW_UPDATE_RES, DEVICE_ID_REQ
+			await session.request(new Uint8Array([BL_AL_MESSAGE_FW_UPDATE_REQ]), BL_AL_MESSAGE_FW_UPDATE_RES);
+			await session.request(null, BL_AL_MESSAGE_DEVICE_ID_REQ);
 
-			// BL_AL_MESSAGE_DEVICE_ID_RES
-			const BL_AL_MESSAGE_DEVICE_ID_RES = new Uint8Array([
-				0x02, 0x00, 0x3f, 0x01, 0xff, 0xff, 0xff, 0xff,
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
-				0xff, 0xff, 0xe2,
-			]);
-			await writer.write(BL_AL_MESSAGE_DEVICE_ID_RES);
-			data = await readBytes(selectedPort, 70);
-			console.log("Value: " + toHexString(data));
+			// BL_AL_MESSAGE_DEVICE_ID_RES -> FW_LENGTH_REQ (max payload, window, where an interrupted update got to)
+			const lengthReq = await session.request(new Uint8Array([BL_AL_MESSAGE_DEVICE_ID_RES, DEVICE_ID]),
+				BL_AL_MESSAGE_FW_LENGTH_REQ);
+			console.log("Value: " + toHexString(lengthReq));
+			setPayloadSize(negotiatePayloadSize(lengthReq[1]));
+			setWindowSize(lengthReq[2] || TL_WINDOW_SIZE); // Older bootloaders only send the payload size
+			setResume(resumeOffer(lengthReq));
 
-			// BL_AL_MESSAGE_FW_LENGTH_RES
-			const BL_AL_MESSAGE_FW_LENGTH_RES = new Uint8Array([
-				0x05, 0x00, 0x45, 0x78, 0x08, 0x00, 0x00, 0xff,
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
-				0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 
-				0xff, 0xff, 0xdd,
-			]);
-			await writer.write(BL_AL_MESSAGE_FW_LENGTH_RES);
-			data = await readBytes(selectedPort, 70);
-			console.log("Value: " + toHexString(data));
-			writer.releaseLock();
 			setStateMachine("AL_STATE_Firmware_Update");
 		} catch (err) {
 			setStateMachine("AL_STATE_Sync")
@@ -124,9 +85,12 @@ function App() {
     	<div>
 			<div>Serial Port</div>
 			<button onClick={handleSelectPort}>Select Serial Port</button>
-			{port && <div>Serial port selected!</div>}
-			{stateMachine == "AL_STATE_Firmware_Update" && <FileSelector 
-				port={port}
+			{link && <div>Serial port selected!</div>}
+			{stateMachine == "AL_STATE_Firmware_Update" && link && <FileSelector 
+				link={link}
+				payloadSize={payloadSize}
+				windowSize={windowSize}
+				resume={resume}
 				stateMachine={stateMachine}
       			setStateMachine={setStateMachine}
 			/>}
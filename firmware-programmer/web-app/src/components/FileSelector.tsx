@@ -1,62 +1,44 @@
 import "../../src/components/FileSelector.css"
 import { useState, type ChangeEvent } from "react";
+import type { SerialLink, TransferProgress } from "../../src/lib/serial-link";
+import {
+    BL_AL_MESSAGE_READY_FOR_DATA,
+    BL_AL_MESSAGE_UPDATE_SUCCESSFUL,
+    SEGMENT_DATA_RLE,
+    firmwareLengthRes,
+    readyOffset,
+    resumeOffset,
+    rleEncode,
+    segmentFrameLength,
+    type ResumeOffer,
+} from "../../src/lib/transport-layer";
+
+// Before READY_FOR_DATA the bootloader only updates data EEPROM and checks a delta base, it erases each page during
+// the transfer just before programming it. 2 s per attempt also covers a build that erases all 384 pages up front
+const ERASE_TIMEOUT = 8000;
 
 type Props = {
-    port: any;
+    link: SerialLink;
+    payloadSize: number;
+    windowSize: number;
+    resume: ResumeOffer;
     stateMachine: any;
     setStateMachine: any;
 };
 
-function toHexString(bytes: Uint8Array) {
-  	return Array
-		.from(bytes)
-		.map((b) => b.toString(16)
-		.toUpperCase()
-		.padStart(2, "0"))
-    	.join(" ");
+function formatProgress({ ackedBytes, totalBytes, elapsedMs, resent }: TransferProgress): string {
+    const rate = elapsedMs > 0 ? ackedBytes / elapsedMs : 0; // Bytes per ms, i.e. kB/s
+    const eta = rate > 0 ? (totalBytes - ackedBytes) / rate / 1000 : Infinity;
+    const percent = totalBytes > 0 ? ackedBytes / totalBytes * 100 : 100;
+    return `${ackedBytes} / ${totalBytes} Byte (${percent.toFixed(0)}%), ${rate.toFixed(1)} kB/s, `
+        + `ETA ${Number.isFinite(eta) ? eta.toFixed(1) + " s" : "-"}${resent ? `, ${resent} resent` : ""}`;
 }
 
-async function readBytes(port: SerialPort, byteCount: number): Promise<Uint8Array> {
-  	const reader = port.readable.getReader();
-  	const buffer = new Uint8Array(byteCount);
-  	let offset = 0;
-
-  	while (offset < byteCount) {
-    	const { value, done } = await reader.read();
-    	if (done) break;
-
-		if (value) {
-			buffer.set(value.slice(0, byteCount - offset), offset);
-			offset += value.length;
-		}
-  	}
-
-  	reader.releaseLock();
-  	return buffer;
-}
-
-function crc8(data: Uint8Array, length: number): number {
-    let crc = 0;
-
-    for (let i = 0; i < length; i++) {
-        crc ^= data[i];
-
-        for (let j = 0; j < 8; j++) {
-            if (crc & 0x80) {
-                crc = ((crc << 1) ^ 0x07) & 0xFF;
-            } else {
-                crc = (crc << 1) & 0xFF;
-            }
-        }
-    }
-
-    return crc & 0xFF;
-}
-
-
-function FileUploader({ port, stateMachine, setStateMachine }: Props) {
+function FileUploader({ link, payloadSize, windowSize, resume, stateMachine, setStateMachine }: Props) {
     const [file, setFile] = useState<File | null>(null);
     const [bytes, setBytes] = useState<Uint8Array | null>(null);
+    const [progress, setProgress] = useState<TransferProgress | null>(null);
+    const [status, setStatus] = useState<string | null>(null);
 
     async function handleFileChange(e: ChangeEvent<HTMLInputElement>) {
         if (e.target.files && e.target.files[0]) {
@@ -74,54 +56,47 @@ function FileUploader({ port, stateMachine, setStateMachine }: Props) {
             return;
         }
         
-        if (bytes.length % 4 != 0) {
-            return;
-        }
+        // The bootloader programs whole words and stops at the announced length, so only word-align the image
+        const image = new Uint8Array(Math.ceil(bytes.length / 4) * 4).fill(0xff);
+        image.set(bytes);
         
-        let byte_sent: number = 0;
-        let segment_to_sent: Uint8Array = new Uint8Array(35);
-        for (let i: number = 0; i < 35; i++) {
-            segment_to_sent[i] = 0xff;
-        }
-
-        const writer = port.writable.getWriter();
-
+        setProgress(null);
         try {
-            while (byte_sent < bytes.length) {
-                if ((bytes.length - byte_sent) > 32) {
-                    segment_to_sent[0] = 0x20;
-                    segment_to_sent[1] = 0x00;
-                    for (let i: number = 2; i < 34; i++) {
-                        segment_to_sent[i] = bytes[byte_sent]
-                        byte_sent += 1;
-                    }
-                    segment_to_sent[34] = crc8(segment_to_sent, 34);
-                    await writer.write(segment_to_sent);
-                    const data = await readBytes(port, 70);
-			        console.log("Value: " + toHexString(data));
-                } else {
-                    let segment_data_padding_start: number = 0;
-                    segment_to_sent[0] = (bytes.length - byte_sent) & 0xff;
-                    segment_to_sent[1] = 0x00;
-                    for (let i: number = 2; i < ((bytes.length - byte_sent) + 2); i++) {
-                        segment_to_sent[i] = bytes[byte_sent];
-                        byte_sent += 1;
-                        segment_data_padding_start = i + 1;
-                    }
-                    for (let i: number = segment_data_padding_start; i < 34; i++) {
-                        segment_to_sent[i] = 0xff;
-                    }
-                    segment_to_sent[34] = crc8(segment_to_sent, 34);
-                    await writer.write(segment_to_sent);
-                    const data = await readBytes(port, 70);
-			        console.log("Value: " + toHexString(data));
-                    setStateMachine("AL_STATE_Done");
-                }
+            // BL_AL_MESSAGE_FW_LENGTH_RES -> READY_FOR_DATA once the old image is invalidated. If an earlier
+            // update of this image was interrupted, ask to continue where the bootloader committed it last
+            setStatus("Erasing...");
+            const proposed = resumeOffset(image, resume);
+            const ready = await link.request(firmwareLengthRes(image, proposed), BL_AL_MESSAGE_READY_FOR_DATA,
+                ERASE_TIMEOUT);
+            const offset = readyOffset(ready);
+            if (offset != 0 && offset != proposed) {
+                throw new Error(`Bootloader starts at ${offset}, not ${proposed}`);
             }
-        } finally {
-            writer.releaseLock();
+
+            // The bootloader expands the runs, mostly the zero/0xFF fill between sections
+            const data = image.subarray(offset);
+            const payloads = rleEncode(data, payloadSize);
+            const rawBytes = Math.ceil(data.length / payloadSize) * segmentFrameLength(payloadSize);
+            const rleBytes = payloads.reduce((sum, payload) => sum + segmentFrameLength(payload.length), 0);
+            console.log(`RLE: ${rawBytes} -> ${rleBytes} bytes on the wire (${(rleBytes / rawBytes * 100).toFixed(1)}%), `
+                + `~${((rawBytes - rleBytes) * 10 / link.baudRate).toFixed(2)} s saved at ${link.baudRate} baud`);
+
+            // Up to windowSize segments in flight, each ACK frees a slot for the next one
+            setStatus(offset ? `Resuming at ${offset} Byte...` : "Writing...");
+            const result = await link.sendImage(payloads, SEGMENT_DATA_RLE, windowSize, setProgress);
+
+            // UPDATE_SUCCESSFUL, or NACK if the image CRC-32 did not match
+            if (result && result[0] == BL_AL_MESSAGE_UPDATE_SUCCESSFUL) {
+                setStatus(null);
+                setStateMachine("AL_STATE_Done");
+            } else {
+                setStatus("Bootloader rejected the image");
+                console.error("Bootloader rejected the image");
+            }
+        } catch (err) {
+            setStatus(`Update failed: ${err}`);
+            console.error("Update failed:", err);
         }
-        
     }
 
     return (
@@ -137,6 +112,13 @@ function FileUploader({ port, stateMachine, setStateMachine }: Props) {
             {file 
                 && stateMachine == "AL_STATE_Firmware_Update" 
                 && <button onClick={handleFileUpload}>Upload</button>}
+            {status && <p>{status}</p>}
+            {progress && (
+                <div>
+                    <progress value={progress.ackedBytes} max={progress.totalBytes} />
+                    <p>{formatProgress(progress)} at {link.baudRate} baud</p>
+                </div>
+            )}
         </div>
     );
 }
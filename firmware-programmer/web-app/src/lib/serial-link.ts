@@ -0,0 +1,372 @@
+// The port for a whole session: one read loop owns port.readable from open to close and feeds every byte through
+// a FrameParser into a queue of segments, one writer owns port.writable. Nothing that arrives between two requests
+// is lost, and nothing waits for a reader lock. Same protocol logic as bl-programmer (firmware-programmer/cli).
+
+import {
+    BAUD_PROBE_PATTERN,
+    BAUD_PROBE_TIMEOUT,
+    BAUD_RATE_CANDIDATES,
+    BL_AL_MESSAGE_BAUD_PROBE,
+    BL_AL_MESSAGE_BAUD_REQ,
+    BL_AL_MESSAGE_BAUD_RES,
+    BL_AL_MESSAGE_SEQ_OBSERVED,
+    DEFAULT_BAUD_RATE,
+    FrameParser,
+    SEGMENT_ACK,
+    SEGMENT_BUSY,
+    SEGMENT_DATA_RLE,
+    SEGMENT_DATA_SIZE,
+    SEGMENT_RETX,
+    SEGMENT_TYPE_DATA,
+    SYNC_SEQUENCE,
+    encodeSegment,
+    rleDecodedLength,
+    segmentFrameLength,
+    uint32LE,
+    type Segment,
+} from "./transport-layer";
+
+const BITS_PER_BYTE = 10;
+const FLASH_MS_PER_BYTE = 0.1; // Erase plus two half-page programs per 128 byte page, rounded up
+const REQUEST_TIMEOUT = 2000;
+const REQUEST_RETRIES = 3;
+const SYNC_ATTEMPTS = 3;
+const VERIFY_TIMEOUT = 5000;
+
+// Resolves waiting readers in order, items that nobody waits for yet are kept
+export class AsyncQueue<T> {
+    private items: T[] = [];
+    private waiters: ((item: T | null) => void)[] = [];
+
+    push(item: T) {
+        const waiter = this.waiters.shift();
+        if (waiter) {
+            waiter(item);
+        } else {
+            this.items.push(item);
+        }
+    }
+
+    // Next item, or null after timeoutMs
+    next(timeoutMs: number): Promise<T | null> {
+        const item = this.items.shift();
+        if (item !== undefined) {
+            return Promise.resolve(item);
+        }
+
+        return new Promise((resolve) => {
+            const waiter = (value: T | null) => {
+                clearTimeout(timer);
+                resolve(value);
+            };
+            const timer = setTimeout(() => {
+                this.waiters = this.waiters.filter((w) => w !== waiter);
+                resolve(null);
+            }, Math.max(0, timeoutMs));
+            this.waiters.push(waiter);
+        });
+    }
+
+    clear() {
+        this.items = [];
+    }
+}
+
+export type TransferProgress = {
+    ackedBytes: number; // Image bytes the bootloader has ACKed
+    totalBytes: number;
+    elapsedMs: number;
+    resent: number;
+};
+
+export class SerialLink {
+    baudRate = DEFAULT_BAUD_RATE;
+    private port: SerialPort;
+    private parser = new FrameParser();
+    private segments = new AsyncQueue<Segment>();
+    private reader: ReadableStreamDefaultReader<Uint8Array> | null = null;
+    private writer: WritableStreamDefaultWriter<Uint8Array> | null = null;
+    private readLoop: Promise<void> | null = null;
+    private txSeq = 0;
+    private rxSeq = 0;
+
+    constructor(port: SerialPort) {
+        this.port = port;
+    }
+
+    static async open(port: SerialPort, baudRate: number = DEFAULT_BAUD_RATE): Promise<SerialLink> {
+        await port.open({ baudRate });
+        const link = new SerialLink(port);
+        link.baudRate = baudRate;
+        link.start();
+        return link;
+    }
+
+    get badFrames(): number {
+        return this.parser.badFrames;
+    }
+
+    private start() {
+        this.reader = this.port.readable.getReader();
+        this.writer = this.port.writable.getWriter();
+        this.readLoop = this.run(this.reader);
+    }
+
+    private async run(reader: ReadableStreamDefaultReader<Uint8Array>) {
+        try {
+            for (;;) {
+                const { value, done } = await reader.read();
+                if (done) {
+                    break;
+                }
+                if (value) {
+                    this.parser.push(value, (segment) => this.segments.push(segment));
+                }
+            }
+        } catch (err) {
+            console.error("Serial read failed:", err);
+        } finally {
+            reader.releaseLock();
+        }
+    }
+
+    private async stop() {
+        if (this.reader) {
+            await this.reader.cancel();
+            await this.readLoop;
+            this.reader = null;
+            this.readLoop = null;
+        }
+        if (this.writer) {
+            this.writer.releaseLock();
+            this.writer = null;
+        }
+    }
+
+    async close() {
+        await this.stop();
+        await this.port.close();
+    }
+
+    // Both transports start over after a baud rate switch or a new sync
+    private restart() {
+        this.txSeq = 0;
+        this.rxSeq = 0;
+        this.parser.reset();
+        this.segments.clear();
+    }
+
+    async reopen(baudRate: number) {
+        await this.stop();
+        await this.port.close();
+        await this.port.open({ baudRate });
+        this.baudRate = baudRate;
+        this.restart();
+        this.start();
+    }
+
+    async write(bytes: Uint8Array) {
+        await this.writer!.write(bytes);
+    }
+
+    async send(type: number, seq: number, data?: Uint8Array) {
+        await this.write(encodeSegment(type, seq, data));
+    }
+
+    async sendMessage(data: Uint8Array) {
+        await this.send(SEGMENT_TYPE_DATA, this.txSeq, data);
+        this.txSeq = (this.txSeq + 1) & 0xff;
+    }
+
+    receive(timeoutMs: number): Promise<Segment | null> {
+        return this.segments.next(timeoutMs);
+    }
+
+    // Next DATA segment from the bootloader, ACKed. Control segments in between are skipped.
+    async receiveMessage(timeoutMs: number): Promise<Uint8Array | null> {
+        const deadline = performance.now() + timeoutMs;
+
+        for (;;) {
+            const segment = await this.receive(deadline - performance.now());
+            if (!segment) {
+                return null;
+            }
+
+            if (segment.type == SEGMENT_TYPE_DATA) {
+                this.rxSeq = (segment.seq + 1) & 0xff;
+                await this.send(SEGMENT_ACK, this.rxSeq);
+                return segment.data;
+            }
+        }
+    }
+
+    // Send data (null to only wait) and wait for message. On a timeout ask for everything from rxSeq again and
+    // repeat data, the bootloader ACKs a duplicate and resends nothing it has not sent yet.
+    async request(data: Uint8Array | null, message: number, timeoutMs: number = REQUEST_TIMEOUT,
+                  retries: number = REQUEST_RETRIES): Promise<Uint8Array> {
+        const seq = this.txSeq;
+        if (data) {
+            await this.sendMessage(data);
+        }
+
+        for (let attempt = 0; ; attempt++) {
+            const response = await this.receiveMessage(timeoutMs / (retries + 1));
+            if (response) {
+                if (response[0] != message) {
+                    throw new Error(`Expected 0x${message.toString(16)}, got 0x${response[0]?.toString(16)}`);
+                }
+                return response;
+            }
+            if (attempt == retries) {
+                throw new Error(`No answer to 0x${(data ? data[0] : message).toString(16)}`);
+            }
+
+            await this.send(SEGMENT_RETX, this.rxSeq);
+            if (data) {
+                await this.send(SEGMENT_TYPE_DATA, seq, data);
+            }
+        }
+    }
+
+    async sync() {
+        this.restart();
+
+        // A lost SEQ_OBSERVED is asked for again, a sync sequence that did not arrive intact is repeated
+        for (let attempt = 0; ; attempt++) {
+            await this.write(SYNC_SEQUENCE);
+            try {
+                await this.request(null, BL_AL_MESSAGE_SEQ_OBSERVED, REQUEST_TIMEOUT / SYNC_ATTEMPTS, 1);
+                return;
+            } catch (err) {
+                if (attempt == SYNC_ATTEMPTS - 1) {
+                    throw err;
+                }
+            }
+        }
+    }
+
+    // Go-back-N over the payloads: the window is written back to back and topped up on every ACK, a RETX or an ACK
+    // timeout resends from the oldest unACKed segment, BUSY pauses until the bootloader's next RETX.
+    // Returns the bootloader's message after the last payload (UPDATE_SUCCESSFUL or NACK).
+    async sendImage(payloads: Uint8Array[], type: number, window: number,
+                    onProgress?: (progress: TransferProgress) => void): Promise<Uint8Array | null> {
+        const start = performance.now();
+        const baseSeq = this.txSeq;
+        const decoded = payloads.map((payload) => type == SEGMENT_DATA_RLE ? rleDecodedLength(payload) : payload.length);
+        const totalBytes = decoded.reduce((sum, length) => sum + length, 0);
+        let acked = 0; // Payloads before this one are ACKed
+        let ackedBytes = 0;
+        let nextIndex = 0; // Next payload to put on the wire
+        let sentUntil = 0; // Payloads before this one went out at least once
+        let resent = 0;
+        let paused = false;
+        let retxHoldoff = 0; // Repeats of the RETX we just served are ignored until the resent window is out
+        let retxHoldoffSeq = -1;
+        let response: Uint8Array | null = null;
+
+        // Resending while the bootloader is still programming would only pile a second window into its RX buffer,
+        // so the timeout covers the flash time of the largest window (an RLE segment can expand to kilobytes)
+        const windowTime = window * segmentFrameLength(SEGMENT_DATA_SIZE) * BITS_PER_BYTE * 1000 / this.baudRate;
+        const flashTime = window * Math.max(0, ...decoded) * FLASH_MS_PER_BYTE;
+        const ackTimeout = Math.max(200, 2 * windowTime + 2 * flashTime);
+
+        // Counted from the oldest unACKed payload, sequence numbers wrap every 256 but the window never does
+        const indexOf = (seq: number) => acked + ((seq - baseSeq - acked) & 0xff);
+
+        while (acked < payloads.length) {
+            // All writes of a window are queued at once, the writer streams them without waiting on each other
+            const writes: Promise<void>[] = [];
+            while (!paused && nextIndex < payloads.length && nextIndex - acked < window) {
+                writes.push(this.send(type, (baseSeq + nextIndex) & 0xff, payloads[nextIndex]));
+                if (nextIndex < sentUntil) {
+                    resent++;
+                } else {
+                    sentUntil = nextIndex + 1;
+                }
+                nextIndex++;
+            }
+            await Promise.all(writes);
+
+            const segment = await this.receive(ackTimeout);
+            const now = performance.now();
+
+            if (!segment) {
+                // Lost ACK, RETX or BUSY release, go back to the oldest outstanding segment
+                nextIndex = acked;
+                paused = false;
+                continue;
+            }
+
+            const index = indexOf(segment.seq);
+            if (segment.type == SEGMENT_ACK) {
+                if (acked < index && index <= nextIndex) {
+                    for (; acked < index; acked++) {
+                        ackedBytes += decoded[acked];
+                    }
+                    onProgress?.({ ackedBytes, totalBytes, elapsedMs: now - start, resent });
+                }
+            } else if (segment.type == SEGMENT_RETX) {
+                const repeat = segment.seq == retxHoldoffSeq && now < retxHoldoff;
+                if (acked <= index && index <= nextIndex && (paused || !repeat)) {
+                    // One RETX per loss is enough, the rest come from segments that were already in flight
+                    retxHoldoffSeq = segment.seq;
+                    retxHoldoff = now + windowTime + 20;
+                    nextIndex = index;
+                    paused = false;
+                }
+            } else if (segment.type == SEGMENT_BUSY) {
+                if (acked <= index && index <= nextIndex) {
+                    nextIndex = index;
+                    paused = true;
+                }
+            } else if (segment.type == SEGMENT_TYPE_DATA) {
+                // The last ACK may have been lost with the final message right behind it
+                this.rxSeq = (segment.seq + 1) & 0xff;
+                await this.send(SEGMENT_ACK, this.rxSeq);
+                response = segment.data;
+                break;
+            }
+        }
+
+        this.txSeq = (baseSeq + payloads.length) & 0xff;
+        onProgress?.({ ackedBytes: totalBytes, totalBytes, elapsedMs: performance.now() - start, resent });
+
+        return response ?? await this.receiveMessage(VERIFY_TIMEOUT);
+    }
+}
+
+// Right after sync: try each candidate from the fastest, keep the first one whose probe comes back intact.
+// Returns the baud rate both sides ended up on.
+export async function negotiateBaudRate(link: SerialLink, candidates: number[] = BAUD_RATE_CANDIDATES): Promise<number> {
+    const previousBaudRate = link.baudRate;
+
+    for (const baudRate of candidates) {
+        let res: Uint8Array;
+        try {
+            res = await link.request(new Uint8Array([BL_AL_MESSAGE_BAUD_REQ, ...uint32LE(baudRate)]),
+                BL_AL_MESSAGE_BAUD_RES, BAUD_PROBE_TIMEOUT);
+        } catch {
+            break; // Old bootloader or a broken link, stay where we are
+        }
+        if (res[1] != 1) {
+            continue;
+        }
+
+        await link.reopen(baudRate);
+        const probe = new Uint8Array([BL_AL_MESSAGE_BAUD_PROBE, ...BAUD_PROBE_PATTERN]);
+        await link.sendMessage(probe);
+
+        const echo = await link.receiveMessage(BAUD_PROBE_TIMEOUT);
+        if (echo && echo.length == probe.length && probe.every((b, i) => echo[i] == b)) {
+            console.log(`Link running at ${baudRate} baud`);
+            return baudRate;
+        }
+
+        // The bootloader falls back on its own once it times out, wait for that before going back
+        console.warn(`Probe at ${baudRate} baud failed, falling back`);
+        await link.reopen(previousBaudRate);
+        await new Promise((resolve) => setTimeout(resolve, BAUD_PROBE_TIMEOUT * 2));
+    }
+
+    return link.baudRate;
+}
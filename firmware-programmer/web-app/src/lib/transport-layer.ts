@@ -0,0 +1,328 @@
+// Host side of the bootloader transport layer, mirrors firmware-bootloader/inc/transport-layer.h.
+// Wire format only, the port itself is driven by SerialLink in serial-link.ts.
+
+// Largest payload we would like to use, the bootloader advertises its own limit in FW_LENGTH_REQ
+export const SEGMENT_DATA_SIZE = 128;
+export const SEGMENT_HEADER_SIZE = 3; // size + type + seq
+export const SEGMENT_CRC_SIZE = 1;
+
+// Only the used data bytes go on the wire
+export function segmentWireLength(dataSize: number): number {
+    return SEGMENT_HEADER_SIZE + dataSize + SEGMENT_CRC_SIZE;
+}
+
+// Each segment is one COBS frame ending in TL_FRAME_DELIMITER, see SEGMENT_FRAME_LENGTH in transport-layer.h.
+// Segments are shorter than 254 bytes, so the frame is always exactly TL_FRAME_OVERHEAD bytes longer.
+const TL_FRAME_DELIMITER = 0x00;
+const TL_FRAME_OVERHEAD = 2;
+
+export function segmentFrameLength(dataSize: number): number {
+    return segmentWireLength(dataSize) + TL_FRAME_OVERHEAD;
+}
+
+export const SEGMENT_TYPE_DATA = 0x00;
+export const SEGMENT_RETX = 0x01;
+export const SEGMENT_ACK = 0x02;
+export const SEGMENT_DATA_RLE = 0x03;
+export const SEGMENT_BUSY = 0x04; // Bootloader queue full, wait for its RETX before sending again
+
+// RLE token layout, see RLE_RUN_FLAG in transport-layer.h
+const RLE_RUN_FLAG = 0x80;
+const RLE_MIN_RUN = 3;
+const RLE_MAX_RUN = 0x7f + RLE_MIN_RUN;
+const RLE_MAX_LITERAL = 128;
+
+export const TL_WINDOW_SIZE = 4;
+
+export const BL_AL_MESSAGE_SEQ_OBSERVED = 0x20;
+export const BL_AL_MESSAGE_FW_UPDATE_REQ = 0x31;
+export const BL_AL_MESSAGE_FW_UPDATE_RES = 0x37;
+export const BL_AL_MESSAGE_DEVICE_ID_REQ = 0x3c;
+export const BL_AL_MESSAGE_DEVICE_ID_RES = 0x3f;
+export const BL_AL_MESSAGE_FW_LENGTH_REQ = 0x42;
+export const BL_AL_MESSAGE_FW_LENGTH_RES = 0x45;
+export const BL_AL_MESSAGE_READY_FOR_DATA = 0x48;
+export const BL_AL_MESSAGE_UPDATE_SUCCESSFUL = 0x54;
+export const BL_AL_MESSAGE_NACK = 0x59;
+export const BL_AL_MESSAGE_BAUD_REQ = 0x4b;
+export const BL_AL_MESSAGE_BAUD_RES = 0x4e;
+export const BL_AL_MESSAGE_BAUD_PROBE = 0x51;
+
+export const SYNC_SEQUENCE = new Uint8Array([0x01, 0x02, 0x03, 0x04]);
+export const DEVICE_ID = 0x01;
+
+// Baud rate negotiation, see BAUD_PROBE_TIMEOUT in firmware-bootloader.c
+export const DEFAULT_BAUD_RATE = 115200;
+export const BAUD_RATE_CANDIDATES = [2000000, 1000000, 921600, 460800, 230400];
+export const BAUD_PROBE_PATTERN = [0x00, 0xff, 0x55, 0xaa, 0x0f, 0xf0, 0x33, 0xcc];
+export const BAUD_PROBE_TIMEOUT = 500;
+
+// Payload size to use given the bootloader's advertised maximum, words only
+export function negotiatePayloadSize(advertised: number): number {
+    return Math.min(SEGMENT_DATA_SIZE, advertised) & ~3;
+}
+
+export function crc8(data: Uint8Array, length: number): number {
+    let crc = 0;
+
+    for (let i = 0; i < length; i++) {
+        crc ^= data[i];
+
+        for (let j = 0; j < 8; j++) {
+            if (crc & 0x80) {
+                crc = ((crc << 1) ^ 0x07) & 0xFF;
+            } else {
+                crc = (crc << 1) & 0xFF;
+            }
+        }
+    }
+
+    return crc & 0xFF;
+}
+
+// CRC-32 (IEEE 802.3), same as crc32() in shared/src/core/crc32.c
+export function crc32(data: Uint8Array): number {
+    let crc = 0xFFFFFFFF;
+
+    for (let i = 0; i < data.length; i++) {
+        crc ^= data[i];
+
+        for (let j = 0; j < 8; j++) {
+            crc = (crc & 1) ? ((crc >>> 1) ^ 0xEDB88320) : (crc >>> 1);
+        }
+    }
+
+    return (crc ^ 0xFFFFFFFF) >>> 0;
+}
+
+export function uint32LE(value: number): number[] {
+    return [value & 0xff, (value >>> 8) & 0xff, (value >>> 16) & 0xff, (value >>> 24) & 0xff];
+}
+
+function readUint32LE(bytes: Uint8Array, index: number): number {
+    return (bytes[index] | (bytes[index + 1] << 8) | (bytes[index + 2] << 16) | (bytes[index + 3] << 24)) >>> 0;
+}
+
+// Where an interrupted update got to: [FW_LENGTH_REQ, max payload, window, offset, CRC-32 up to it]
+export type ResumeOffer = {
+    offset: number; // 0 when there is nothing to continue, older bootloaders never offer
+    crc: number;
+};
+
+export function resumeOffer(lengthReq: Uint8Array): ResumeOffer {
+    if (lengthReq.length < 11) {
+        return { offset: 0, crc: 0 };
+    }
+    return { offset: readUint32LE(lengthReq, 3), crc: readUint32LE(lengthReq, 7) };
+}
+
+// Offset to continue from, only if the bootloader holds the same bytes as our image up to there
+export function resumeOffset(image: Uint8Array, offer: ResumeOffer): number {
+    if (offer.offset == 0 || offer.offset >= image.length) {
+        return 0;
+    }
+    return crc32(image.subarray(0, offer.offset)) == offer.crc ? offer.offset : 0;
+}
+
+// BL_AL_MESSAGE_FW_LENGTH_RES: image length and the CRC-32 the bootloader checks the whole image against, plus the
+// offset to resume from if there is one
+export function firmwareLengthRes(image: Uint8Array, offset: number = 0): Uint8Array {
+    return new Uint8Array([
+        BL_AL_MESSAGE_FW_LENGTH_RES,
+        ...uint32LE(image.length),
+        ...uint32LE(crc32(image)),
+        ...(offset ? uint32LE(offset) : []),
+    ]);
+}
+
+// [READY_FOR_DATA, offset], where the first data segment has to start
+export function readyOffset(ready: Uint8Array): number {
+    return ready.length >= 5 ? readUint32LE(ready, 1) : 0;
+}
+
+// COBS: every zero is replaced by the distance to the next one, the first distance leads the frame
+function cobsEncode(data: Uint8Array): Uint8Array {
+    const frame = new Uint8Array(data.length + TL_FRAME_OVERHEAD);
+    let codeIndex = 0;
+    let out = 1;
+
+    for (const byte of data) {
+        if (byte == 0) {
+            frame[codeIndex] = out - codeIndex;
+            codeIndex = out++;
+        } else {
+            frame[out++] = byte;
+        }
+    }
+    frame[codeIndex] = out - codeIndex;
+    frame[out++] = TL_FRAME_DELIMITER;
+
+    return frame.subarray(0, out);
+}
+
+// One frame without its delimiter, null if it is malformed
+function cobsDecode(frame: Uint8Array): Uint8Array | null {
+    const data: number[] = [];
+    let i = 0;
+
+    while (i < frame.length) {
+        const code = frame[i];
+        if (code == 0 || i + code > frame.length + 1) {
+            return null;
+        }
+        data.push(...frame.subarray(i + 1, i + code));
+        i += code;
+        if (code != 0xff && i < frame.length) {
+            data.push(0);
+        }
+    }
+
+    return new Uint8Array(data);
+}
+
+export type Segment = {
+    type: number;
+    seq: number;
+    data: Uint8Array;
+};
+
+// One segment as a complete frame, delimiter included
+export function encodeSegment(type: number, seq: number, data: Uint8Array = new Uint8Array(0)): Uint8Array {
+    const length = segmentWireLength(data.length);
+    const segment = new Uint8Array(length);
+    segment[0] = data.length;
+    segment[1] = type;
+    segment[2] = seq & 0xff;
+    segment.set(data, SEGMENT_HEADER_SIZE);
+    segment[length - 1] = crc8(segment, length - 1);
+    return cobsEncode(segment);
+}
+
+// One frame without its delimiter, null if it is cut off or fails the CRC
+export function decodeFrame(frame: Uint8Array): Segment | null {
+    const segment = cobsDecode(frame);
+    if (!segment || segment.length < SEGMENT_HEADER_SIZE + SEGMENT_CRC_SIZE) {
+        return null;
+    }
+
+    const length = segment.length - SEGMENT_CRC_SIZE;
+    if (segment[0] != length - SEGMENT_HEADER_SIZE || segment[length] != crc8(segment, length)) {
+        return null;
+    }
+
+    return { type: segment[1], seq: segment[2], data: segment.subarray(SEGMENT_HEADER_SIZE, length) };
+}
+
+// Splits the byte stream into frames, chunks may end anywhere. Bytes of an unfinished frame are kept for the next push.
+export class FrameParser {
+    badFrames = 0;
+    private pending = new Uint8Array(0);
+
+    push(chunk: Uint8Array, onSegment: (segment: Segment) => void) {
+        const bytes = new Uint8Array(this.pending.length + chunk.length);
+        bytes.set(this.pending);
+        bytes.set(chunk, this.pending.length);
+
+        let start = 0;
+        for (let end = bytes.indexOf(TL_FRAME_DELIMITER); end >= 0; end = bytes.indexOf(TL_FRAME_DELIMITER, start)) {
+            if (end > start) {
+                const segment = decodeFrame(bytes.subarray(start, end));
+                if (segment) {
+                    onSegment(segment);
+                } else {
+                    this.badFrames++;
+                }
+            }
+            start = end + 1;
+        }
+
+        // Longer than any frame means its delimiter got lost, drop it and wait for the next one
+        this.pending = bytes.slice(start);
+        if (this.pending.length > segmentFrameLength(SEGMENT_DATA_SIZE)) {
+            this.badFrames++;
+            this.pending = new Uint8Array(0);
+        }
+    }
+
+    reset() {
+        this.pending = new Uint8Array(0);
+    }
+}
+
+// Splits the image into RLE payloads of at most payloadSize bytes, tokens never cross a payload
+export function rleEncode(image: Uint8Array, payloadSize: number): Uint8Array[] {
+    const maxLiteral = Math.min(RLE_MAX_LITERAL, payloadSize - 1);
+    const tokens: Uint8Array[] = [];
+    let literalStart = 0;
+
+    const flushLiteral = (end: number) => {
+        while (literalStart < end) {
+            const length = Math.min(maxLiteral, end - literalStart);
+            const token = new Uint8Array(length + 1);
+            token[0] = length - 1;
+            token.set(image.subarray(literalStart, literalStart + length), 1);
+            tokens.push(token);
+            literalStart += length;
+        }
+    };
+
+    let i = 0;
+    while (i < image.length) {
+        let run = 1;
+        while (i + run < image.length && run < RLE_MAX_RUN && image[i + run] == image[i]) {
+            run++;
+        }
+
+        if (run >= RLE_MIN_RUN) {
+            flushLiteral(i);
+            tokens.push(new Uint8Array([RLE_RUN_FLAG | (run - RLE_MIN_RUN), image[i]]));
+            i += run;
+            literalStart = i;
+        } else {
+            i += run;
+        }
+    }
+    flushLiteral(image.length);
+
+    const payloads: Uint8Array[] = [];
+    let current: number[] = [];
+    for (const token of tokens) {
+        if (current.length + token.length > payloadSize) {
+            payloads.push(new Uint8Array(current));
+            current = [];
+        }
+        current.push(...token);
+    }
+    if (current.length > 0) {
+        payloads.push(new Uint8Array(current));
+    }
+
+    return payloads;
+}
+
+// Image bytes an RLE payload expands to
+export function rleDecodedLength(payload: Uint8Array): number {
+    let length = 0;
+
+    for (let i = 0; i < payload.length;) {
+        const control = payload[i];
+        if (control & RLE_RUN_FLAG) {
+            length += (control & 0x7f) + RLE_MIN_RUN;
+            i += 2;
+        } else {
+            length += control + 1;
+            i += control + 2;
+        }
+    }
+
+    return length;
+}
+
+export function toHexString(bytes: Uint8Array) {
+  	return Array
+		.from(bytes)
+		.map((b) => b.toString(16)
+		.toUpperCase()
+		.padStart(2, "0"))
+    	.join(" ");
+}
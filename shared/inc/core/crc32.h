@@ -0,0 +1,17 @@
+#ifndef INC_CRC32_H
+#define INC_CRC32_H
+
+#include "common-defines.h"
+
+// CRC-32 (IEEE 802.3, reflected, poly 0x04C11DB7). Check value: "123456789" -> 0xCBF43926
+// Built with CRC32_HARDWARE it runs on the STM32L0 CRC peripheral, otherwise a 16-entry table is used.
+#define CRC32_INIT (0xFFFFFFFFU)
+#define CRC32_FINAL_XOR (0xFFFFFFFFU)
+
+void CRC32_Init(void);
+
+// Running form: start from CRC32_INIT, feed any number of chunks, XOR with CRC32_FINAL_XOR at the end
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t length);
+uint32_t crc32(const uint8_t* data, uint32_t length);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "common-defines.h"
 
+// CRC-8 (poly 0x07, init 0x00), same as crc8() in the web programmer. Check value: "123456789" -> 0xF4
 uint8_t crc8(uint8_t* data, uint32_t length);
 
 #endif
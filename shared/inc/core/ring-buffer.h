@@ -3,11 +3,14 @@
 
 #include "common-defines.h"
 
+// Single producer / single consumer, e.g. an ISR writing and the main loop reading.
+// Each index is only ever stored by its own side. The data is written before write_index is published and
+// read before read_index is released (compiler fence, enough on the single-core M0+), so no locking is needed.
 typedef struct ring_buffer_t {
     uint8_t* buffer;
     uint32_t mask;
-    uint32_t read_index;
-    uint32_t write_index;
+    volatile uint32_t read_index;
+    volatile uint32_t write_index;
 } ring_buffer_t;
 
 void ring_buffer_setup(ring_buffer_t* rb, uint8_t* buffer, uint32_t size);
@@ -15,4 +18,11 @@ bool ring_buffer_empty(ring_buffer_t* rb);
 bool ring_buffer_write(ring_buffer_t* rb, uint8_t byte);
 bool ring_buffer_read(ring_buffer_t* rb, uint8_t* byte);
 
+// Bulk access: the span functions return how many bytes are contiguous at *data (0 if none),
+// commit/consume then publish the bytes written to / release the bytes read from that span.
+uint32_t ring_buffer_write_span(ring_buffer_t* rb, uint8_t** data);
+void ring_buffer_commit(ring_buffer_t* rb, uint32_t count);
+uint32_t ring_buffer_read_span(ring_buffer_t* rb, const uint8_t** data);
+void ring_buffer_consume(ring_buffer_t* rb, uint32_t count);
+
 #endif
@@ -3,6 +3,13 @@
 
 #include "common-defines.h"
 
+typedef struct uart_stats_t {
+    uint32_t overruns;       // Bytes the USART lost before they were read out of RDR
+    uint32_t dropped;        // Bytes received but lost because the reader fell behind
+    uint32_t framing_errors; // Bytes received without a stop bit, passed on as they are for the CRC to catch
+    uint32_t noise_errors;   // Bytes with noise on a sampled bit, passed on likewise
+} uart_stats_t;
+
 void UART_Init(void);
 void uart_write(uint8_t* data, const uint32_t length);
 void uart_write_byte(uint8_t data);
@@ -10,5 +17,11 @@ uint32_t uart_read(uint8_t* data, const uint32_t length);
 uint8_t uart_read_byte(void);
 bool uart_data_available(void);
 void UART_Init_Reset(void);
+void uart_get_stats(uart_stats_t* out);
+bool uart_baudrate_supported(uint32_t baud_rate);
+bool uart_set_baudrate(uint32_t baud_rate);
+uint32_t uart_get_baudrate(void);
+bool uart_tx_busy(void);
+void uart_flush(void);
 
 #endif
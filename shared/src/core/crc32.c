@@ -0,0 +1,57 @@
+#include "core/crc32.h"
+
+#if defined(CRC32_HARDWARE)
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/crc.h>
+
+// The peripheral shifts MSB first, its register holds the bit-reverse of our running value
+static uint32_t crc32_reflect(uint32_t value) {
+    value = ((value >> 1) & 0x55555555U) | ((value & 0x55555555U) << 1);
+    value = ((value >> 2) & 0x33333333U) | ((value & 0x33333333U) << 2);
+    value = ((value >> 4) & 0x0F0F0F0FU) | ((value & 0x0F0F0F0FU) << 4);
+    value = ((value >> 8) & 0x00FF00FFU) | ((value & 0x00FF00FFU) << 8);
+    return (value >> 16) | (value << 16);
+}
+
+void CRC32_Init(void) {
+    rcc_periph_clock_enable(RCC_CRC);
+    CRC_CR = CRC_CR_REV_IN_BYTE | CRC_CR_REV_OUT; // Default 32-bit poly 0x04C11DB7, reflected in and out
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t length) {
+    CRC_INIT = crc32_reflect(crc);
+    CRC_CR |= CRC_CR_RESET;
+
+    for (uint32_t i = 0; i < length; i++) {
+        *(volatile uint8_t*)&CRC_DR = data[i];
+    }
+
+    return CRC_DR;
+}
+
+#else
+
+static const uint32_t crc32_table[16] = {
+    0x00000000U, 0x1db71064U, 0x3b6e20c8U, 0x26d930acU, 0x76dc4190U, 0x6b6b51f4U, 0x4db26158U, 0x5005713cU,
+    0xedb88320U, 0xf00f9344U, 0xd6d6a3e8U, 0xcb61b38cU, 0x9b64c2b0U, 0x86d3d2d4U, 0xa00ae278U, 0xbdbdf21cU,
+};
+
+void CRC32_Init(void) {
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ crc32_table[crc & 0x0F];
+        crc = (crc >> 4) ^ crc32_table[crc & 0x0F];
+    }
+
+    return crc;
+}
+
+#endif
+
+uint32_t crc32(const uint8_t* data, uint32_t length) {
+    return crc32_update(CRC32_INIT, data, length) ^ CRC32_FINAL_XOR;
+}
@@ -1,5 +1,7 @@
 #include "core/ring-buffer.h"
 
+#include <stdatomic.h>
+
 void ring_buffer_setup(ring_buffer_t* rb, uint8_t* buffer, uint32_t size) {
     rb->buffer = buffer;
     rb->read_index = 0;
@@ -19,8 +21,10 @@ bool ring_buffer_read(ring_buffer_t* rb, uint8_t* byte) {
         return false;
     }
 
+    atomic_signal_fence(memory_order_acquire); // Read the byte only after seeing write_index
     *byte = rb->buffer[local_read_index];
     local_read_index = (local_read_index + 1) & rb->mask; // Round value back to zero if variable went to the end
+    atomic_signal_fence(memory_order_release); // Done with the byte before the producer may reuse it
     rb->read_index = local_read_index;
     
     return true;
@@ -37,7 +41,42 @@ bool ring_buffer_write(ring_buffer_t* rb, uint8_t byte) {
     }
 
     rb->buffer[local_write_index] = byte;
+    atomic_signal_fence(memory_order_release); // Byte is in place before the consumer can see it
     rb->write_index = next_wirte_index;
 
     return true;
 }
+
+uint32_t ring_buffer_write_span(ring_buffer_t* rb, uint8_t** data) {
+    uint32_t local_write_index = rb->write_index;
+    uint32_t local_read_index = rb->read_index;
+
+    // One slot always stays free to tell full from empty
+    uint32_t space = (local_read_index - local_write_index - 1) & rb->mask;
+    uint32_t to_end = rb->mask + 1 - local_write_index;
+
+    *data = &rb->buffer[local_write_index];
+    return (space < to_end) ? space : to_end;
+}
+
+void ring_buffer_commit(ring_buffer_t* rb, uint32_t count) {
+    atomic_signal_fence(memory_order_release);
+    rb->write_index = (rb->write_index + count) & rb->mask;
+}
+
+uint32_t ring_buffer_read_span(ring_buffer_t* rb, const uint8_t** data) {
+    uint32_t local_read_index = rb->read_index;
+    uint32_t local_write_index = rb->write_index;
+
+    uint32_t used = (local_write_index - local_read_index) & rb->mask;
+    uint32_t to_end = rb->mask + 1 - local_read_index;
+
+    atomic_signal_fence(memory_order_acquire);
+    *data = &rb->buffer[local_read_index];
+    return (used < to_end) ? used : to_end;
+}
+
+void ring_buffer_consume(ring_buffer_t* rb, uint32_t count) {
+    atomic_signal_fence(memory_order_release);
+    rb->read_index = (rb->read_index + count) & rb->mask;
+}
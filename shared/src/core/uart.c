@@ -1,13 +1,200 @@
 #include "libopencm3/stm32/rcc.h"
 #include "libopencm3/stm32/l0/usart.h"
+#include "libopencm3/stm32/dma.h"
 #include "libopencm3/cm3/nvic.h"
+#include "libopencm3/cm3/cortex.h"
 
 #include "core/uart.h"
 #include "core/ring-buffer.h"
 
-#define BAUD_RATE (115200)
+#include "string.h"
+
+#define BAUD_RATE (115200) // Until the host negotiates a faster one
+#define UART_CLOCK (32000000U)
+#define UART_BRR_MIN (16U) // 16x oversampling, so at most UART_CLOCK / 16 = 2 Mbaud
+#define UART_BRR_MAX (0xFFFFU)
+#define UART_BRR(baud_rate) ((UART_CLOCK + (baud_rate) / 2U) / (baud_rate)) // Rounded to the nearest divider
 #define RING_BUFFER_SIZE (128)
 
+static uart_stats_t stats = {0U};
+static uint32_t baud_rate_current = BAUD_RATE;
+
+#if defined(UART_RX_DMA) || defined(UART_TX_DMA)
+#define UART_DMA
+#endif
+
+#if defined(UART_RX_DMA)
+
+// USART2_RX is request 4 on DMA1 channel 5
+#define UART_RX_DMA_CHANNEL (DMA_CHANNEL5)
+#define UART_RX_DMA_REQUEST (4U)
+// Power of two, a full window (4 x 134 Byte frames) must fit while the core is stalled on flash. Builds with a
+// larger TL_WINDOW_SIZE pass their own
+#ifndef UART_RX_DMA_BUFFER_SIZE
+#define UART_RX_DMA_BUFFER_SIZE (1024)
+#endif
+
+// The longest the core goes without taking the DMA interrupt: a half-page program runs from RAM with interrupts
+// masked and a page erase stalls every flash fetch, 3.2 ms each on the L053. The DMA may wrap at most once in that
+// time, a second wrap sets the same TC flag again and uart_rx_dma_update counts one lap for both
+#define UART_RX_MAX_MASKED_US (3200U)
+#define UART_BAUD_RATE_MAX (UART_CLOCK / UART_BRR_MIN)
+_Static_assert((UART_BAUD_RATE_MAX / 10U) * UART_RX_MAX_MASKED_US / 1000000U < UART_RX_DMA_BUFFER_SIZE,
+               "UART_RX_DMA_BUFFER_SIZE fills before a flash stall at the fastest baud rate is over");
+
+static uint8_t dma_buffer[UART_RX_DMA_BUFFER_SIZE] = {0U};
+
+// Both only grow and wrap at 2^32, their difference is the number of unread bytes
+static volatile uint32_t rx_received = 0U; // Bytes the DMA wrote, as of the last update
+static uint32_t rx_consumed = 0U;
+static uint32_t rx_dma_laps = 0U; // TC events, times the DMA wrapped round the buffer
+
+// From an interrupt or with interrupts masked. The write index alone cannot tell a lap from no progress, so every
+// TC is counted here and rx_received is laps * size + index
+static void uart_rx_dma_update(void) {
+    bool wrapped;
+    uint32_t dma_index;
+    do {
+        // A TC seen before the index was read is a wrap before that index. If it only shows up afterwards the index
+        // may be from either side of the wrap, read it again
+        wrapped = dma_get_interrupt_flag(DMA1, UART_RX_DMA_CHANNEL, DMA_TCIF);
+        dma_index = (UART_RX_DMA_BUFFER_SIZE - DMA_CNDTR(DMA1, UART_RX_DMA_CHANNEL)) & (UART_RX_DMA_BUFFER_SIZE - 1);
+    } while (!wrapped && dma_get_interrupt_flag(DMA1, UART_RX_DMA_CHANNEL, DMA_TCIF));
+
+    if (wrapped) {
+        dma_clear_interrupt_flags(DMA1, UART_RX_DMA_CHANNEL, DMA_TCIF);
+        rx_dma_laps++;
+    }
+
+    const uint32_t received = rx_dma_laps * UART_RX_DMA_BUFFER_SIZE + dma_index;
+    if ((int32_t)(received - rx_received) < 0) {
+        // Behind the last update, a TC went missing. Nothing in the buffer can be trusted, start over from here
+        stats.dropped += rx_received - rx_consumed;
+        rx_consumed = received;
+    }
+    rx_received = received;
+}
+
+static void uart_rx_dma_isr(void) {
+    if (dma_get_interrupt_flag(DMA1, UART_RX_DMA_CHANNEL, DMA_HTIF | DMA_TCIF)) {
+        dma_clear_interrupt_flags(DMA1, UART_RX_DMA_CHANNEL, DMA_HTIF);
+        uart_rx_dma_update();
+    }
+}
+
+void usart2_isr(void) {
+    if (usart_get_flag(USART2, USART_FLAG_ORE) == 1) {
+        USART_ICR(USART2) = USART_ICR_ORECF;
+        stats.overruns++;
+    }
+
+    // With EIE a framing error or noise interrupts too and keeps doing so until its flag is cleared
+    if (usart_get_flag(USART2, USART_FLAG_FE) == 1) {
+        USART_ICR(USART2) = USART_ICR_FECF;
+        stats.framing_errors++;
+    }
+    if (usart_get_flag(USART2, USART_FLAG_NF) == 1) {
+        USART_ICR(USART2) = USART_ICR_NCF;
+        stats.noise_errors++;
+    }
+
+    // Line went quiet, hand over whatever arrived since the last half/full transfer
+    if (usart_get_flag(USART2, USART_FLAG_IDLE) == 1) {
+        USART_ICR(USART2) = USART_ICR_IDLECF;
+        uart_rx_dma_update();
+    }
+}
+
+static void UART_Init_RX(void) {
+    rx_received = 0U;
+    rx_consumed = 0U;
+    rx_dma_laps = 0U;
+
+    dma_channel_reset(DMA1, UART_RX_DMA_CHANNEL);
+    dma_clear_interrupt_flags(DMA1, UART_RX_DMA_CHANNEL, DMA_HTIF | DMA_TCIF);
+    dma_set_channel_request(DMA1, UART_RX_DMA_CHANNEL, UART_RX_DMA_REQUEST);
+    dma_set_peripheral_address(DMA1, UART_RX_DMA_CHANNEL, (uint32_t)&USART_RDR(USART2));
+    dma_set_memory_address(DMA1, UART_RX_DMA_CHANNEL, (uint32_t)dma_buffer);
+    dma_set_number_of_data(DMA1, UART_RX_DMA_CHANNEL, UART_RX_DMA_BUFFER_SIZE);
+    dma_set_read_from_peripheral(DMA1, UART_RX_DMA_CHANNEL);
+    dma_enable_memory_increment_mode(DMA1, UART_RX_DMA_CHANNEL);
+    dma_set_peripheral_size(DMA1, UART_RX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(DMA1, UART_RX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+    dma_set_priority(DMA1, UART_RX_DMA_CHANNEL, DMA_CCR_PL_HIGH);
+    dma_enable_circular_mode(DMA1, UART_RX_DMA_CHANNEL);
+    dma_enable_half_transfer_interrupt(DMA1, UART_RX_DMA_CHANNEL);
+    dma_enable_transfer_complete_interrupt(DMA1, UART_RX_DMA_CHANNEL);
+    dma_enable_channel(DMA1, UART_RX_DMA_CHANNEL);
+
+    usart_enable_rx_dma(USART2);
+    USART_CR1(USART2) |= USART_CR1_IDLEIE;
+    USART_CR3(USART2) |= USART_CR3_EIE; // Overrun, framing error and noise raise an interrupt without RXNEIE
+}
+
+static void UART_Init_Reset_RX(void) {
+    USART_CR1(USART2) &= ~USART_CR1_IDLEIE;
+    USART_CR3(USART2) &= ~USART_CR3_EIE;
+    usart_disable_rx_dma(USART2);
+    dma_disable_channel(DMA1, UART_RX_DMA_CHANNEL);
+    dma_channel_reset(DMA1, UART_RX_DMA_CHANNEL);
+}
+
+// Unread bytes, or 0 after the DMA lapped the reader and the lost bytes are dropped. As of the last update
+static uint32_t uart_rx_pending(void) {
+    uint32_t pending = rx_received - rx_consumed;
+
+    if (pending > UART_RX_DMA_BUFFER_SIZE) {
+        stats.dropped += pending;
+        rx_consumed = rx_received;
+        pending = 0U;
+    }
+
+    return pending;
+}
+
+// Takes in what the DMA wrote since the last interrupt, rx_received alone lags by up to half a buffer
+static void uart_rx_dma_sample(void) {
+    const uint32_t masked = cm_mask_interrupts(1);
+    uart_rx_dma_update();
+    cm_mask_interrupts(masked);
+}
+
+uint32_t uart_read(uint8_t* data, const uint32_t length) {
+    uart_rx_dma_sample();
+    uint32_t count = uart_rx_pending();
+    if (count > length) {
+        count = length;
+    }
+
+    // At most two copies, up to the end of the buffer and from its start
+    const uint32_t index = rx_consumed & (UART_RX_DMA_BUFFER_SIZE - 1);
+    const uint32_t first = (count < UART_RX_DMA_BUFFER_SIZE - index) ? count : UART_RX_DMA_BUFFER_SIZE - index;
+    memcpy(data, &dma_buffer[index], first);
+    memcpy(&data[first], dma_buffer, count - first);
+
+    // The DMA may have come round again onto the bytes just copied, they are lost then, not handed over torn
+    uart_rx_dma_sample();
+    if (rx_received - rx_consumed > UART_RX_DMA_BUFFER_SIZE) {
+        count = 0U;
+    }
+    rx_consumed += count;
+
+    return count;
+}
+
+bool uart_data_available(void) {
+    return uart_rx_pending() > 0U;
+}
+
+static void uart_rx_discard(void) {
+    const uint32_t masked = cm_mask_interrupts(1);
+    uart_rx_dma_update();
+    rx_consumed = rx_received;
+    cm_mask_interrupts(masked);
+}
+
+#else
+
 static ring_buffer_t rb = {0U};
 static uint8_t data_buffer[RING_BUFFER_SIZE] = {0U};
 
@@ -15,56 +202,268 @@ void usart2_isr(void) {
     const bool overrun_occurred = usart_get_flag(USART2, USART_FLAG_ORE) == 1;
     const bool received_data = usart_get_flag(USART2, USART_FLAG_RXNE) == 1;
 
+    if (overrun_occurred) {
+        USART_ICR(USART2) = USART_ICR_ORECF;
+        stats.overruns++;
+    }
+
+    // Only counted, EIE is off so the flags do not interrupt on their own. The byte in RDR is read as usual
+    if (usart_get_flag(USART2, USART_FLAG_FE) == 1) {
+        USART_ICR(USART2) = USART_ICR_FECF;
+        stats.framing_errors++;
+    }
+    if (usart_get_flag(USART2, USART_FLAG_NF) == 1) {
+        USART_ICR(USART2) = USART_ICR_NCF;
+        stats.noise_errors++;
+    }
+
     if (received_data || overrun_occurred) {
-        if (ring_buffer_write(&rb, (uint8_t)usart_recv(USART2))) {
-            // Handle error
+        if (!ring_buffer_write(&rb, (uint8_t)usart_recv(USART2))) {
+            stats.dropped++;
         }
     }
 }
 
-void UART_Init(void) {
+static void UART_Init_RX(void) {
     ring_buffer_setup(&rb, data_buffer, RING_BUFFER_SIZE);
+    usart_enable_rx_interrupt(USART2);
+}
+
+static void UART_Init_Reset_RX(void) {
+    usart_disable_rx_interrupt(USART2);
+}
+
+uint32_t uart_read(uint8_t* data, const uint32_t length) {
+    uint32_t bytes_read = 0;
+
+    // At most two spans, up to the end of the buffer and from its start
+    while (bytes_read < length) {
+        const uint8_t* span;
+        uint32_t count = ring_buffer_read_span(&rb, &span);
+        if (count == 0) {
+            break;
+        }
+
+        if (count > length - bytes_read) {
+            count = length - bytes_read;
+        }
+        memcpy(&data[bytes_read], span, count);
+        ring_buffer_consume(&rb, count);
+        bytes_read += count;
+    }
+
+    return bytes_read;
+}
+
+bool uart_data_available(void) {
+    return !ring_buffer_empty(&rb);
+}
+
+static void uart_rx_discard(void) {
+    rb.read_index = rb.write_index;
+}
+
+#endif
+
+#if defined(UART_TX_DMA)
+
+// USART2_TX is request 4 on DMA1 channel 4
+#define UART_TX_DMA_CHANNEL (DMA_CHANNEL4)
+#define UART_TX_DMA_REQUEST (4U)
+#define UART_TX_BUFFER_SIZE (256) // Power of two, holds a full segment with room to spare
+
+static uint8_t tx_buffer[UART_TX_BUFFER_SIZE] = {0U};
+
+// Free-running like rx_received / rx_consumed, queued is only written by uart_write, sent only by the ISR
+static volatile uint32_t tx_queued = 0U;
+static volatile uint32_t tx_sent = 0U;
+static volatile uint32_t tx_in_flight = 0U; // Length of the running DMA transfer, 0 when idle
+
+// Interrupts must be masked or we are in the DMA ISR
+static void uart_tx_dma_start(void) {
+    const uint32_t pending = tx_queued - tx_sent;
+
+    if ((tx_in_flight != 0U) || (pending == 0U)) {
+        return;
+    }
+
+    // One contiguous span per transfer, the ISR starts the part that wrapped around
+    const uint32_t index = tx_sent & (UART_TX_BUFFER_SIZE - 1);
+    const uint32_t span = (pending < UART_TX_BUFFER_SIZE - index) ? pending : UART_TX_BUFFER_SIZE - index;
+
+    dma_disable_channel(DMA1, UART_TX_DMA_CHANNEL);
+    dma_set_memory_address(DMA1, UART_TX_DMA_CHANNEL, (uint32_t)&tx_buffer[index]);
+    dma_set_number_of_data(DMA1, UART_TX_DMA_CHANNEL, (uint16_t)span);
+    tx_in_flight = span;
+    dma_enable_channel(DMA1, UART_TX_DMA_CHANNEL);
+}
+
+static void uart_tx_kick(void) {
+    const uint32_t masked = cm_mask_interrupts(1);
+    uart_tx_dma_start();
+    cm_mask_interrupts(masked);
+}
+
+static void uart_tx_dma_isr(void) {
+    if (dma_get_interrupt_flag(DMA1, UART_TX_DMA_CHANNEL, DMA_TCIF)) {
+        dma_clear_interrupt_flags(DMA1, UART_TX_DMA_CHANNEL, DMA_TCIF);
+        tx_sent += tx_in_flight;
+        tx_in_flight = 0U;
+        uart_tx_dma_start();
+    }
+}
+
+static void UART_Init_TX(void) {
+    tx_queued = 0U;
+    tx_sent = 0U;
+    tx_in_flight = 0U;
+
+    dma_channel_reset(DMA1, UART_TX_DMA_CHANNEL);
+    dma_set_channel_request(DMA1, UART_TX_DMA_CHANNEL, UART_TX_DMA_REQUEST);
+    dma_set_peripheral_address(DMA1, UART_TX_DMA_CHANNEL, (uint32_t)&USART_TDR(USART2));
+    dma_set_read_from_memory(DMA1, UART_TX_DMA_CHANNEL);
+    dma_enable_memory_increment_mode(DMA1, UART_TX_DMA_CHANNEL);
+    dma_set_peripheral_size(DMA1, UART_TX_DMA_CHANNEL, DMA_CCR_PSIZE_8BIT);
+    dma_set_memory_size(DMA1, UART_TX_DMA_CHANNEL, DMA_CCR_MSIZE_8BIT);
+    dma_enable_transfer_complete_interrupt(DMA1, UART_TX_DMA_CHANNEL);
+
+    usart_enable_tx_dma(USART2);
+}
+
+static void UART_Init_Reset_TX(void) {
+    uart_flush();
+    usart_disable_tx_dma(USART2);
+    dma_disable_channel(DMA1, UART_TX_DMA_CHANNEL);
+    dma_channel_reset(DMA1, UART_TX_DMA_CHANNEL);
+}
+
+void uart_write(uint8_t* data, const uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        // Queue full, only happens for bursts larger than the buffer
+        while ((tx_queued - tx_sent) == UART_TX_BUFFER_SIZE) {
+            uart_tx_kick();
+        }
+
+        tx_buffer[tx_queued & (UART_TX_BUFFER_SIZE - 1)] = data[i];
+        tx_queued++;
+    }
+
+    uart_tx_kick();
+}
+
+void uart_write_byte(uint8_t data) {
+    uart_write(&data, 1);
+}
+
+bool uart_tx_busy(void) {
+    return tx_queued != tx_sent;
+}
+
+#else
+
+static void UART_Init_TX(void) {
+}
+
+static void UART_Init_Reset_TX(void) {
+    uart_flush();
+}
+
+void uart_write(uint8_t* data, const uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        uart_write_byte(data[i]);
+    }
+}
+
+void uart_write_byte(uint8_t data) {
+    usart_send_blocking(USART2, (uint16_t)data);
+}
+
+bool uart_tx_busy(void) {
+    return false;
+}
+
+#endif
+
+#if defined(UART_DMA)
+// RX and TX channels share one vector
+void dma1_channel4_7_isr(void) {
+#if defined(UART_RX_DMA)
+    uart_rx_dma_isr();
+#endif
+#if defined(UART_TX_DMA)
+    uart_tx_dma_isr();
+#endif
+}
+#endif
+
+void UART_Init(void) {
     rcc_periph_clock_enable(RCC_USART2);
     usart_set_flow_control(USART2, USART_FLOWCONTROL_NONE);
     usart_set_databits(USART2, 8);
-    *(volatile uint32_t*)(0X4000440CU) = (32000000U)/BAUD_RATE; // Setup baud rate
+    baud_rate_current = BAUD_RATE;
+    USART_BRR(USART2) = UART_BRR(baud_rate_current);
     usart_set_parity(USART2, USART_PARITY_NONE);
     usart_set_stopbits(USART2, USART_STOPBITS_1);
     usart_set_mode(USART2, USART_MODE_TX_RX);
-    usart_enable_rx_interrupt(USART2);
+#if defined(UART_DMA)
+    rcc_periph_clock_enable(RCC_DMA);
+    nvic_enable_irq(NVIC_DMA1_CHANNEL4_7_IRQ);
+#endif
+    UART_Init_RX();
+    UART_Init_TX();
     nvic_enable_irq(NVIC_USART2_IRQ);
     usart_enable(USART2);
 }
 
 void UART_Init_Reset(void) {
-    usart_disable_rx_interrupt(USART2);
+    // Let queued bytes (e.g. the last UPDATE_SUCCESSFUL) leave before the USART goes down
+    UART_Init_Reset_TX();
+    UART_Init_Reset_RX();
+#if defined(UART_DMA)
+    nvic_disable_irq(NVIC_DMA1_CHANNEL4_7_IRQ);
+    rcc_periph_clock_disable(RCC_DMA);
+#endif
     usart_disable(USART2);
     nvic_disable_irq(NVIC_USART2_IRQ);
     rcc_periph_clock_disable(RCC_USART2);
 }
 
-void uart_write(uint8_t* data, const uint32_t length) {
-    for (uint32_t i = 0; i < length; i++) {
-        uart_write_byte(data[i]);
+bool uart_baudrate_supported(uint32_t baud_rate) {
+    if (baud_rate == 0U) {
+        return false;
     }
-}
 
-void uart_write_byte(uint8_t data) {
-    usart_send_blocking(USART2, (uint16_t)data);
+    const uint32_t brr = UART_BRR(baud_rate);
+    return (brr >= UART_BRR_MIN) && (brr <= UART_BRR_MAX);
 }
 
-uint32_t uart_read(uint8_t* data, const uint32_t length) {
-    if (length <= 0) {
-        return 0;
+// Drains TX first, whatever was received at the old rate is discarded
+bool uart_set_baudrate(uint32_t baud_rate) {
+    if (!uart_baudrate_supported(baud_rate)) {
+        return false;
     }
 
-    for (uint32_t bytes_read = 0; bytes_read < length; bytes_read ++) {
-        if (!ring_buffer_read(&rb, &data[bytes_read])) {
-            return bytes_read;
-        }
+    uart_flush();
+    usart_disable(USART2);
+    USART_BRR(USART2) = UART_BRR(baud_rate);
+    baud_rate_current = baud_rate;
+    usart_enable(USART2);
+    uart_rx_discard();
+
+    return true;
+}
+
+uint32_t uart_get_baudrate(void) {
+    return baud_rate_current;
+}
+
+void uart_flush(void) {
+    while (uart_tx_busy()) {
     }
 
-    return length;
+    // Wait for the last byte to leave the shift register
+    while (usart_get_flag(USART2, USART_FLAG_TC) == 0) {
+    }
 }
 
 uint8_t uart_read_byte(void) {
@@ -73,6 +472,6 @@ uint8_t uart_read_byte(void) {
     return byte;
 }
 
-bool uart_data_available(void) {
-    return !ring_buffer_empty(&rb);
+void uart_get_stats(uart_stats_t* out) {
+    *out = stats;
 }